@@ -20,6 +20,15 @@ struct FRException : public std::runtime_error {
   std::string msg;
 };
 
+// thrown when a run is cancelled by its CancellationToken
+struct FRCancelled : public FRException {
+  // returns FRCancelled& so that `throw FRCancelled() << msg` is not sliced
+  template <typename T> FRCancelled &operator<<(const T &s) {
+    FRException::operator<<(s);
+    return *this;
+  }
+};
+
 #define CUBLAS_CHECK(...)                                                      \
   for (cublasStatus_t _cublas_check_status = (__VA_ARGS__);                    \
        _cublas_check_status != CUBLAS_STATUS_SUCCESS;)                         \
@@ -4,7 +4,6 @@ option(WITH_LAYER_batchnorm "" OFF)
 option(WITH_LAYER_bias "" OFF)
 option(WITH_LAYER_bnll "" OFF)
 option(WITH_LAYER_clip "" OFF)
-option(WITH_LAYER_concat "" OFF)
 option(WITH_LAYER_convolution "" OFF)
 option(WITH_LAYER_convolution1d "" OFF)
 option(WITH_LAYER_convolution3d "" OFF)
@@ -0,0 +1,607 @@
+#include "constraint.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+
+#include <tokenizer.h>
+
+namespace rwkv {
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+struct RegexNode {
+  enum Kind { kEmpty, kBytes, kConcat, kAlt, kRepeat };
+  Kind kind = kEmpty;
+  // kBytes
+  ByteSet bytes;
+  // kConcat, kAlt, kRepeat (one child)
+  std::vector<std::unique_ptr<RegexNode>> children;
+  // kRepeat, max == -1 means unbounded
+  int min = 0;
+  int max = 0;
+};
+using NodePtr = std::unique_ptr<RegexNode>;
+
+NodePtr MakeBytes(const ByteSet &bytes) {
+  auto node = std::make_unique<RegexNode>();
+  node->kind = RegexNode::kBytes;
+  node->bytes = bytes;
+  return node;
+}
+
+NodePtr MakeByte(uint8_t byte) {
+  ByteSet bytes;
+  bytes.set(byte);
+  return MakeBytes(bytes);
+}
+
+NodePtr MakeByteRange(int lo, int hi) {
+  ByteSet bytes;
+  for (int b = lo; b <= hi; b++) {
+    bytes.set(b);
+  }
+  return MakeBytes(bytes);
+}
+
+NodePtr MakeList(RegexNode::Kind kind, std::vector<NodePtr> children) {
+  if (children.size() == 1) {
+    return std::move(children[0]);
+  }
+  auto node = std::make_unique<RegexNode>();
+  node->kind = children.empty() ? RegexNode::kEmpty : kind;
+  node->children = std::move(children);
+  return node;
+}
+
+// any UTF-8 code point of 2 to 4 bytes
+NodePtr MakeMultiByteCodePoint() {
+  std::vector<NodePtr> alts;
+  for (int len = 2; len <= 4; len++) {
+    std::vector<NodePtr> seq;
+    seq.push_back(len == 2   ? MakeByteRange(0xC2, 0xDF)
+                  : len == 3 ? MakeByteRange(0xE0, 0xEF)
+                             : MakeByteRange(0xF0, 0xF4));
+    for (int i = 1; i < len; i++) {
+      seq.push_back(MakeByteRange(0x80, 0xBF));
+    }
+    alts.push_back(MakeList(RegexNode::kConcat, std::move(seq)));
+  }
+  return MakeList(RegexNode::kAlt, std::move(alts));
+}
+
+class RegexParser {
+public:
+  explicit RegexParser(const std::string &pattern) : _pattern(pattern) {}
+
+  NodePtr Parse() {
+    auto node = ParseAlt();
+    RV_CHECK(_pos == _pattern.size())
+        << "unexpected '" << _pattern[_pos] << "' at " << _pos << " in regex";
+    return node;
+  }
+
+private:
+  bool AtEnd() const { return _pos >= _pattern.size(); }
+  char Peek() const { return _pattern[_pos]; }
+  char Next() {
+    RV_CHECK(!AtEnd()) << "unexpected end of regex";
+    return _pattern[_pos++];
+  }
+
+  NodePtr ParseAlt() {
+    std::vector<NodePtr> alts;
+    alts.push_back(ParseConcat());
+    while (!AtEnd() && Peek() == '|') {
+      _pos++;
+      alts.push_back(ParseConcat());
+    }
+    return MakeList(RegexNode::kAlt, std::move(alts));
+  }
+
+  NodePtr ParseConcat() {
+    std::vector<NodePtr> seq;
+    while (!AtEnd() && Peek() != '|' && Peek() != ')') {
+      seq.push_back(ParseRepeat());
+    }
+    return MakeList(RegexNode::kConcat, std::move(seq));
+  }
+
+  NodePtr ParseRepeat() {
+    auto node = ParseAtom();
+    while (!AtEnd()) {
+      int min, max;
+      const char c = Peek();
+      if (c == '*') {
+        min = 0, max = -1;
+      } else if (c == '+') {
+        min = 1, max = -1;
+      } else if (c == '?') {
+        min = 0, max = 1;
+      } else if (c == '{') {
+        _pos++;
+        min = ParseInt();
+        max = min;
+        if (Peek() == ',') {
+          _pos++;
+          max = Peek() == '}' ? -1 : ParseInt();
+        }
+        RV_CHECK(Peek() == '}') << "invalid repetition in regex";
+        RV_CHECK(max == -1 || max >= min) << "invalid repetition in regex";
+        RV_CHECK(std::max(min, max) <= kMaxRepeat)
+            << "repetition larger than " << kMaxRepeat << " in regex";
+      } else {
+        break;
+      }
+      _pos++;
+      auto repeat = std::make_unique<RegexNode>();
+      repeat->kind = RegexNode::kRepeat;
+      repeat->min = min;
+      repeat->max = max;
+      repeat->children.push_back(std::move(node));
+      node = std::move(repeat);
+    }
+    return node;
+  }
+
+  int ParseInt() {
+    RV_CHECK(!AtEnd() && isdigit(Peek())) << "expected a number in regex";
+    int value = 0;
+    while (!AtEnd() && isdigit(Peek())) {
+      value = value * 10 + (Next() - '0');
+      RV_CHECK(value <= kMaxRepeat)
+          << "repetition larger than " << kMaxRepeat << " in regex";
+    }
+    return value;
+  }
+
+  NodePtr ParseAtom() {
+    const char c = Next();
+    RV_CHECK(c != '*' && c != '+' && c != '?' && c != '{')
+        << "nothing to repeat at " << _pos - 1 << " in regex";
+    switch (c) {
+    case '(': {
+      if (!AtEnd() && Peek() == '?') {
+        _pos++;
+        RV_CHECK(Next() == ':') << "only (?:...) groups are supported";
+      }
+      auto node = ParseAlt();
+      RV_CHECK(Next() == ')') << "missing ')' in regex";
+      return node;
+    }
+    case '[':
+      return ParseClass();
+    case '.': {
+      ByteSet bytes;
+      AddAscii(bytes, 0, 0x7F);
+      bytes.reset('\n');
+      return WithMultiByte(MakeBytes(bytes));
+    }
+    case '\\': {
+      ByteSet bytes;
+      bool negated = false;
+      ParseEscape(bytes, negated);
+      if (negated) {
+        return WithMultiByte(MakeBytes(ComplementAscii(bytes)));
+      }
+      return MakeBytes(bytes);
+    }
+    default:
+      return MakeByte(static_cast<uint8_t>(c));
+    }
+  }
+
+  // the escape after '\', as a set of ASCII bytes, `negated` for \D \W \S
+  void ParseEscape(ByteSet &bytes, bool &negated) {
+    const char c = Next();
+    switch (c) {
+    case 'D':
+      negated = true;
+      [[fallthrough]];
+    case 'd':
+      AddAscii(bytes, '0', '9');
+      break;
+    case 'W':
+      negated = true;
+      [[fallthrough]];
+    case 'w':
+      AddAscii(bytes, '0', '9');
+      AddAscii(bytes, 'a', 'z');
+      AddAscii(bytes, 'A', 'Z');
+      bytes.set('_');
+      break;
+    case 'S':
+      negated = true;
+      [[fallthrough]];
+    case 's':
+      for (char s : {' ', '\t', '\n', '\r', '\f', '\v'}) {
+        bytes.set(s);
+      }
+      break;
+    case 'n':
+      bytes.set('\n');
+      break;
+    case 't':
+      bytes.set('\t');
+      break;
+    case 'r':
+      bytes.set('\r');
+      break;
+    default:
+      RV_CHECK(!isalnum(c)) << "unsupported escape \\" << c << " in regex";
+      bytes.set(static_cast<uint8_t>(c));
+    }
+  }
+
+  NodePtr ParseClass() {
+    bool negated = false;
+    if (!AtEnd() && Peek() == '^') {
+      negated = true;
+      _pos++;
+    }
+    ByteSet bytes;
+    // non-ASCII members, as UTF-8 sequences
+    std::vector<std::string> code_points;
+    bool first = true;
+    while (true) {
+      RV_CHECK(!AtEnd()) << "missing ']' in regex";
+      if (Peek() == ']' && !first) {
+        _pos++;
+        break;
+      }
+      first = false;
+      if (Peek() == '\\') {
+        _pos++;
+        bool escape_negated = false;
+        ByteSet escaped;
+        ParseEscape(escaped, escape_negated);
+        bytes |= escape_negated ? ComplementAscii(escaped) : escaped;
+        continue;
+      }
+      const auto lo = static_cast<uint8_t>(Next());
+      if (lo >= 0x80) {
+        // a multi-byte code point, ranges are not supported
+        RV_CHECK(!negated) << "non-ASCII characters in a negated class";
+        std::string cp(1, static_cast<char>(lo));
+        while (!AtEnd() && (static_cast<uint8_t>(Peek()) & 0xC0) == 0x80) {
+          cp += Next();
+        }
+        code_points.push_back(cp);
+        continue;
+      }
+      if (_pos + 1 < _pattern.size() && Peek() == '-' &&
+          _pattern[_pos + 1] != ']') {
+        _pos++;
+        const auto hi = static_cast<uint8_t>(Next());
+        RV_CHECK(hi < 0x80 && hi >= lo) << "invalid range in regex class";
+        AddAscii(bytes, lo, hi);
+      } else {
+        bytes.set(lo);
+      }
+    }
+    if (negated) {
+      return WithMultiByte(MakeBytes(ComplementAscii(bytes)));
+    }
+    std::vector<NodePtr> alts;
+    alts.push_back(MakeBytes(bytes));
+    for (const auto &cp : code_points) {
+      std::vector<NodePtr> seq;
+      for (char b : cp) {
+        seq.push_back(MakeByte(static_cast<uint8_t>(b)));
+      }
+      alts.push_back(MakeList(RegexNode::kConcat, std::move(seq)));
+    }
+    return MakeList(RegexNode::kAlt, std::move(alts));
+  }
+
+  static void AddAscii(ByteSet &bytes, int lo, int hi) {
+    for (int b = lo; b <= hi; b++) {
+      bytes.set(b);
+    }
+  }
+
+  static ByteSet ComplementAscii(const ByteSet &bytes) {
+    ByteSet result;
+    for (int b = 0; b < 0x80; b++) {
+      result[b] = !bytes[b];
+    }
+    return result;
+  }
+
+  // `ascii` or any multi-byte code point
+  static NodePtr WithMultiByte(NodePtr ascii) {
+    std::vector<NodePtr> alts;
+    alts.push_back(std::move(ascii));
+    alts.push_back(MakeMultiByteCodePoint());
+    return MakeList(RegexNode::kAlt, std::move(alts));
+  }
+
+  static constexpr int kMaxRepeat = 1000;
+  const std::string &_pattern;
+  size_t _pos = 0;
+};
+
+} // namespace
+
+// Thompson NFA. A state either consumes one byte of `bytes` and goes to
+// `next`, or has only epsilon edges.
+struct RegexAutomaton::Nfa {
+  struct State {
+    ByteSet bytes;
+    int next = -1;
+    std::vector<int> eps;
+  };
+  std::vector<State> states;
+  int start;
+  int accept;
+
+  int AddState() {
+    states.emplace_back();
+    return states.size() - 1;
+  }
+
+  // build `node` between new states and return (begin, end)
+  std::pair<int, int> Build(const RegexNode &node) {
+    switch (node.kind) {
+    case RegexNode::kEmpty: {
+      const int s = AddState();
+      return {s, s};
+    }
+    case RegexNode::kBytes: {
+      const int s = AddState();
+      const int e = AddState();
+      states[s].bytes = node.bytes;
+      states[s].next = e;
+      return {s, e};
+    }
+    case RegexNode::kConcat: {
+      auto [begin, end] = Build(*node.children[0]);
+      for (size_t i = 1; i < node.children.size(); i++) {
+        auto [b, e] = Build(*node.children[i]);
+        states[end].eps.push_back(b);
+        end = e;
+      }
+      return {begin, end};
+    }
+    case RegexNode::kAlt: {
+      const int s = AddState();
+      const int e = AddState();
+      for (const auto &child : node.children) {
+        auto [b, end] = Build(*child);
+        states[s].eps.push_back(b);
+        states[end].eps.push_back(e);
+      }
+      return {s, e};
+    }
+    case RegexNode::kRepeat: {
+      const auto &child = *node.children[0];
+      const int s = AddState();
+      int end = s;
+      for (int i = 0; i < node.min; i++) {
+        auto [b, e] = Build(child);
+        states[end].eps.push_back(b);
+        end = e;
+      }
+      if (node.max == -1) {
+        auto [b, e] = Build(child);
+        const int loop = AddState();
+        states[end].eps.push_back(loop);
+        states[loop].eps.push_back(b);
+        states[e].eps.push_back(loop);
+        end = loop;
+      } else {
+        // every optional copy can skip to the end
+        const int final_end = AddState();
+        for (int i = node.min; i < node.max; i++) {
+          auto [b, e] = Build(child);
+          states[end].eps.push_back(b);
+          states[end].eps.push_back(final_end);
+          end = e;
+        }
+        states[end].eps.push_back(final_end);
+        end = final_end;
+      }
+      return {s, end};
+    }
+    }
+    RV_UNIMPLEMENTED();
+  }
+
+  // sorted epsilon closure, only keeping the states which matter for the
+  // transitions (byte states which can consume something) and the accepting
+  // state, so that equivalent sets are merged into one DFA state
+  std::vector<int> Closure(std::vector<int> seeds) const {
+    std::vector<bool> visited(states.size());
+    std::vector<int> result;
+    while (!seeds.empty()) {
+      const int s = seeds.back();
+      seeds.pop_back();
+      if (visited[s]) {
+        continue;
+      }
+      visited[s] = true;
+      if (states[s].next == -1 ? s == accept : states[s].bytes.any()) {
+        result.push_back(s);
+      }
+      seeds.insert(seeds.end(), states[s].eps.begin(), states[s].eps.end());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+};
+
+struct RegexAutomaton::DfaState {
+  static constexpr int kUnknown = -2;
+  explicit DfaState(std::vector<int> nfa_states, bool accepting)
+      : nfa_states(std::move(nfa_states)), accepting(accepting) {
+    next.fill(kUnknown);
+  }
+  std::vector<int> nfa_states;
+  bool accepting;
+  std::array<int, 256> next;
+  std::vector<uint64_t> mask;
+};
+
+struct RegexAutomaton::TrieNode {
+  // sorted by byte
+  std::vector<std::pair<uint8_t, int>> children;
+  std::vector<int> token_ids;
+};
+
+RegexAutomaton::RegexAutomaton(const std::string &pattern,
+                               std::vector<std::string> vocab,
+                               int eos_token_id)
+    : _nfa(std::make_unique<Nfa>()), _vocab(std::move(vocab)),
+      _eos_token_id(eos_token_id) {
+  RV_CHECK(eos_token_id < static_cast<int>(_vocab.size()));
+  auto root = RegexParser(pattern).Parse();
+  std::tie(_nfa->start, _nfa->accept) = _nfa->Build(*root);
+
+  // trie of the vocabulary, shared prefixes are walked through the DFA once
+  _trie.emplace_back();
+  for (int id = 0; id < _vocab.size(); id++) {
+    if (id == eos_token_id || _vocab[id].empty()) {
+      continue;
+    }
+    int node = 0;
+    for (char c : _vocab[id]) {
+      const auto byte = static_cast<uint8_t>(c);
+      auto &children = _trie[node].children;
+      auto it = std::lower_bound(
+          children.begin(), children.end(), byte,
+          [](const std::pair<uint8_t, int> &a, uint8_t b) { return a.first < b; });
+      if (it != children.end() && it->first == byte) {
+        node = it->second;
+      } else {
+        const int child = _trie.size();
+        children.insert(it, {byte, child});
+        _trie.emplace_back();
+        node = child;
+      }
+    }
+    _trie[node].token_ids.push_back(id);
+  }
+
+  const int start = AddDfaState(_nfa->Closure({_nfa->start}));
+  RV_CHECK(start == kStartState);
+}
+
+RegexAutomaton::~RegexAutomaton() = default;
+
+std::shared_ptr<RegexAutomaton>
+RegexAutomaton::FromTokenizer(const std::string &pattern,
+                              const Tokenizer &tokenizer, int n_vocab) {
+  std::vector<std::string> vocab(n_vocab);
+  for (int id = 0; id < n_vocab; id++) {
+    if (id == tokenizer.eos_token_id() || id == tokenizer.pad_token_id() ||
+        id == tokenizer.bos_token_id()) {
+      continue;
+    }
+    vocab[id] = tokenizer.decode(id);
+    // unknown ids are decoded as a placeholder
+    if (vocab[id] == "<unk>" && tokenizer.encode(vocab[id]) != std::vector{id}) {
+      vocab[id].clear();
+    }
+  }
+  return std::make_shared<RegexAutomaton>(pattern, std::move(vocab),
+                                          tokenizer.eos_token_id());
+}
+
+int RegexAutomaton::AddDfaState(std::vector<int> nfa_states) {
+  if (nfa_states.empty()) {
+    return kDeadState;
+  }
+  auto it = _dfa_state_ids.find(nfa_states);
+  if (it != _dfa_state_ids.end()) {
+    return it->second;
+  }
+  const int id = _dfa_states.size();
+  const bool accepting = std::binary_search(nfa_states.begin(),
+                                            nfa_states.end(), _nfa->accept);
+  _dfa_state_ids.emplace(nfa_states, id);
+  _dfa_states.emplace_back(std::move(nfa_states), accepting);
+  return id;
+}
+
+int RegexAutomaton::StepByte(int state, uint8_t byte) {
+  auto &dfa_state = _dfa_states[state];
+  if (dfa_state.next[byte] == DfaState::kUnknown) {
+    std::vector<int> seeds;
+    for (int s : dfa_state.nfa_states) {
+      const auto &nfa_state = _nfa->states[s];
+      if (nfa_state.next != -1 && nfa_state.bytes[byte]) {
+        seeds.push_back(nfa_state.next);
+      }
+    }
+    // `dfa_state` stays valid, _dfa_states is a deque
+    dfa_state.next[byte] = AddDfaState(_nfa->Closure(std::move(seeds)));
+  }
+  return dfa_state.next[byte];
+}
+
+int RegexAutomaton::Step(int state, int id) {
+  RV_CHECK(id >= 0 && id < _vocab.size());
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (state == kDeadState) {
+    return kDeadState;
+  }
+  if (id == _eos_token_id) {
+    return _dfa_states[state].accepting ? state : kDeadState;
+  }
+  if (_vocab[id].empty()) {
+    return kDeadState;
+  }
+  for (char c : _vocab[id]) {
+    state = StepByte(state, static_cast<uint8_t>(c));
+    if (state == kDeadState) {
+      break;
+    }
+  }
+  return state;
+}
+
+bool RegexAutomaton::IsAccepting(int state) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return state != kDeadState && _dfa_states[state].accepting;
+}
+
+int RegexAutomaton::num_dfa_states() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _dfa_states.size();
+}
+
+void RegexAutomaton::FillMask(int trie_node, int state, uint64_t *mask) {
+  for (int id : _trie[trie_node].token_ids) {
+    mask[id / 64] |= uint64_t{1} << (id % 64);
+  }
+  for (const auto &[byte, child] : _trie[trie_node].children) {
+    const int next = StepByte(state, byte);
+    if (next != kDeadState) {
+      FillMask(child, next, mask);
+    }
+  }
+}
+
+const uint64_t *RegexAutomaton::AllowedMask(int state) {
+  RV_CHECK(state != kDeadState);
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto &dfa_state = _dfa_states[state];
+  if (dfa_state.mask.empty()) {
+    std::vector<uint64_t> mask((_vocab.size() + 63) / 64, 0);
+    FillMask(0, state, mask.data());
+    if (_eos_token_id >= 0 && dfa_state.accepting) {
+      mask[_eos_token_id / 64] |= uint64_t{1} << (_eos_token_id % 64);
+    }
+    RV_CHECK(std::any_of(mask.begin(), mask.end(),
+                         [](uint64_t word) { return word != 0; }))
+        << "no token can continue the output under the constraint: the "
+           "regex needs bytes which no token provides, or it is complete "
+           "and there is no eos token";
+    dfa_state.mask = std::move(mask);
+  }
+  return dfa_state.mask.data();
+}
+
+} // namespace rwkv
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <check.h>
+
+namespace rwkv {
+class Tokenizer;
+
+// A regex compiled into a DFA over bytes, together with a vocabulary. The DFA
+// states are built lazily by subset construction, and for every DFA state the
+// bitmask of the tokens which can follow is computed on first use (by walking
+// a trie of the vocabulary, pruned at dead states) and cached. So a decoding
+// step costs one cached lookup per token and one masking pass over the
+// logits.
+//
+// The output is constrained to match the whole regex. Supported syntax:
+// literals (UTF-8 included), `.`, `[...]`, `[^...]`, `\d \w \s \D \W \S`,
+// `\n \t \r` and escaped metacharacters, groups `(...)` and `(?:...)`, `|`,
+// `*`, `+`, `?` and `{m}`, `{m,}`, `{m,n}`. `.` and negated classes match one
+// UTF-8 code point.
+//
+// An automaton is thread-safe and can be shared by many RegexConstraint.
+class RegexAutomaton {
+public:
+  // `vocab[id]` is the bytes of token `id`, empty for tokens which can never
+  // be emitted. `eos_token_id` (if >= 0) is allowed exactly when the output
+  // so far matches the regex.
+  RegexAutomaton(const std::string &pattern, std::vector<std::string> vocab,
+                 int eos_token_id);
+  // The vocabulary of the first `n_vocab` ids of `tokenizer`.
+  static std::shared_ptr<RegexAutomaton>
+  FromTokenizer(const std::string &pattern, const Tokenizer &tokenizer,
+                int n_vocab);
+  ~RegexAutomaton();
+  FR_DISALLOW_COPY_AND_MOVE(RegexAutomaton);
+
+  static constexpr int kStartState = 0;
+  static constexpr int kDeadState = -1;
+  // the state after emitting `id` in `state`, kDeadState if not allowed
+  int Step(int state, int id);
+  bool IsAccepting(int state);
+  // bit `id` (mask[id / 64] >> (id % 64) & 1) is set iff `id` is allowed in
+  // `state`. The pointer stays valid as long as the automaton. Throws if no
+  // token is allowed, which sampling could not handle.
+  const uint64_t *AllowedMask(int state);
+  int n_vocab() const { return _vocab.size(); }
+  int num_dfa_states();
+
+private:
+  struct Nfa;
+  struct DfaState;
+  struct TrieNode;
+
+  int StepByte(int state, uint8_t byte);
+  int AddDfaState(std::vector<int> nfa_states);
+  void FillMask(int trie_node, int state, uint64_t *mask);
+
+  std::unique_ptr<Nfa> _nfa;
+  std::vector<std::string> _vocab;
+  int _eos_token_id;
+  std::vector<TrieNode> _trie;
+  // a deque so that references (and masks) stay valid when states are added
+  std::deque<DfaState> _dfa_states;
+  std::map<std::vector<int>, int> _dfa_state_ids;
+  std::mutex _mutex;
+};
+
+// The decoding state of one sequence under a RegexAutomaton.
+class RegexConstraint {
+public:
+  explicit RegexConstraint(std::shared_ptr<RegexAutomaton> automaton)
+      : _automaton(std::move(automaton)) {}
+  // the tokens allowed next, to be passed to Sampler::Sample
+  const uint64_t *AllowedMask() { return _automaton->AllowedMask(_state); }
+  // advance by an emitted token, which must be allowed
+  void Accept(int id) {
+    const int next = _automaton->Step(_state, id);
+    RV_CHECK(next != RegexAutomaton::kDeadState)
+        << "token " << id << " violates the constraint";
+    _state = next;
+  }
+  // whether the output so far matches the whole regex
+  bool IsComplete() { return _automaton->IsAccepting(_state); }
+  void Reset() { _state = RegexAutomaton::kStartState; }
+  const RegexAutomaton &automaton() const { return *_automaton; }
+
+private:
+  std::shared_ptr<RegexAutomaton> _automaton;
+  int _state = RegexAutomaton::kStartState;
+};
+
+} // namespace rwkv
@@ -1,9 +1,9 @@
 #include <chrono>
 #include <iostream>
-#include <map>
 
 #include <model.h>
 #include <sampler.h>
+#include <stop_matcher.h>
 #include <tokenizer.h>
 
 static const std::string kUserPrefix = "User: ";
@@ -36,7 +36,9 @@ int main(int argc, char **argv) {
   if (argc == 5) {
     model.LoadStateFile(argv[4]);
   }
-  std::map<int, float> occurences;
+  rwkv::PenaltyState penalties;
+  rwkv::StreamDecoder decoder(tokenizer);
+  rwkv::StopMatcher stop_matcher({kDoubleNewLine});
   while (true) {
     std::cout << kUserPrefix;
     std::string input;
@@ -51,14 +53,10 @@ int main(int argc, char **argv) {
         std::chrono::system_clock::now() - tmp);
     tmp = std::chrono::system_clock::now();
     auto output = Copy(model.Run(prompt_ids), rwkv::Device::kCPU);
-    std::string response;
     int num_new_tokens = 0;
     for (; num_new_tokens < kMaxOutputLength; num_new_tokens++) {
-      for (auto &[id, occurence] : occurences) {
-        output.data_ptr<float>()[id] -=
-            kFrequencyPenalty * occurence + kPresencePenalty;
-        occurence *= kPenaltyDecay;
-      }
+      penalties.Apply(output, kPresencePenalty, kFrequencyPenalty,
+                      kPenaltyDecay);
       if (kQAMode) {
         output.data_ptr<float>()[kEndOfSentence] = -1e30;
         if (num_new_tokens == 0) {
@@ -75,21 +73,23 @@ int main(int argc, char **argv) {
       }
       auto output_id =
           sampler.Sample(output, /*temperature=*/1.f, /*top_k=*/1, kTopP);
-      occurences[output_id]++;
+      penalties.Accept(output_id);
       if (output_id == kEndOfSentence && !kQAMode) {
         break;
       }
-      auto output_str = tokenizer.decode(output_id);
-      std::cout << output_str;
-      response += output_str;
+      // whole characters only, and nothing that may begin the stop word
+      auto result = stop_matcher.Put(decoder.Put(output_id));
+      std::cout << result.text;
       // it is important to pass the stop word (\n\n) to the model,
       // or it will stop incorrectly in the next iteration.
       output = Copy(model.Run(output_id), rwkv::Device::kCPU);
-      if (response.size() >= 2 &&
-          response.substr(response.size() - 2) == "\n\n") {
+      if (result.stopped()) {
+        std::cout << kDoubleNewLine;
         break;
       }
     }
+    // the held back bytes, if the response ended without a stop
+    std::cout << stop_matcher.Flush() << decoder.Flush();
     auto model_time = std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::system_clock::now() - tmp);
     auto end = std::chrono::system_clock::now();
@@ -110,7 +110,7 @@ int main(int argc, char **argv) {
       std::cout << std::endl;
     }
     if (!kGlobalPenalty) {
-      occurences.clear();
+      penalties.Reset();
     }
     // std::cout << std::endl;
     // model.Run(tokenizer.encode("\n"), states);
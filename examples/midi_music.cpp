@@ -1,7 +1,6 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
-#include <map>
 #include <sstream>
 
 #include <model.h>
@@ -33,12 +32,11 @@ int main(int argc, char **argv) {
     std::string result;
     auto start = std::chrono::system_clock::now();
     auto output_tensor = Copy(model.Run(input_ids), rwkv::Device::kCPU);
-    std::map<int, float> occurences;
+    rwkv::PenaltyState penalties;
     for (i = 1; i < length; i++) {
       // translated from ChatRWKV
-      for (const auto &[id, occurence] : occurences) {
-        output_tensor.data_ptr<float>()[id] -= 0.5 * occurence;
-      }
+      penalties.Apply(output_tensor, /*presence_penalty=*/0.f,
+                      /*frequency_penalty=*/0.5f, /*penalty_decay=*/0.997f);
       output_tensor.data_ptr<float>()[0] +=
           (i - 2000) / 500.;                      // not too short, not too long
       output_tensor.data_ptr<float>()[127] -= 1.; // avoid "t125"
@@ -48,13 +46,10 @@ int main(int argc, char **argv) {
                                 output_tensor, 5.f, 100, 0.6f);
 
       // translated from ChatRWKV
-      for (const auto &[id, occurence] : occurences) {
-        occurences[id] *= 0.997;
-      }
       if (output_id >= 128 || output_id == 127) {
-        occurences[output_id] += 1;
+        penalties.Accept(output_id, 1.f);
       } else {
-        occurences[output_id] += 0.3;
+        penalties.Accept(output_id, 0.3f);
       }
 
       if (output_id == tokenizer.eos_token_id()) {
@@ -0,0 +1,90 @@
+#include "executor.h"
+
+#include <memory>
+
+namespace rwkv {
+
+Executor::Executor(Model &model)
+    : _model(model), _worker(&Executor::WorkerLoop, this) {}
+
+Executor::~Executor() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cv.notify_one();
+  _worker.join();
+}
+
+void Executor::Post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    RV_CHECK(!_stop);
+    _tasks.push_back(std::move(task));
+  }
+  _cv.notify_one();
+}
+
+void Executor::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+      // pending tasks are still run on destruction so that no future is left
+      // unsatisfied
+      if (_tasks.empty()) {
+        return;
+      }
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+    task();
+  }
+}
+
+std::future<Tensor> Executor::RunAsync(Session &session, std::vector<int> ids,
+                                       CancellationToken token) {
+  // std::function must be copyable
+  auto promise = std::make_shared<std::promise<Tensor>>();
+  auto future = promise->get_future();
+  Post([this, &session, ids = std::move(ids), token, promise]() {
+    try {
+      promise->set_value(_model.Run(session, ids, false, &token));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
+
+std::future<std::vector<int>> Executor::GenerateAsync(
+    Session &session, std::vector<int> prompt_ids, int max_new_tokens,
+    Sampler &sampler, float temperature, int top_k, float top_p,
+    std::function<bool(int)> callback, CancellationToken token) {
+  auto promise = std::make_shared<std::promise<std::vector<int>>>();
+  auto future = promise->get_future();
+  Post([this, &session, prompt_ids = std::move(prompt_ids), max_new_tokens,
+        &sampler, temperature, top_k, top_p, callback = std::move(callback),
+        token, promise]() {
+    try {
+      RV_CHECK(!prompt_ids.empty());
+      std::vector<int> output_ids;
+      auto logits = _model.Run(session, prompt_ids, false, &token);
+      for (int i = 0; i < max_new_tokens; i++) {
+        int id = sampler.Sample(logits, temperature, top_k, top_p);
+        output_ids.push_back(id);
+        if ((callback && !callback(id)) || i == max_new_tokens - 1) {
+          break;
+        }
+        logits = _model.Run(session, {id}, false, &token);
+      }
+      promise->set_value(std::move(output_ids));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
+
+} // namespace rwkv
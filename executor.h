@@ -0,0 +1,54 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <check.h>
+#include <model.h>
+#include <sampler.h>
+
+namespace rwkv {
+
+// Runs the model on a background thread, so that the caller (e.g. an event
+// loop) is never blocked by inference. Requests are executed in submission
+// order. A cancelled request fails its future with FRCancelled; it is checked
+// before the request starts, between layers and between tokens.
+class Executor {
+public:
+  explicit Executor(Model &model);
+  ~Executor();
+  FR_DISALLOW_COPY_AND_MOVE(Executor);
+
+  // `session` must be kept alive until the future is ready.
+  std::future<Tensor> RunAsync(Session &session, std::vector<int> ids,
+                               CancellationToken token = CancellationToken());
+
+  // Feed `prompt_ids` and generate at most `max_new_tokens` tokens. `callback`
+  // is called on the executor thread for each generated token as soon as it
+  // is sampled and can return false to stop. The future holds all generated
+  // tokens. `session` and `sampler` must be kept alive and not be used
+  // elsewhere until the future is ready.
+  std::future<std::vector<int>>
+  GenerateAsync(Session &session, std::vector<int> prompt_ids,
+                int max_new_tokens, Sampler &sampler, float temperature,
+                int top_k, float top_p, std::function<bool(int)> callback,
+                CancellationToken token = CancellationToken());
+
+private:
+  void Post(std::function<void()> task);
+  void WorkerLoop();
+
+  Model &_model;
+  std::deque<std::function<void()>> _tasks;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stop = false;
+  std::thread _worker;
+};
+
+} // namespace rwkv
@@ -1,4 +1,5 @@
 #include "faster_rwkvd.h"
+#include "check.h"
 #include "model.h"
 #include "sampler.h"
 #include "stdlib.h"
@@ -7,11 +8,14 @@
 #include <cstring>
 #include <fstream>
 #include "soc_detect.h"
+#include "stop_matcher.h"
+
+#include <memory>
+#include <mutex>
 
 #ifdef FR_ENABLE_WEBRWKV
 #include <time.h>
 #include "web_rwkv_ffi.h"
-static bool is_webrwkv = false;
 #endif
 
 #ifdef FR_ENABLE_QNN
@@ -19,8 +23,58 @@ static bool is_webrwkv = false;
 #include "kernels/qnn/extra.h"
 #endif
 
-std::string last_out;
-std::map<int, float> occurences;
+namespace {
+
+struct ModelHandle {
+  // null for web-rwkv models
+  std::unique_ptr<rwkv::Model> model;
+  bool is_webrwkv = false;
+  // used by the functions without a session, which run on the states of the
+  // model itself
+  std::mutex mutex;
+  std::string last_out;
+  // last_out only holds whole UTF-8 code points
+  rwkv::StreamDecoder decoder;
+  rwkv::PenaltyState penalties;
+};
+
+struct SessionHandle {
+  explicit SessionHandle(ModelHandle *model_handle)
+      : model_handle(model_handle), session(*model_handle->model) {}
+  ModelHandle *model_handle;
+  rwkv::Session session;
+  rwkv::Sampler sampler;
+  std::string last_out;
+  rwkv::StreamDecoder decoder;
+  // null if no stop strings are set
+  std::unique_ptr<rwkv::StopMatcher> stop_matcher;
+  rwkv::PenaltyState penalties;
+};
+
+ModelHandle *GetModelHandle(rwkv_model_t model_handle) {
+  return static_cast<ModelHandle *>(model_handle);
+}
+
+SessionHandle *GetSessionHandle(rwkv_session_t session_handle) {
+  return static_cast<SessionHandle *>(session_handle);
+}
+
+int SessionEval(SessionHandle *handle, const std::vector<int> &input_ids,
+                float temperature, int top_k, float top_p,
+                float presence_penalty, float frequency_penalty,
+                float penalty_decay) {
+  rwkv::Model *model = handle->model_handle->model.get();
+  auto output_tensor =
+      Copy(model->Run(handle->session, input_ids), rwkv::Device::kCPU);
+  handle->penalties.Apply(output_tensor, presence_penalty, frequency_penalty,
+                          penalty_decay);
+  int output_id =
+      handle->sampler.Sample(output_tensor, temperature, top_k, top_p);
+  handle->penalties.Accept(output_id);
+  return output_id;
+}
+
+} // namespace
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,7 +83,6 @@ extern "C" {
 rwkv_model_t rwkv_model_create(const char *path, const char *strategy) {
 #ifdef FR_ENABLE_WEBRWKV
   if (std::string(strategy).substr(0, 6) == "webgpu") {
-    is_webrwkv = true;
     init(time(NULL));
     try {
       if (std::string(path).find("ABC") != std::string::npos || 
@@ -40,15 +93,18 @@ rwkv_model_t rwkv_model_create(const char *path, const char *strategy) {
     } catch(...) {
       return nullptr;
     }
-    return (void *)1;
+    auto *handle = new ModelHandle();
+    handle->is_webrwkv = true;
+    return handle;
   } else {
 #else
   {
 #endif
-    rwkv_model_t handle;
+    auto *handle = new ModelHandle();
     try {
-      handle = new rwkv::Model(path, strategy);
+      handle->model = std::make_unique<rwkv::Model>(path, strategy);
     } catch(FRException &e) {
+      delete handle;
 #ifdef __ANDROID__
       __android_log_print(ANDROID_LOG_ERROR, "faster-rwkv", "rwkv_model_create failed!");
       __android_log_print(ANDROID_LOG_ERROR, "faster-rwkv", "Error msg: %s", e.what());
@@ -59,6 +115,10 @@ rwkv_model_t rwkv_model_create(const char *path, const char *strategy) {
   }
 }
 
+void rwkv_model_destroy(rwkv_model_t model_handle) {
+  delete GetModelHandle(model_handle);
+}
+
 rwkv_tokenizer_t rwkv_ABCTokenizer_create() {
   return new rwkv::ABCTokenizer();
 }
@@ -85,7 +145,7 @@ char rwkv_abcmodel_run_with_tokenizer_and_sampler(
   std::vector<int> input_id = tokenizer->encode(std::string(1, input));
   int output_id;
 #ifdef FR_ENABLE_WEBRWKV
-  if (is_webrwkv) {
+  if (GetModelHandle(model_handle)->is_webrwkv) {
     std::vector<uint16_t> input_ids_u16 = std::vector<uint16_t>(input_id.begin(), input_id.end());
     output_id = (int)infer(input_ids_u16.data(), input_ids_u16.size(), {temperature, top_p, static_cast<uintptr_t>(top_k)});
   } else {
@@ -93,7 +153,7 @@ char rwkv_abcmodel_run_with_tokenizer_and_sampler(
   {
 #endif
     rwkv::Sampler *sampler = static_cast<rwkv::Sampler *>(sampler_handle);
-    rwkv::Model *model = static_cast<rwkv::Model *>(model_handle);
+    rwkv::Model *model = GetModelHandle(model_handle)->model.get();
     auto output_tensor = Copy(model->Run(input_id[0]), rwkv::Device::kCPU);
     output_id = sampler->Sample(output_tensor, temperature, top_k, top_p);
   }
@@ -116,7 +176,7 @@ char rwkv_abcmodel_run_prompt(
   std::vector<int> input_ids = tokenizer->encode(input_str);
   int output_id;
 #ifdef FR_ENABLE_WEBRWKV
-  if (is_webrwkv) {
+  if (GetModelHandle(model_handle)->is_webrwkv) {
     std::vector<uint16_t> input_ids_u16 = std::vector<uint16_t>(input_ids.begin(), input_ids.end());
     output_id = (int)infer(input_ids_u16.data(), input_ids_u16.size(), {temperature, top_p, static_cast<uintptr_t>(top_k)});
   } else {
@@ -124,7 +184,7 @@ char rwkv_abcmodel_run_prompt(
   {
 #endif
     rwkv::Sampler *sampler = static_cast<rwkv::Sampler *>(sampler_handle);
-    rwkv::Model *model = static_cast<rwkv::Model *>(model_handle);
+    rwkv::Model *model = GetModelHandle(model_handle)->model.get();
     for (int i = 0; i < input_ids.size(); i++) {
       if (i == (input_ids.size() - 1)) {
         auto output_tensor = Copy(model->Run(input_ids[i]), rwkv::Device::kCPU);
@@ -145,12 +205,14 @@ char* rwkv_chatmodel_eval(
     // sampler params
     float temperature, int top_k, float top_p,
     float presence_penalty, float frequency_penalty, float penalty_decay) {
+  ModelHandle *handle = GetModelHandle(model_handle);
+  std::lock_guard<std::mutex> lock(handle->mutex);
   rwkv::Tokenizer *tokenizer =
       static_cast<rwkv::Tokenizer *>(tokenizer_handle);
   std::vector<int> input_id = tokenizer->encode(std::string(input));
   int output_id;
 #ifdef FR_ENABLE_WEBRWKV
-  if (is_webrwkv) {
+  if (GetModelHandle(model_handle)->is_webrwkv) {
     std::vector<uint16_t> input_ids_u16 = std::vector<uint16_t>(input_id.begin(), input_id.end());
     output_id = (int)infer(input_ids_u16.data(), input_ids_u16.size(), {temperature, top_p, static_cast<uintptr_t>(top_k)});
   } else {
@@ -158,22 +220,21 @@ char* rwkv_chatmodel_eval(
   {
 #endif
     rwkv::Sampler *sampler = static_cast<rwkv::Sampler *>(sampler_handle);
-    rwkv::Model *model = static_cast<rwkv::Model *>(model_handle);
+    rwkv::Model *model = GetModelHandle(model_handle)->model.get();
     auto output_tensor = Copy(model->Run(input_id), rwkv::Device::kCPU);
-    for (auto &[id, occurence] : occurences) {
-      output_tensor.data_ptr<float>()[id] -=
-          frequency_penalty * occurence + presence_penalty;
-      occurence *= penalty_decay;
-    }
+    handle->penalties.Apply(output_tensor, presence_penalty,
+                            frequency_penalty, penalty_decay);
 
     output_id = sampler->Sample(output_tensor, temperature, top_k, top_p);
-    occurences[output_id]++;
+    handle->penalties.Accept(output_id);
   }
-  if (output_id == 0) // end_of_sentense
-    last_out = "<end>";
-  else
-    last_out = tokenizer->decode(output_id);
-  return (char*)last_out.c_str();
+  if (output_id == 0) { // end_of_sentense
+    // the bytes of an incomplete code point, which also resets the decoder
+    handle->last_out = handle->decoder.Flush() + "<end>";
+  } else {
+    handle->last_out = handle->decoder.Put(tokenizer->decode_view(output_id));
+  }
+  return (char*)handle->last_out.c_str();
 }
 
 int rwkv_model_eval_id(
@@ -183,10 +244,12 @@ int rwkv_model_eval_id(
     // sampler params
     float temperature, int top_k, float top_p,
     float presence_penalty, float frequency_penalty, float penalty_decay) {
+  ModelHandle *handle = GetModelHandle(model_handle);
+  std::lock_guard<std::mutex> lock(handle->mutex);
   std::vector<int> input_id = {token};
   int output_id;
 #ifdef FR_ENABLE_WEBRWKV
-  if (is_webrwkv) {
+  if (GetModelHandle(model_handle)->is_webrwkv) {
     std::vector<uint16_t> input_ids_u16 = std::vector<uint16_t>(input_id.begin(), input_id.end());
     output_id = (int)infer(input_ids_u16.data(), input_ids_u16.size(), {temperature, top_p, static_cast<uintptr_t>(top_k)});
   } else {
@@ -194,16 +257,13 @@ int rwkv_model_eval_id(
   {
 #endif
     rwkv::Sampler *sampler = static_cast<rwkv::Sampler *>(sampler_handle);
-    rwkv::Model *model = static_cast<rwkv::Model *>(model_handle);
+    rwkv::Model *model = GetModelHandle(model_handle)->model.get();
     auto output_tensor = Copy(model->Run(input_id), rwkv::Device::kCPU);
-    for (auto &[id, occurence] : occurences) {
-      output_tensor.data_ptr<float>()[id] -=
-          frequency_penalty * occurence + presence_penalty;
-      occurence *= penalty_decay;
-    }
+    handle->penalties.Apply(output_tensor, presence_penalty,
+                            frequency_penalty, penalty_decay);
 
     output_id = sampler->Sample(output_tensor, temperature, top_k, top_p);
-    occurences[output_id]++;
+    handle->penalties.Accept(output_id);
   }
   return output_id;
 }
@@ -211,7 +271,7 @@ int rwkv_model_eval_id(
 
 int rwkv_model_load_states(rwkv_model_t model_handle, const char *path) {
   try {
-    rwkv::Model *model = static_cast<rwkv::Model *>(model_handle);
+    rwkv::Model *model = GetModelHandle(model_handle)->model.get();
     model->LoadStateFile(std::string(path));
   } catch(...) {
     return 1;
@@ -221,15 +281,18 @@ int rwkv_model_load_states(rwkv_model_t model_handle, const char *path) {
 
 void rwkv_model_clear_states(rwkv_model_t model_handle) {
 #ifdef FR_ENABLE_WEBRWKV
-  if (is_webrwkv) {
+  if (GetModelHandle(model_handle)->is_webrwkv) {
     clear_state();
   } else {
 #else
   {
 #endif
-    static_cast<rwkv::Model *>(model_handle)->ResetStates();
-    last_out.clear();
-    occurences.clear();
+    ModelHandle *handle = GetModelHandle(model_handle);
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    handle->model->ResetStates();
+    handle->last_out.clear();
+    handle->decoder.Reset();
+    handle->penalties.Reset();
   }
 }
 
@@ -239,6 +302,148 @@ char* rwkv_get_soc_name() {
   return (char*)detect.get_soc_name();
 }
 
+rwkv_session_t rwkv_session_create(rwkv_model_t model_handle) {
+  ModelHandle *handle = GetModelHandle(model_handle);
+  if (handle->is_webrwkv ||
+      handle->model->act_device() == rwkv::Device::kQNN ||
+      handle->model->act_device() == rwkv::Device::kMTK) {
+    return nullptr;
+  }
+  try {
+    return new SessionHandle(handle);
+  } catch (FRException &e) {
+    return nullptr;
+  }
+}
+
+void rwkv_session_destroy(rwkv_session_t session_handle) {
+  delete GetSessionHandle(session_handle);
+}
+
+void rwkv_session_set_seed(rwkv_session_t session_handle, int seed) {
+  GetSessionHandle(session_handle)->sampler.set_seed(seed);
+}
+
+void rwkv_session_clear_states(rwkv_session_t session_handle) {
+  SessionHandle *handle = GetSessionHandle(session_handle);
+  handle->session.Reset(*handle->model_handle->model);
+  handle->last_out.clear();
+  handle->decoder.Reset();
+  if (handle->stop_matcher != nullptr) {
+    handle->stop_matcher->Reset();
+  }
+  handle->penalties.Reset();
+}
+
+int rwkv_session_set_stop_strings(rwkv_session_t session_handle,
+                                  const char *const *stop_strings, int n) {
+  SessionHandle *handle = GetSessionHandle(session_handle);
+  if (n == 0) {
+    handle->stop_matcher = nullptr;
+    return 0;
+  }
+  try {
+    handle->stop_matcher = std::make_unique<rwkv::StopMatcher>(
+        std::vector<std::string>(stop_strings, stop_strings + n));
+  } catch (FRException &e) {
+    return 1;
+  }
+  return 0;
+}
+
+int rwkv_session_stopped(rwkv_session_t session_handle) {
+  SessionHandle *handle = GetSessionHandle(session_handle);
+  return handle->stop_matcher != nullptr && handle->stop_matcher->stopped();
+}
+
+int rwkv_session_set_allowed_tokens(rwkv_session_t session_handle,
+                                    const int *tokens, int n) {
+  SessionHandle *handle = GetSessionHandle(session_handle);
+  if (n == 0) {
+    handle->session.head_slice = nullptr;
+    return 0;
+  }
+  try {
+    handle->session.head_slice = handle->model_handle->model->MakeHeadSlice(
+        std::vector<int>(tokens, tokens + n));
+  } catch (FRException &e) {
+    return 1;
+  }
+  return 0;
+}
+
+int rwkv_session_eval_id(
+    rwkv_session_t session_handle,
+    int token,
+    // sampler params
+    float temperature, int top_k, float top_p,
+    float presence_penalty, float frequency_penalty, float penalty_decay) {
+  return SessionEval(GetSessionHandle(session_handle), {token}, temperature,
+                     top_k, top_p, presence_penalty, frequency_penalty,
+                     penalty_decay);
+}
+
+char* rwkv_session_chat_eval(
+    rwkv_session_t session_handle, rwkv_tokenizer_t tokenizer_handle,
+    char *input,
+    // sampler params
+    float temperature, int top_k, float top_p,
+    float presence_penalty, float frequency_penalty, float penalty_decay) {
+  SessionHandle *handle = GetSessionHandle(session_handle);
+  rwkv::Tokenizer *tokenizer =
+      static_cast<rwkv::Tokenizer *>(tokenizer_handle);
+  std::vector<int> input_id = tokenizer->encode(std::string(input));
+  int output_id =
+      SessionEval(handle, input_id, temperature, top_k, top_p,
+                  presence_penalty, frequency_penalty, penalty_decay);
+  if (output_id == 0) { // end_of_sentense
+    std::string text = handle->decoder.Flush();
+    if (handle->stop_matcher != nullptr) {
+      // the held back text, which is not a stop string now that the response
+      // ends. Flush also resets the matcher for the next response.
+      text = std::string(handle->stop_matcher->Put(text).text) +
+             handle->stop_matcher->Flush();
+    }
+    handle->last_out = text + "<end>";
+  } else {
+    std::string_view text =
+        handle->decoder.Put(tokenizer->decode_view(output_id));
+    if (handle->stop_matcher != nullptr) {
+      text = handle->stop_matcher->Put(text).text;
+    }
+    handle->last_out = text;
+  }
+  return (char*)handle->last_out.c_str();
+}
+
+int rwkv_model_eval_batch(
+    rwkv_model_t model_handle,
+    rwkv_session_t *session_handles,
+    const int *tokens,
+    int n,
+    // sampler params
+    float temperature, int top_k, float top_p,
+    float presence_penalty, float frequency_penalty, float penalty_decay,
+    int *output_ids) {
+  ModelHandle *handle = GetModelHandle(model_handle);
+  for (int i = 0; i < n; i++) {
+    if (GetSessionHandle(session_handles[i])->model_handle != handle) {
+      return 1;
+    }
+  }
+  try {
+    for (int i = 0; i < n; i++) {
+      output_ids[i] = SessionEval(GetSessionHandle(session_handles[i]),
+                                  {tokens[i]}, temperature, top_k, top_p,
+                                  presence_penalty, frequency_penalty,
+                                  penalty_decay);
+    }
+  } catch (...) {
+    return 1;
+  }
+  return 0;
+}
+
 #ifdef __cplusplus
 }
 #endif
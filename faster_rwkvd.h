@@ -9,6 +9,7 @@ typedef void* rwkv_model_t;
 typedef void* rwkv_tokenizer_t;
 typedef void* rwkv_sampler_t;
 typedef void* rwkv_tensor_t;
+typedef void* rwkv_session_t;
 
 /**
  * @brief Create an RWKV model.
@@ -19,6 +20,14 @@ typedef void* rwkv_tensor_t;
  */
 rwkv_model_t rwkv_model_create(const char* path, const char* strategy);
 
+/**
+ * @brief Destroy a model created by rwkv_model_create. The sessions of the
+ * model must be destroyed before.
+ * 
+ * @param model_handle The handle to the model.
+ */
+void rwkv_model_destroy(rwkv_model_t model_handle);
+
 /**
  * @brief Create an RWKV ABCTokenizer.
  * 
@@ -65,6 +74,12 @@ char rwkv_abcmodel_run_with_tokenizer_and_sampler(rwkv_model_t model_handle,
                     // sampler params 
                     float temperature, int top_k, float top_p);
 
+/**
+ * @brief Feed `input` to the model and decode the sampled token. The returned
+ * text holds whole UTF-8 code points only, the bytes of an incomplete one are
+ * returned with the next token. At the end of the response it is the held
+ * back bytes (usually none) followed by "<end>".
+ */
 char* rwkv_chatmodel_eval(rwkv_model_t model_handle,
                     rwkv_tokenizer_t tokenizer_handle,
                     rwkv_sampler_t sampler_handle,
@@ -90,6 +105,95 @@ void rwkv_qualcomm_save_context(rwkv_model_t model_handle, const char *path);
 
 char* rwkv_get_soc_name();
 
+/**
+ * @brief Create a session on a model. A session holds its own states,
+ * penalty table and sampler, so that one model can be shared by many threads,
+ * each driving its own sessions. Runs on one model are serialized.
+ * 
+ * @param model_handle The handle to the model.
+ * @return rwkv_session_t The handle to the created session, or NULL if the
+ * model does not support sessions (web-rwkv, QNN and MTK).
+ */
+rwkv_session_t rwkv_session_create(rwkv_model_t model_handle);
+
+void rwkv_session_destroy(rwkv_session_t session_handle);
+
+void rwkv_session_set_seed(rwkv_session_t session_handle, int seed);
+
+void rwkv_session_clear_states(rwkv_session_t session_handle);
+
+/**
+ * @brief Restrict the tokens a session can emit to `tokens`, e.g. the
+ * vocabulary of an ABC or MIDI tokenizer. Only these columns of the output
+ * head are computed. Pass n = 0 to allow all tokens again.
+ * 
+ * @return int 0 on success, 1 on failure.
+ */
+int rwkv_session_set_allowed_tokens(rwkv_session_t session_handle,
+                    const int *tokens, int n);
+
+int rwkv_session_eval_id(
+                    rwkv_session_t session_handle,
+                    int token,
+                    // sampler params
+                    float temperature, int top_k, float top_p,
+                    float presence_penalty, float frequency_penalty, float penalty_decay);
+
+/**
+ * @brief Same as rwkv_chatmodel_eval but on a session. The returned string is
+ * owned by the session and valid until the next call on it.
+ */
+char* rwkv_session_chat_eval(rwkv_session_t session_handle,
+                    rwkv_tokenizer_t tokenizer_handle,
+                    char *input,
+                    // sampler params
+                    float temperature, int top_k, float top_p,
+                    // penalty params
+                    float presence_penalty, float frequency_penalty, float penalty_decay);
+
+/**
+ * @brief Stop rwkv_session_chat_eval at any of the `n` strings. The text is
+ * checked as it is generated, and text which may begin a stop string is held
+ * back until it is known not to be one. Once a stop string is completed,
+ * rwkv_session_stopped returns 1 and rwkv_session_chat_eval returns only the
+ * text before it, then "" until the end of the response ("<end>"), this
+ * function or rwkv_session_clear_states. At the end of the response the
+ * held back text is returned in front of "<end>". Pass n = 0 to remove the
+ * stop strings.
+ *
+ * @return int 0 on success, 1 on failure (e.g. an empty stop string).
+ */
+int rwkv_session_set_stop_strings(rwkv_session_t session_handle,
+                    const char *const *stop_strings, int n);
+
+/**
+ * @brief Whether the current response of rwkv_session_chat_eval has completed
+ * a stop string (see rwkv_session_set_stop_strings).
+ * 
+ * @return int 1 if it has, 0 otherwise.
+ */
+int rwkv_session_stopped(rwkv_session_t session_handle);
+
+/**
+ * @brief Feed `tokens[i]` to `session_handles[i]` and sample the next token of
+ * each session into `output_ids[i]`, for `n` sessions of one model.
+ * 
+ * @return int 0 on success, 1 on failure. If a session is not of this model,
+ * nothing is run. If the evaluation of a session fails, the sessions before
+ * it keep their new states and output ids, the sessions after it are
+ * unchanged, and the failed session should be cleared by
+ * rwkv_session_clear_states before it is used again.
+ */
+int rwkv_model_eval_batch(
+                    rwkv_model_t model_handle,
+                    rwkv_session_t *session_handles,
+                    const int *tokens,
+                    int n,
+                    // sampler params
+                    float temperature, int top_k, float top_p,
+                    float presence_penalty, float frequency_penalty, float penalty_decay,
+                    int *output_ids);
+
 #ifdef __cplusplus
 }
 #endif
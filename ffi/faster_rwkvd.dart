@@ -31,6 +31,20 @@ late final _rwkv_model_createPtr = _lookup<
     ffi.NativeFunction<rwkv_model_t Function(ffi.Pointer<ffi.Char> , ffi.Pointer<ffi.Char> )>>('rwkv_model_create');
 late final _rwkv_model_create = _rwkv_model_createPtr.asFunction<rwkv_model_t Function(ffi.Pointer<ffi.Char> , ffi.Pointer<ffi.Char> )>();
 
+/// @brief Destroy a model created by rwkv_model_create. The sessions of the
+/// model must be destroyed before.
+/// 
+/// @param model_handle The handle to the model.
+void rwkv_model_destroy(rwkv_model_t model_handle,
+) {
+  return _rwkv_model_destroy(model_handle,
+);
+}
+
+late final _rwkv_model_destroyPtr = _lookup<
+    ffi.NativeFunction<ffi.Void Function(rwkv_model_t )>>('rwkv_model_destroy');
+late final _rwkv_model_destroy = _rwkv_model_destroyPtr.asFunction<void Function(rwkv_model_t )>();
+
 /// @brief Create an RWKV ABCTokenizer.
 /// 
 /// @return rwkv_tokenizer_t The handle to the created ABCTokenizer.
@@ -127,6 +141,10 @@ late final _rwkv_abcmodel_run_with_tokenizer_and_samplerPtr = _lookup<
     ffi.NativeFunction<ffi.Char Function(rwkv_model_t , rwkv_tokenizer_t , rwkv_sampler_t , ffi.Char , ffi.Float , ffi.Int , ffi.Float )>>('rwkv_abcmodel_run_with_tokenizer_and_sampler');
 late final _rwkv_abcmodel_run_with_tokenizer_and_sampler = _rwkv_abcmodel_run_with_tokenizer_and_samplerPtr.asFunction<int Function(rwkv_model_t , rwkv_tokenizer_t , rwkv_sampler_t , int , double , int , double )>();
 
+/// @brief Feed `input` to the model and decode the sampled token. The returned
+/// text holds whole UTF-8 code points only, the bytes of an incomplete one are
+/// returned with the next token. At the end of the response it is the held
+/// back bytes (usually none) followed by "<end>".
 ffi.Pointer<ffi.Char> rwkv_chatmodel_eval(rwkv_model_t model_handle,
 rwkv_tokenizer_t tokenizer_handle,
 rwkv_sampler_t sampler_handle,
@@ -223,8 +241,205 @@ late final _rwkv_get_soc_namePtr = _lookup<
     ffi.NativeFunction<ffi.Pointer<ffi.Char> Function()>>('rwkv_get_soc_name');
 late final _rwkv_get_soc_name = _rwkv_get_soc_namePtr.asFunction<ffi.Pointer<ffi.Char> Function()>();
 
+/// @brief Create a session on a model. A session holds its own states,
+/// penalty table and sampler, so that one model can be shared by many threads,
+/// each driving its own sessions. Runs on one model are serialized.
+/// 
+/// @param model_handle The handle to the model.
+/// @return rwkv_session_t The handle to the created session, or NULL if the
+/// model does not support sessions (web-rwkv, QNN and MTK).
+rwkv_session_t rwkv_session_create(rwkv_model_t model_handle,
+) {
+  return _rwkv_session_create(model_handle,
+);
+}
+
+late final _rwkv_session_createPtr = _lookup<
+    ffi.NativeFunction<rwkv_session_t Function(rwkv_model_t )>>('rwkv_session_create');
+late final _rwkv_session_create = _rwkv_session_createPtr.asFunction<rwkv_session_t Function(rwkv_model_t )>();
+
+void rwkv_session_destroy(rwkv_session_t session_handle,
+) {
+  return _rwkv_session_destroy(session_handle,
+);
+}
+
+late final _rwkv_session_destroyPtr = _lookup<
+    ffi.NativeFunction<ffi.Void Function(rwkv_session_t )>>('rwkv_session_destroy');
+late final _rwkv_session_destroy = _rwkv_session_destroyPtr.asFunction<void Function(rwkv_session_t )>();
+
+void rwkv_session_set_seed(rwkv_session_t session_handle,
+int seed,
+) {
+  return _rwkv_session_set_seed(session_handle,
+seed,
+);
+}
+
+late final _rwkv_session_set_seedPtr = _lookup<
+    ffi.NativeFunction<ffi.Void Function(rwkv_session_t , ffi.Int )>>('rwkv_session_set_seed');
+late final _rwkv_session_set_seed = _rwkv_session_set_seedPtr.asFunction<void Function(rwkv_session_t , int )>();
+
+void rwkv_session_clear_states(rwkv_session_t session_handle,
+) {
+  return _rwkv_session_clear_states(session_handle,
+);
+}
+
+late final _rwkv_session_clear_statesPtr = _lookup<
+    ffi.NativeFunction<ffi.Void Function(rwkv_session_t )>>('rwkv_session_clear_states');
+late final _rwkv_session_clear_states = _rwkv_session_clear_statesPtr.asFunction<void Function(rwkv_session_t )>();
+
+/// @brief Restrict the tokens a session can emit to `tokens`, e.g. the
+/// vocabulary of an ABC or MIDI tokenizer. Only these columns of the output
+/// head are computed. Pass n = 0 to allow all tokens again.
+/// 
+/// @return int 0 on success, 1 on failure.
+int rwkv_session_set_allowed_tokens(rwkv_session_t session_handle,
+ffi.Pointer<ffi.Int> tokens,
+int n,
+) {
+  return _rwkv_session_set_allowed_tokens(session_handle,
+tokens,
+n,
+);
+}
+
+late final _rwkv_session_set_allowed_tokensPtr = _lookup<
+    ffi.NativeFunction<ffi.Int Function(rwkv_session_t , ffi.Pointer<ffi.Int> , ffi.Int )>>('rwkv_session_set_allowed_tokens');
+late final _rwkv_session_set_allowed_tokens = _rwkv_session_set_allowed_tokensPtr.asFunction<int Function(rwkv_session_t , ffi.Pointer<ffi.Int> , int )>();
+
+int rwkv_session_eval_id(rwkv_session_t session_handle,
+int token,
+double temperature,
+int top_k,
+double top_p,
+double presence_penalty,
+double frequency_penalty,
+double penalty_decay,
+) {
+  return _rwkv_session_eval_id(session_handle,
+token,
+temperature,
+top_k,
+top_p,
+presence_penalty,
+frequency_penalty,
+penalty_decay,
+);
+}
+
+late final _rwkv_session_eval_idPtr = _lookup<
+    ffi.NativeFunction<ffi.Int Function(rwkv_session_t , ffi.Int , ffi.Float , ffi.Int , ffi.Float , ffi.Float , ffi.Float , ffi.Float )>>('rwkv_session_eval_id');
+late final _rwkv_session_eval_id = _rwkv_session_eval_idPtr.asFunction<int Function(rwkv_session_t , int , double , int , double , double , double , double )>();
+
+/// @brief Same as rwkv_chatmodel_eval but on a session. The returned string is
+/// owned by the session and valid until the next call on it.
+ffi.Pointer<ffi.Char> rwkv_session_chat_eval(rwkv_session_t session_handle,
+rwkv_tokenizer_t tokenizer_handle,
+ffi.Pointer<ffi.Char> input,
+double temperature,
+int top_k,
+double top_p,
+double presence_penalty,
+double frequency_penalty,
+double penalty_decay,
+) {
+  return _rwkv_session_chat_eval(session_handle,
+tokenizer_handle,
+input,
+temperature,
+top_k,
+top_p,
+presence_penalty,
+frequency_penalty,
+penalty_decay,
+);
+}
+
+late final _rwkv_session_chat_evalPtr = _lookup<
+    ffi.NativeFunction<ffi.Pointer<ffi.Char> Function(rwkv_session_t , rwkv_tokenizer_t , ffi.Pointer<ffi.Char> , ffi.Float , ffi.Int , ffi.Float , ffi.Float , ffi.Float , ffi.Float )>>('rwkv_session_chat_eval');
+late final _rwkv_session_chat_eval = _rwkv_session_chat_evalPtr.asFunction<ffi.Pointer<ffi.Char> Function(rwkv_session_t , rwkv_tokenizer_t , ffi.Pointer<ffi.Char> , double , int , double , double , double , double )>();
+
+/// @brief Stop rwkv_session_chat_eval at any of the `n` strings. The text is
+/// checked as it is generated, and text which may begin a stop string is held
+/// back until it is known not to be one. Once a stop string is completed,
+/// rwkv_session_stopped returns 1 and rwkv_session_chat_eval returns only the
+/// text before it, then "" until the end of the response ("<end>"), this
+/// function or rwkv_session_clear_states. At the end of the response the
+/// held back text is returned in front of "<end>". Pass n = 0 to remove the
+/// stop strings.
+/// 
+/// @return int 0 on success, 1 on failure (e.g. an empty stop string).
+int rwkv_session_set_stop_strings(rwkv_session_t session_handle,
+ffi.Pointer<ffi.Pointer<ffi.Char>> stop_strings,
+int n,
+) {
+  return _rwkv_session_set_stop_strings(session_handle,
+stop_strings,
+n,
+);
+}
+
+late final _rwkv_session_set_stop_stringsPtr = _lookup<
+    ffi.NativeFunction<ffi.Int Function(rwkv_session_t , ffi.Pointer<ffi.Pointer<ffi.Char>> , ffi.Int )>>('rwkv_session_set_stop_strings');
+late final _rwkv_session_set_stop_strings = _rwkv_session_set_stop_stringsPtr.asFunction<int Function(rwkv_session_t , ffi.Pointer<ffi.Pointer<ffi.Char>> , int )>();
+
+/// @brief Whether the current response of rwkv_session_chat_eval has completed
+/// a stop string (see rwkv_session_set_stop_strings).
+/// 
+/// @return int 1 if it has, 0 otherwise.
+int rwkv_session_stopped(rwkv_session_t session_handle,
+) {
+  return _rwkv_session_stopped(session_handle,
+);
+}
+
+late final _rwkv_session_stoppedPtr = _lookup<
+    ffi.NativeFunction<ffi.Int Function(rwkv_session_t )>>('rwkv_session_stopped');
+late final _rwkv_session_stopped = _rwkv_session_stoppedPtr.asFunction<int Function(rwkv_session_t )>();
+
+/// @brief Feed `tokens[i]` to `session_handles[i]` and sample the next token of
+/// each session into `output_ids[i]`, for `n` sessions of one model.
+/// 
+/// @return int 0 on success, 1 on failure. If a session is not of this model,
+/// nothing is run. If the evaluation of a session fails, the sessions before
+/// it keep their new states and output ids, the sessions after it are
+/// unchanged, and the failed session should be cleared by
+/// rwkv_session_clear_states before it is used again.
+int rwkv_model_eval_batch(rwkv_model_t model_handle,
+ffi.Pointer<rwkv_session_t> session_handles,
+ffi.Pointer<ffi.Int> tokens,
+int n,
+double temperature,
+int top_k,
+double top_p,
+double presence_penalty,
+double frequency_penalty,
+double penalty_decay,
+ffi.Pointer<ffi.Int> output_ids,
+) {
+  return _rwkv_model_eval_batch(model_handle,
+session_handles,
+tokens,
+n,
+temperature,
+top_k,
+top_p,
+presence_penalty,
+frequency_penalty,
+penalty_decay,
+output_ids,
+);
+}
+
+late final _rwkv_model_eval_batchPtr = _lookup<
+    ffi.NativeFunction<ffi.Int Function(rwkv_model_t , ffi.Pointer<rwkv_session_t> , ffi.Pointer<ffi.Int> , ffi.Int , ffi.Float , ffi.Int , ffi.Float , ffi.Float , ffi.Float , ffi.Float , ffi.Pointer<ffi.Int> )>>('rwkv_model_eval_batch');
+late final _rwkv_model_eval_batch = _rwkv_model_eval_batchPtr.asFunction<int Function(rwkv_model_t , ffi.Pointer<rwkv_session_t> , ffi.Pointer<ffi.Int> , int , double , int , double , double , double , double , ffi.Pointer<ffi.Int> )>();
+
 }
 
 typedef rwkv_model_t = ffi.Pointer<ffi.Void>;
 typedef rwkv_tokenizer_t = ffi.Pointer<ffi.Void>;
 typedef rwkv_sampler_t = ffi.Pointer<ffi.Void>;
+typedef rwkv_session_t = ffi.Pointer<ffi.Void>;
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <vector>
+
+#include <kernels/cpu/topk.h>
+#include <kernels/registry.h>
+#include <tensor.h>
+
+namespace rwkv {
+namespace cpu {
+
+namespace {
+// the logits of a tile stay in L1
+constexpr int kTileSize = 256;
+
+template <typename T> float ToFloat(T x) { return static_cast<float>(x); }
+
+template <typename W>
+void HeadTopKImpl(const std::vector<float> &x, const W *weight, int n_vocab,
+                  TopKAccumulator &acc) {
+  const int n_embd = x.size();
+  float logits[kTileSize];
+  for (int tile_begin = 0; tile_begin < n_vocab; tile_begin += kTileSize) {
+    const int n = std::min(kTileSize, n_vocab - tile_begin);
+    std::fill(logits, logits + n, 0.f);
+    // weight is [n_embd, n_vocab], so the inner loop is contiguous
+    for (int c = 0; c < n_embd; c++) {
+      const W *row = weight + static_cast<size_t>(c) * n_vocab + tile_begin;
+      const float xc = x[c];
+      for (int j = 0; j < n; j++) {
+        logits[j] += xc * ToFloat(row[j]);
+      }
+    }
+    acc.PushTile(logits, tile_begin, n);
+  }
+}
+} // namespace
+
+std::tuple<Tensor, Tensor, float> head_topk(const Tensor &x,
+                                            const Tensor &weight, int k) {
+  RV_CHECK(weight.shape().size() == 2);
+  RV_CHECK(x.numel() == weight.size(0));
+  RV_CHECK(k >= 1);
+  const int n_embd = weight.size(0);
+  const int n_vocab = weight.size(1);
+  std::vector<float> x_fp32(n_embd);
+  if (x.dtype() == DType::kFloat32) {
+    std::copy_n(x.data_ptr<float>(), n_embd, x_fp32.begin());
+  } else if (x.dtype() == DType::kFloat16) {
+    std::copy_n(x.data_ptr<float16>(), n_embd, x_fp32.begin());
+  } else {
+    RV_UNIMPLEMENTED();
+  }
+  TopKAccumulator acc(std::min(k, n_vocab));
+  if (weight.dtype() == DType::kFloat32) {
+    HeadTopKImpl(x_fp32, weight.data_ptr<float>(), n_vocab, acc);
+  } else if (weight.dtype() == DType::kFloat16) {
+    HeadTopKImpl(x_fp32, weight.data_ptr<float16>(), n_vocab, acc);
+  } else {
+    RV_UNIMPLEMENTED();
+  }
+  return acc.Finish();
+}
+
+KernelRegister head_topk_reg("head_topk", Device::kCPU, head_topk);
+
+} // namespace cpu
+} // namespace rwkv
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+#include <tensor.h>
+
+namespace rwkv {
+namespace cpu {
+
+// Keeps the `k` largest logits pushed so far and the log-sum-exp of all of
+// them, so that the logits never need to be stored as a whole. Equal logits
+// are ordered by id like std::max_element does.
+class TopKAccumulator {
+public:
+  explicit TopKAccumulator(int k) : _k(k) { _heap.reserve(k); }
+
+  void Push(float logit, int id) {
+    if (_heap.size() < _k) {
+      _heap.emplace_back(logit, id);
+      std::push_heap(_heap.begin(), _heap.end(), Better);
+    } else if (Better({logit, id}, _heap.front())) {
+      std::pop_heap(_heap.begin(), _heap.end(), Better);
+      _heap.back() = {logit, id};
+      std::push_heap(_heap.begin(), _heap.end(), Better);
+    }
+  }
+
+  // logits[i] is the logit of id `first_id + i`
+  void PushTile(const float *logits, int first_id, int n) {
+    float tile_max = -std::numeric_limits<float>::infinity();
+    for (int i = 0; i < n; i++) {
+      tile_max = std::max(tile_max, logits[i]);
+    }
+    float tile_sum = 0.f;
+    for (int i = 0; i < n; i++) {
+      tile_sum += std::exp(logits[i] - tile_max);
+    }
+    AddExpSum(tile_max, tile_sum);
+    for (int i = 0; i < n; i++) {
+      // cheap rejection before touching the heap
+      if (_heap.size() < _k || logits[i] >= _heap.front().first) {
+        Push(logits[i], first_id + i);
+      }
+    }
+  }
+
+  // merge sum(exp(logit - max)) of logits pushed elsewhere (e.g. on device)
+  void AddExpSum(float max, float sum) {
+    if (sum <= 0.f) {
+      return;
+    }
+    if (max > _max) {
+      _sum = _sum * std::exp(_max - max) + sum;
+      _max = max;
+    } else {
+      _sum += sum * std::exp(max - _max);
+    }
+  }
+
+  // values (float32, [k]), ids (int32, [k]) in descending order, and the
+  // log-sum-exp, all on CPU
+  std::tuple<Tensor, Tensor, float> Finish() {
+    std::sort_heap(_heap.begin(), _heap.end(), Better);
+    const int n = _heap.size();
+    auto values = Tensor::Empty({n}, DType::kFloat32, Device::kCPU);
+    auto ids = Tensor::Empty({n}, DType::kInt32, Device::kCPU);
+    for (int i = 0; i < n; i++) {
+      values.data_ptr<float>()[i] = _heap[i].first;
+      ids.data_ptr<int>()[i] = _heap[i].second;
+    }
+    return {values, ids, _max + std::log(_sum)};
+  }
+
+private:
+  using Entry = std::pair<float, int>;
+  // a min-heap by this order keeps the worst kept entry at the front
+  static bool Better(const Entry &a, const Entry &b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  }
+
+  int _k;
+  std::vector<Entry> _heap;
+  float _max = -std::numeric_limits<float>::infinity();
+  float _sum = 0.f;
+};
+
+} // namespace cpu
+} // namespace rwkv
@@ -0,0 +1,162 @@
+#include <climits>
+
+#include <cub/cub.cuh>
+#include <cuda_fp16.h>
+#include <math_constants.h>
+
+#include <kernels/cpu/topk.h>
+#include <kernels/registry.h>
+#include <tensor.h>
+
+namespace rwkv {
+namespace cuda {
+namespace {
+constexpr int kTileSize = 256;
+// the per-tile selection below is O(k) block reductions
+constexpr int kMaxK = 64;
+
+struct Candidate {
+  float value;
+  int id;
+};
+
+struct BetterCandidate {
+  __device__ __forceinline__ Candidate operator()(const Candidate &a,
+                                                  const Candidate &b) const {
+    return (a.value > b.value || (a.value == b.value && a.id < b.id)) ? a : b;
+  }
+};
+
+__device__ __forceinline__ float ToFloat(float x) { return x; }
+__device__ __forceinline__ float ToFloat(half x) { return __half2float(x); }
+
+// One block per tile of kTileSize columns of the head. Every thread computes
+// one logit, then the block writes out only the top-k of the tile and
+// sum(exp(logit - tile_max)), so the [n_vocab] logits never reach global
+// memory.
+template <typename X, typename W>
+__global__ void head_topk_kernel(const X *__restrict__ x,
+                                 const W *__restrict__ weight, int n_embd,
+                                 int n_vocab, int k, float *cand_values,
+                                 int *cand_ids, float *tile_max,
+                                 float *tile_sum) {
+  using BlockReduceF = cub::BlockReduce<float, kTileSize>;
+  using BlockReduceC = cub::BlockReduce<Candidate, kTileSize>;
+  __shared__ union {
+    typename BlockReduceF::TempStorage f;
+    typename BlockReduceC::TempStorage c;
+  } temp;
+  __shared__ float shared_max;
+  __shared__ Candidate shared_best;
+  extern __shared__ float x_shared[];
+
+  for (int c = threadIdx.x; c < n_embd; c += blockDim.x) {
+    x_shared[c] = ToFloat(x[c]);
+  }
+  __syncthreads();
+
+  const int id = blockIdx.x * kTileSize + threadIdx.x;
+  const bool valid = id < n_vocab;
+  float logit = -CUDART_INF_F;
+  if (valid) {
+    float sum = 0.f;
+    // consecutive threads read consecutive columns, so the loads coalesce
+    for (int c = 0; c < n_embd; c++) {
+      sum += x_shared[c] * ToFloat(weight[static_cast<size_t>(c) * n_vocab + id]);
+    }
+    logit = sum;
+  }
+
+  const float max = BlockReduceF(temp.f).Reduce(logit, cub::Max());
+  if (threadIdx.x == 0) {
+    shared_max = max;
+  }
+  __syncthreads();
+  const float e = valid ? __expf(logit - shared_max) : 0.f;
+  const float sum = BlockReduceF(temp.f).Sum(e);
+  if (threadIdx.x == 0) {
+    tile_max[blockIdx.x] = shared_max;
+    tile_sum[blockIdx.x] = sum;
+  }
+
+  // k rounds of block argmax, the winner drops out of the next rounds
+  Candidate mine{logit, valid ? id : INT_MAX};
+  for (int i = 0; i < k; i++) {
+    __syncthreads();
+    const Candidate best =
+        BlockReduceC(temp.c).Reduce(mine, BetterCandidate());
+    if (threadIdx.x == 0) {
+      shared_best = best;
+      cand_values[blockIdx.x * k + i] = best.value;
+      cand_ids[blockIdx.x * k + i] = best.id < n_vocab ? best.id : -1;
+    }
+    __syncthreads();
+    if (shared_best.id == mine.id) {
+      mine = {-CUDART_INF_F, INT_MAX};
+    }
+  }
+}
+
+template <typename X, typename W>
+void launch(const Tensor &x, const Tensor &weight, int k, int num_tiles,
+            Tensor &cand_values, Tensor &cand_ids, Tensor &tile_max,
+            Tensor &tile_sum) {
+  const int n_embd = weight.size(0);
+  const int n_vocab = weight.size(1);
+  head_topk_kernel<X, W><<<num_tiles, kTileSize, n_embd * sizeof(float)>>>(
+      x.data_ptr<X>(), weight.data_ptr<W>(), n_embd, n_vocab, k,
+      cand_values.data_ptr<float>(), cand_ids.data_ptr<int>(),
+      tile_max.data_ptr<float>(), tile_sum.data_ptr<float>());
+}
+} // namespace
+
+std::tuple<Tensor, Tensor, float> head_topk(const Tensor &x,
+                                            const Tensor &weight, int k) {
+  RV_CHECK(weight.shape().size() == 2);
+  RV_CHECK(x.numel() == weight.size(0));
+  RV_CHECK(k >= 1 && k <= kMaxK) << "k should be in [1, " << kMaxK << "]";
+  const int n_vocab = weight.size(1);
+  const int num_tiles = (n_vocab + kTileSize - 1) / kTileSize;
+  auto cand_values =
+      Tensor::Empty({num_tiles * k}, DType::kFloat32, Device::kCUDA);
+  auto cand_ids = Tensor::Empty({num_tiles * k}, DType::kInt32, Device::kCUDA);
+  auto tile_max = Tensor::Empty({num_tiles}, DType::kFloat32, Device::kCUDA);
+  auto tile_sum = Tensor::Empty({num_tiles}, DType::kFloat32, Device::kCUDA);
+
+  if (x.dtype() == DType::kFloat16 && weight.dtype() == DType::kFloat16) {
+    launch<half, half>(x, weight, k, num_tiles, cand_values, cand_ids,
+                       tile_max, tile_sum);
+  } else if (x.dtype() == DType::kFloat32 &&
+             weight.dtype() == DType::kFloat32) {
+    launch<float, float>(x, weight, k, num_tiles, cand_values, cand_ids,
+                         tile_max, tile_sum);
+  } else if (x.dtype() == DType::kFloat32 &&
+             weight.dtype() == DType::kFloat16) {
+    launch<float, half>(x, weight, k, num_tiles, cand_values, cand_ids,
+                        tile_max, tile_sum);
+  } else {
+    RV_UNIMPLEMENTED();
+  }
+
+  // only num_tiles * (k + 1) floats are copied back instead of the logits
+  cand_values = Copy(cand_values, Device::kCPU);
+  cand_ids = Copy(cand_ids, Device::kCPU);
+  tile_max = Copy(tile_max, Device::kCPU);
+  tile_sum = Copy(tile_sum, Device::kCPU);
+  cpu::TopKAccumulator acc(std::min(k, n_vocab));
+  for (int t = 0; t < num_tiles; t++) {
+    acc.AddExpSum(tile_max.data_ptr<float>()[t], tile_sum.data_ptr<float>()[t]);
+    for (int i = 0; i < k; i++) {
+      const int id = cand_ids.data_ptr<int>()[t * k + i];
+      if (id >= 0) {
+        acc.Push(cand_values.data_ptr<float>()[t * k + i], id);
+      }
+    }
+  }
+  return acc.Finish();
+}
+
+KernelRegister head_topk_reg("head_topk", Device::kCUDA, head_topk);
+
+} // namespace cuda
+} // namespace rwkv
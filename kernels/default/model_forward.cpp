@@ -19,6 +19,52 @@ namespace rwkv {
 
 namespace def {
 
+Tensor ModelForwardLayers(Model *model, Device device, Tensor x,
+                          std::vector<std::vector<Tensor>> &states,
+                          int layer_begin, int layer_end, Tensor &v_first);
+Tensor ModelForwardHead(Model *model, Device device, Tensor x);
+
+// the embedding weights as one [n_vocab, n_embd] tensor of the weight dtype,
+// to be written into an exported graph
+Tensor EmbeddingWeightsForExport(Model *model) {
+  Tensor embd_weights_cpu =
+      Tensor::Empty({static_cast<long>(model->_embd_weights.size()),
+                     model->_embd_weights[0].shape()[0]},
+                    model->weight_dtype(), Device::kCPU);
+  {
+    auto fr_embd_dtype = model->_embd_weights[0].dtype();
+    auto weight_dtype = model->weight_dtype();
+    if (fr_embd_dtype == DType::kFloat16 &&
+        weight_dtype == DType::kFloat32) {
+      auto *ptr = embd_weights_cpu.data_ptr<float>();
+      for (int i = 0; i < model->_embd_weights.size(); i++) {
+        for (int j = 0; j < model->_n_embd; j++) {
+          *ptr++ = model->_embd_weights[i].data_ptr<float16>()[j];
+        }
+      }
+    } else if (fr_embd_dtype == DType::kFloat32 &&
+               weight_dtype == DType::kFloat32) {
+      auto *ptr = embd_weights_cpu.data_ptr<float>();
+      for (int i = 0; i < model->_embd_weights.size(); i++) {
+        for (int j = 0; j < model->_n_embd; j++) {
+          *ptr++ = model->_embd_weights[i].data_ptr<float>()[j];
+        }
+      }
+    } else if (fr_embd_dtype == DType::kFloat16 &&
+               weight_dtype == DType::kFloat16) {
+      auto *ptr = embd_weights_cpu.data_ptr<float16>();
+      for (int i = 0; i < model->_embd_weights.size(); i++) {
+        for (int j = 0; j < model->_n_embd; j++) {
+          *ptr++ = model->_embd_weights[i].data_ptr<float16>()[j];
+        }
+      }
+    } else {
+      RV_UNIMPLEMENTED();
+    }
+  }
+  return embd_weights_cpu;
+}
+
 Tensor ModelForward(Model *model, Device device, int id) {
   auto &states = model->states();
   Tensor x = [&]() -> Tensor {
@@ -27,41 +73,7 @@ Tensor ModelForward(Model *model, Device device, int id) {
         || model->_act_device == Device::kONNXMeta
 #endif
     ) {
-      Tensor embd_weights_cpu =
-          Tensor::Empty({static_cast<long>(model->_embd_weights.size()),
-                         model->_embd_weights[0].shape()[0]},
-                        model->weight_dtype(), Device::kCPU);
-      {
-        auto fr_embd_dtype = model->_embd_weights[0].dtype();
-        auto weight_dtype = model->weight_dtype();
-        if (fr_embd_dtype == DType::kFloat16 &&
-            weight_dtype == DType::kFloat32) {
-          auto *ptr = embd_weights_cpu.data_ptr<float>();
-          for (int i = 0; i < model->_embd_weights.size(); i++) {
-            for (int j = 0; j < model->_n_embd; j++) {
-              *ptr++ = model->_embd_weights[i].data_ptr<float16>()[j];
-            }
-          }
-        } else if (fr_embd_dtype == DType::kFloat32 &&
-                   weight_dtype == DType::kFloat32) {
-          auto *ptr = embd_weights_cpu.data_ptr<float>();
-          for (int i = 0; i < model->_embd_weights.size(); i++) {
-            for (int j = 0; j < model->_n_embd; j++) {
-              *ptr++ = model->_embd_weights[i].data_ptr<float>()[j];
-            }
-          }
-        } else if (fr_embd_dtype == DType::kFloat16 &&
-                   weight_dtype == DType::kFloat16) {
-          auto *ptr = embd_weights_cpu.data_ptr<float16>();
-          for (int i = 0; i < model->_embd_weights.size(); i++) {
-            for (int j = 0; j < model->_n_embd; j++) {
-              *ptr++ = model->_embd_weights[i].data_ptr<float16>()[j];
-            }
-          }
-        } else {
-          RV_UNIMPLEMENTED();
-        }
-      }
+      Tensor embd_weights_cpu = EmbeddingWeightsForExport(model);
       if (model->_act_device == Device::kNCNNMeta) {
         Tensor id_tensor = ncnnmeta::add_input({1}, "input_id");
         for (int i = 0; i < states.size(); i++) {
@@ -87,7 +99,6 @@ Tensor ModelForward(Model *model, Device device, int id) {
     return model->_embd_weights[id];
   }();
 
-  auto &params = model->_params;
 #ifdef FR_ENABLE_ONNX
   if (model->_act_device == Device::kONNXMeta) {
     for (int i = 0; i < states.size(); i++) {
@@ -102,10 +113,39 @@ Tensor ModelForward(Model *model, Device device, int id) {
   }
 #endif
 
-  int param_idx = 0;
   Tensor v_first = Tensor::Empty({0}, DType::kFloat32, Device::kNCNNMeta);
+  x = def::ModelForwardLayers(model, device, x, states, 0, states.size(),
+                              v_first);
+  return def::ModelForwardHead(model, device, x);
+}
+
+// index of the first parameter of layer `layer` in `model->_params`, see
+// init_model for the order of the parameters
+static int LayerParamIndex(const Model *model, int layer) {
+  const auto &version = model->_version;
+  if (version == "4") {
+    return layer * 18;
+  } else if (version == "5") {
+    return layer * 20;
+  } else if (version == "5.1" || version == "5.2") {
+    return layer * 22;
+  } else if (version == "6") {
+    return layer * 28;
+  } else if (version == "7") {
+    // layer 0 has no v0, v1 and v2
+    return layer == 0 ? 0 : 30 + (layer - 1) * 33;
+  }
+  RV_UNIMPLEMENTED();
+}
 
-  for (int i = 0; i < states.size(); ++i) {
+Tensor ModelForwardLayers(Model *model, Device device, Tensor x,
+                          std::vector<std::vector<Tensor>> &states,
+                          int layer_begin, int layer_end, Tensor &v_first) {
+  auto &params = model->_params;
+  int param_idx = LayerParamIndex(model, layer_begin);
+
+  for (int i = layer_begin; i < layer_end; ++i) {
+    model->CheckCancelled();
     auto &state = states[i];
 
     {
@@ -245,15 +285,20 @@ Tensor ModelForward(Model *model, Device device, int id) {
       scalar_div_(x, 2);
     }
   }
+  return x;
+}
+
+Tensor ModelForwardHeadSlice(Model *model, Device device, Tensor x,
+                             const Tensor &head_weight) {
+  auto &params = model->_params;
+  int param_idx = LayerParamIndex(model, model->_n_layer);
 
   //             x = F.layer_norm(x, (args.n_embd,),
   //             weight=w['ln_out.weight'], bias=w['ln_out.bias'])
   x = layernorm(x, params[param_idx], params[param_idx + 1]);
 
   //                 x = x @ w['head.weight']
-  ncnnmeta::disable_int4(true);
-  x = matmul(x, params[param_idx + 2]);
-  ncnnmeta::disable_int4(false);
+  x = matmul(x, head_weight);
   if (x.dtype() == DType::kFloat16) {
     x = cast_dtype(x, DType::kFloat32);
   }
@@ -263,6 +308,21 @@ Tensor ModelForward(Model *model, Device device, int id) {
   return x;
 }
 
+Tensor ModelForwardHead(Model *model, Device device, Tensor x) {
+  int param_idx = LayerParamIndex(model, model->_n_layer);
+  return def::ModelForwardHeadSlice(model, device, x,
+                                    model->_params[param_idx + 2]);
+}
+
+std::tuple<Tensor, Tensor, float> ModelForwardHeadTopK(Model *model,
+                                                       Device device, Tensor x,
+                                                       int k) {
+  auto &params = model->_params;
+  int param_idx = LayerParamIndex(model, model->_n_layer);
+  x = layernorm(x, params[param_idx], params[param_idx + 1]);
+  return head_topk(x, params[param_idx + 2], k);
+}
+
 KernelRegister model_forward_reg_1("model_forward", Device::kCPU, ModelForward);
 KernelRegister model_forward_reg_2("model_forward", Device::kCUDA,
                                    ModelForward);
@@ -270,6 +330,26 @@ KernelRegister model_forward_reg_3("model_forward", Device::kNCNNMeta,
                                    ModelForward);
 KernelRegister model_forward_reg_4("model_forward", Device::kONNXMeta,
                                    ModelForward);
+KernelRegister model_forward_layers_reg_1("model_forward_layers",
+                                          Device::kCPU, ModelForwardLayers);
+KernelRegister model_forward_layers_reg_2("model_forward_layers",
+                                          Device::kCUDA, ModelForwardLayers);
+KernelRegister model_forward_head_reg_1("model_forward_head", Device::kCPU,
+                                        ModelForwardHead);
+KernelRegister model_forward_head_reg_2("model_forward_head", Device::kCUDA,
+                                        ModelForwardHead);
+KernelRegister model_forward_head_slice_reg_1("model_forward_head_slice",
+                                              Device::kCPU,
+                                              ModelForwardHeadSlice);
+KernelRegister model_forward_head_slice_reg_2("model_forward_head_slice",
+                                              Device::kCUDA,
+                                              ModelForwardHeadSlice);
+KernelRegister model_forward_head_topk_reg_1("model_forward_head_topk",
+                                             Device::kCPU,
+                                             ModelForwardHeadTopK);
+KernelRegister model_forward_head_topk_reg_2("model_forward_head_topk",
+                                             Device::kCUDA,
+                                             ModelForwardHeadTopK);
 
 } // namespace def
 } // namespace rwkv
@@ -22,6 +22,8 @@ namespace rwkv {
 
 namespace def {
 
+Tensor EmbeddingWeightsForExport(Model *model);
+
 static Tensor CopyToCPUIfAvailable(Tensor x) {
   // TODO: more elegant
   try {
@@ -34,15 +36,34 @@ static Tensor CopyToCPUIfAvailable(Tensor x) {
 Tensor ModelForwardSeqFallback(Model *model, Device device,
                        const std::vector<int> &ids,
                        bool full_output) {
-  RV_CHECK(!full_output) << "full_output is not supported in fallback mode";
+  if (!full_output) {
+    for (int i = 0; i < ids.size(); ++i) {
+      model->CheckCancelled();
+      auto id = ids[i];
+      auto out = ModelForward(model, model->_act_device, id);
+      if (i == ids.size() - 1) {
+        return CopyToCPUIfAvailable(out);
+      }
+    }
+    RV_UNIMPLEMENTED();
+  }
+  // run token by token and stack the logits into a [len(ids), n_vocab] tensor
+  auto out = CopyToCPUIfAvailable(
+      ModelForward(model, model->_act_device, ids[0]));
+  RV_CHECK(out.device() == Device::kCPU && out.dtype() == DType::kFloat32);
+  const auto n_vocab = out.numel();
+  auto full = Tensor::Empty({static_cast<LengthType>(ids.size()), n_vocab},
+                            DType::kFloat32, Device::kCPU);
   for (int i = 0; i < ids.size(); ++i) {
-    auto id = ids[i];
-    auto out = ModelForward(model, model->_act_device, id);
-    if (i == ids.size() - 1) {
-      return CopyToCPUIfAvailable(out);
+    if (i > 0) {
+      model->CheckCancelled();
+      out = CopyToCPUIfAvailable(
+          ModelForward(model, model->_act_device, ids[i]));
     }
+    memcpy(full.data_ptr<float>() + i * n_vocab, out.data_ptr<float>(),
+           n_vocab * sizeof(float));
   }
-  RV_UNIMPLEMENTED();
+  return full;
 }
 
 Tensor ModelForwardSeq(Model *model, Device device,
@@ -50,6 +71,19 @@ Tensor ModelForwardSeq(Model *model, Device device,
                        bool full_output) {
   auto &states = model->states();
   Tensor x = [&]() -> Tensor {
+    if (model->_act_device == Device::kNCNNMeta) {
+      Tensor id_tensor = ncnnmeta::add_input(
+          {static_cast<LengthType>(id.size())}, "input_id");
+      for (int i = 0; i < states.size(); i++) {
+        for (int j = 0; j < states[i].size(); j++) {
+          auto state_name =
+              "state_" + std::to_string(i) + "_" + std::to_string(j);
+          auto &state_tensor = states[i][j];
+          state_tensor = ncnnmeta::add_input(state_tensor.shape(), state_name);
+        }
+      }
+      return ncnnmeta::Embedding(EmbeddingWeightsForExport(model), id_tensor);
+    }
 #ifdef FR_ENABLE_ONNX
     RV_UNIMPLEMENTED();
     // if (model->_act_device == Device::kONNXMeta) {
@@ -77,17 +111,6 @@ Tensor ModelForwardSeq(Model *model, Device device,
   }();
 
   auto &params = model->_params;
-  if (model->_act_device == Device::kNCNNMeta) {
-    x = ncnnmeta::add_input(x.shape(), "input");
-    for (int i = 0; i < states.size(); i++) {
-      for (int j = 0; j < states[i].size(); j++) {
-        auto state_name =
-            "state_" + std::to_string(i) + "_" + std::to_string(j);
-        auto &state_tensor = states[i][j];
-        state_tensor = ncnnmeta::add_input(state_tensor.shape(), state_name);
-      }
-    }
-  }
 #ifdef FR_ENABLE_ONNX
   if (model->_act_device == Device::kONNXMeta) {
     for (int i = 0; i < states.size(); i++) {
@@ -103,8 +126,10 @@ Tensor ModelForwardSeq(Model *model, Device device,
 #endif
 
   int param_idx = 0;
+  Tensor v_first = Tensor::Empty({0}, DType::kFloat32, Device::kNCNNMeta);
 
   for (int i = 0; i < states.size(); ++i) {
+    model->CheckCancelled();
     auto &state = states[i];
 
     {
@@ -139,25 +164,53 @@ Tensor ModelForwardSeq(Model *model, Device device,
           mark_as_output(state[1], "output_state_" + std::to_string(i) + "_1");
         }
         param_idx += 15;
+      } else if (model->_version == "7") {
+        // layer 0 has no v0, v1 and v2, see ModelForwardLayers
+        const int v_idx = i == 0 ? param_idx + 10 : param_idx + 13;
+        const int w_idx = i == 0 ? param_idx + 13 : param_idx + 16;
+        std::tie(x, state[0], state[1], v_first) = att_seq_v7(
+            x, state[0], state[1], v_first, i, params[param_idx],
+            params[param_idx + 1], params[param_idx + 2], params[param_idx + 3],
+            params[param_idx + 4], params[param_idx + 5], params[param_idx + 6],
+            params[param_idx + 7], params[param_idx + 8], params[param_idx + 9],
+            params[param_idx + 10], params[param_idx + 11],
+            params[param_idx + 12], params[v_idx], params[v_idx + 1],
+            params[v_idx + 2], params[w_idx], params[w_idx + 1],
+            params[w_idx + 2], params[w_idx + 3], params[w_idx + 4],
+            params[w_idx + 5], params[w_idx + 6], params[w_idx + 7],
+            params[w_idx + 8], params[w_idx + 9], params[w_idx + 10],
+            params[w_idx + 11]);
+        if (device == Device::kNCNNMeta || device == Device::kONNXMeta) {
+          mark_as_output(state[0], "output_state_" + std::to_string(i) + "_0");
+          mark_as_output(state[1], "output_state_" + std::to_string(i) + "_1");
+        }
+        param_idx = w_idx + 12;
       } else {
         RV_UNIMPLEMENTED();
       }
     }
     {
       int offset = 4;
-      if (model->_version.substr(0, 1) == "5") {
+      if (model->_version.substr(0, 1) != "4") {
         offset = 2;
       }
 
-      std::tie(x, state[offset]) = ffn_seq(
-          x, state[offset], params[param_idx], params[param_idx + 1],
-          params[param_idx + 2], params[param_idx + 3], params[param_idx + 4],
-          params[param_idx + 5], params[param_idx + 6]);
+      if (model->_version == "7") {
+        std::tie(x, state[offset]) = ffn_seq_v7(
+            x, state[offset], params[param_idx], params[param_idx + 1],
+            params[param_idx + 2], params[param_idx + 3], params[param_idx + 4]);
+        param_idx += 5;
+      } else {
+        std::tie(x, state[offset]) = ffn_seq(
+            x, state[offset], params[param_idx], params[param_idx + 1],
+            params[param_idx + 2], params[param_idx + 3], params[param_idx + 4],
+            params[param_idx + 5], params[param_idx + 6]);
+        param_idx += 7;
+      }
       if (device == Device::kNCNNMeta || device == Device::kONNXMeta) {
         mark_as_output(state[offset], "output_state_" + std::to_string(i) +
                                           "_" + std::to_string(offset));
       }
-      param_idx += 7;
     }
 
     if (x.dtype() == DType::kFloat16 && (i + 1) % 6 == 0) {
@@ -187,14 +240,14 @@ KernelRegister model_forward_seq_reg_1("model_forward_seq", Device::kCPU,
                                        ModelForwardSeqFallback);
 KernelRegister model_forward_seq_reg_2("model_forward_seq", Device::kCUDA,
                                        ModelForwardSeq);
-KernelRegister model_forward_seq_reg_3("model_forward_seq", Device::kNCNN,
-                                       ModelForwardSeqFallback);
 KernelRegister model_forward_seq_reg_4("model_forward_seq", Device::kONNX,
                                        ModelForwardSeqFallback);
 KernelRegister model_forward_seq_reg_5("model_forward_seq", Device::kQNN,
                                        ModelForwardSeqFallback);
 KernelRegister model_forward_seq_reg_6("model_forward_seq", Device::kMTK,
                                        ModelForwardSeqFallback);
+KernelRegister model_forward_seq_reg_7("model_forward_seq", Device::kNCNNMeta,
+                                       ModelForwardSeq);
 
 } // namespace def
 } // namespace rwkv
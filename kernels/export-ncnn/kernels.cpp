@@ -1,17 +1,25 @@
 #include <kernels/export-ncnn/kernels.h>
+#include <kernels/export-ncnn/quantize.h>
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include <stdio.h>
 #include <string>
+#include <vector>
 
 #include <kernels/allocator.h>
 #include <kernels/registry.h>
 #include <kernels/shape/shape_inference.h>
 #include <model.h>
+#include <quant_plan.h>
 #include <tensor.h>
+#include <thread_pool.h>
+#include <utils.h>
 
 namespace rwkv {
 namespace cpu {
@@ -41,19 +49,21 @@ int add_and_get_blob_num(int num) {
 
 void reset_blob_num() { *get_blob_num_ptr() = 0; }
 
-bool* get_disable_int4() {
-  static bool _disable_int4 = false;
-  return &_disable_int4;
-}
-
-void disable_int4(bool flag) {
-  *get_disable_int4() = flag;
-}
-
 FILE *bp, *pp;
 std::string _pp_path;
 std::string _config_path;
 DType _weight_dtype;
+int _seq_len = 0;
+// see ExportCalibrationModel
+bool _calibration = false;
+ActStats _act_stats;
+// the names of the weights which looked up their statistics
+std::set<std::string> _used_act_stats;
+QuantPlan _quant_plan;
+int _n_layer = 0;
+// the lowest precision of the quantized weights, written to the config so
+// that the runtime checks the cpu features and sets the options it needs
+DType _config_weight_dtype;
 
 void init(DType weight_dtype, const std::string &bp_path,
           const std::string &pp_path, const std::string &config_path) {
@@ -64,6 +74,7 @@ void init(DType weight_dtype, const std::string &bp_path,
   _pp_path = pp_path;
   _config_path = config_path;
   _weight_dtype = weight_dtype;
+  _config_weight_dtype = DType::kFloat16;
 }
 
 void destroy(const Model &model) {
@@ -83,12 +94,13 @@ void destroy(const Model &model) {
     out << pp_str;
     out.close();
   }
-  {
+  // the sequence graph shares the config of the single token graph
+  if (!_config_path.empty()) {
     std::ofstream config_file(_config_path);
     config_file << "version: " << model.version() << std::endl;
     config_file << "act_dtype: " << dtype_to_string(DType::kFloat32)
                 << std::endl;
-    config_file << "weight_dtype: " << dtype_to_string(_weight_dtype)
+    config_file << "weight_dtype: " << dtype_to_string(_config_weight_dtype)
                 << std::endl;
     config_file << "head_size: " << model.head_size() << std::endl;
     config_file << "n_layer: " << model.n_layer() << std::endl;
@@ -97,26 +109,86 @@ void destroy(const Model &model) {
     config_file << "n_ffn: " << model.n_ffn() << std::endl;
     std::string kNcnnImplVersion = "2";
     config_file << "ncnn_impl_version: " << kNcnnImplVersion << std::endl;
+    if (_seq_len > 1) {
+      config_file << "seq_len: " << _seq_len << std::endl;
+    }
     config_file.close();
   }
 }
 
 void ExportModel(const std::string &input_path, DType weight_dtype,
-                 const std::string &output_prefix) {
+                 const std::string &output_prefix, int seq_len,
+                 const std::string &act_stats_path,
+                 const std::string &quant_plan_path) {
   RV_CHECK(weight_dtype == DType::kFloat16 || weight_dtype == DType::kInt8 ||
            weight_dtype == DType::kInt4);
+  RV_CHECK(seq_len >= 0) << "seq_len should be >= 0, but got " << seq_len;
   default_dispatch_device() = Device::kNCNNMeta;
 
+  _act_stats.clear();
+  _used_act_stats.clear();
+  if (!act_stats_path.empty()) {
+    const std::string data = read_file(act_stats_path);
+    auto unpacker = msgpack::unpack(data.data(), data.size());
+    _act_stats = unpacker.get().as<ActStats>();
+  }
+  _quant_plan = quant_plan_path.empty() ? QuantPlan()
+                                        : QuantPlan::FromFile(quant_plan_path);
+
+  _seq_len = seq_len;
   init(weight_dtype, output_prefix + ".bin",
        output_prefix + ".param", output_prefix + ".config");
 
   // NOTE: fp32 here is just a placeholder. The dtype used by ncnn is determined
   // by the weight_dtype parameter.
   Model model(input_path, "export-ncnn fp32");
+  // before destroy() writes a config which points to the sequence graph
+  if (seq_len > 1 && model.version() != "7") {
+    fclose(bp);
+    fclose(pp);
+    std::remove((output_prefix + ".bin").c_str());
+    std::remove((output_prefix + ".param").c_str());
+    default_dispatch_device() = std::nullopt;
+    RV_UNIMPLEMENTED() << "the sequence graph is only implemented for RWKV v7, "
+                          "but the model is v"
+                       << model.version();
+  }
+  _n_layer = model.n_layer();
   model.Run(0);
   destroy(model);
 
+  if (seq_len > 1) {
+    init(weight_dtype, output_prefix + ".seq.bin",
+         output_prefix + ".seq.param", "");
+    // the values of the ids do not matter, only the length
+    model.Run(std::vector<int>(seq_len, 0));
+    destroy(model);
+  }
+
   default_dispatch_device() = std::nullopt;
+  // e.g. the statistics of another model, or of weights not quantized by
+  // the plan
+  for (const auto &[name, _] : _act_stats) {
+    if (_used_act_stats.count(name) == 0) {
+      std::cerr << "warning: the activation statistics of " << name
+                << " are not used" << std::endl;
+    }
+  }
+  _act_stats.clear();
+  _used_act_stats.clear();
+  _quant_plan = QuantPlan();
+}
+
+void ExportCalibrationModel(const std::string &input_path,
+                            const std::string &output_prefix) {
+  _calibration = true;
+  try {
+    ExportModel(input_path, DType::kFloat16, output_prefix);
+  } catch (...) {
+    _calibration = false;
+    throw;
+  }
+  _calibration = false;
 }
 
 void append_data_to_bin_file(const Tensor &tensor, bool write_tag) {
@@ -250,71 +322,44 @@ Tensor reshape(const Tensor &x, const Shape &shape) {
   return output;
 }
 
-uint8_t quantize_nf4(float x) {
-  RV_CHECK(x <= 1 && x >= -1);
-  // It is copied from https://github.com/TimDettmers/bitsandbytes/blob/main/csrc/kernels.cu#L278
-  // the values for this tree was generated by test_normal_map_tree
-  // in the file tests/test_functional.py
-  if(x > 0.03979014977812767f)
-    if(x > 0.3893125355243683f) // 1
-      if(x > 0.6427869200706482f) // 11
-        if(x > 0.8614784181118011f) // 111
-          return 0b1111;
-        else
-          return 0b1110;
-      else
-        if(x > 0.5016634166240692f) // 110
-          return 0b1101;
-        else
-          return 0b1100;
-    else
-      if(x > 0.2035212516784668f) // 10
-        if(x > 0.2920137718319893f) // 101
-          return 0b1011;
-        else
-          return 0b1010;
-      else
-        if(x > 0.1202552504837513f) // 100
-          return 0b1001;
-        else
-          return 0b1000;
-  else
-    if(x > -0.33967943489551544f) // 0
-      if(x > -0.13791173323988914f) // 01
-        if(x > -0.045525018125772476f) // 011
-          return 0b0111;
-        else
-          return 0b0110;
-      else
-        if(x > -0.23460740596055984f) // 010
-          return 0b0101;
-        else
-          return 0b0100;
-    else
-      if(x > -0.6106329262256622f) // 00
-        if(x > -0.4599952697753906f) // 001
-          return 0b0011;
-        else
-          return 0b0010;
-      else
-        if(x > -0.8480964004993439f) // 000
-          return 0b0001;
-        else
-          return 0b0000;
+// Quantization runs on all cores: the blocks of a weight are independent, and
+// every block writes to a fixed offset of the outputs.
+ThreadPool &quantize_pool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+// Run `fn(begin, end)` on the pool for chunks of [0, n).
+template <typename F> void parallel_chunks(int n, int chunk_size, F fn) {
+  const int num_chunks = (n + chunk_size - 1) / chunk_size;
+  quantize_pool().ParallelFor(num_chunks, [&](int chunk) {
+    fn(chunk * chunk_size, std::min(n, (chunk + 1) * chunk_size));
+  });
+}
+
+// The statistics of the input channels of weight `b`, null if there are none
+const float *find_act_stats(const Tensor &b) {
+  auto it = _act_stats.find(b.name);
+  if (it == _act_stats.end()) {
+    return nullptr;
+  }
+  _used_act_stats.insert(b.name);
+  RV_CHECK(it->second.size() == b.size(0))
+      << "the activation statistics of " << b.name << " have "
+      << it->second.size() << " channels but the weight has " << b.size(0);
+  return it->second.data();
 }
 
 // The code here is highly coupled with the kernel implementation.
-Tensor gemv_a32w4(const Tensor &a, const Tensor &b) {
+Int4Weight quantize_int4(const Tensor &b, const float *act) {
   RV_CHECK(b.device() == Device::kCPU);
   const float *const ptr0 = b.data_ptr<float>();
   const int K = b.shape()[0];
   RV_CHECK(K % 2 == 0);
   const int N = b.shape()[1];
   static constexpr int KT = 64;
-  // static const int effective_KT = KT / 2;
   Tensor B_int4_t = Tensor::Empty({K / 2, N}, DType::kInt8, Device::kCPU);
   constexpr int kGroupSize = 8;
-  const bool double_quant = true;
   RV_CHECK(64 % kGroupSize == 0);
 #ifdef _MSC_VER
   // MSVC has poor constexpr support
@@ -323,155 +368,142 @@ Tensor gemv_a32w4(const Tensor &a, const Tensor &b) {
 #else
   static constexpr int kGroupNum = 64 / kGroupSize;
 #endif
+  static constexpr int kBlockCols = 8;
+  static constexpr int kScaleGroupSize = 16;
+  // the scales of kScaleGroupSize / kGroupNum blocks are quantized together
+  static constexpr int kBlocksPerScaleGroup = kScaleGroupSize / kGroupNum;
 
   // a column --> kGroupNum scales
   Tensor scales_t =
       Tensor::Empty({K * N * kGroupNum / KT}, DType::kInt8, Device::kCPU);
-  std::vector<int8_t> scales_vec;
   Tensor dq_scales_t =
       Tensor::Empty({scales_t.numel() / 16}, DType::kFloat16, Device::kCPU);
-  std::vector<float16> dq_scales_vec;
-
-  static constexpr int kBlockCols = 8;
-
-  std::vector<std::array<float, kBlockCols>> unquanted_scales_buffer;
-  int kScaleGroupSize = 16;
 
   // (2 comes from a int8 has two int4)
   // (K / 2, N)
   // (K / KT, N / kBlockCols, KT / 2, kBlockCols)
   // int4
-  for (int a = 0; a < K / KT; a++) {
-    uint8_t *ptr = static_cast<uint8_t *>(B_int4_t.data_ptr()) + a * (KT / 2) * N;
-    int block_id = a * (N / kBlockCols);
-    for (int b = 0; b < N / kBlockCols; b++) {
-      std::array<float, KT * kBlockCols> block_data;
-      int index = 0;
-      // every (64, 1) block in (64, 8) superblock has one or more scales
-      for (int c = 0; c < KT; c++) {
-        for (int d = 0; d < kBlockCols; d++) {
-          int k = a * KT + c;
-          int n = b * kBlockCols + d;
-          block_data[index++] = ptr0[k * N + n];
-        }
-      }
-
-      const auto col_scales =
-          [&]() -> std::array<std::array<float, kBlockCols>, kGroupNum> {
-        std::array<std::array<float, KT>, kBlockCols> col_datas;
-        std::array<std::array<float, kBlockCols>, kGroupNum> col_scales;
-
-        for (int i = 0; i < KT * kBlockCols; i++) {
-          col_datas[i % kBlockCols][i / kBlockCols] = block_data[i];
+  // The blocks are numbered in this order, and every kBlocksPerScaleGroup
+  // consecutive blocks (which may span two rows of blocks) share the
+  // double-quantization scales.
+  const int num_blocks = (K / KT) * (N / kBlockCols);
+  RV_CHECK(num_blocks % kBlocksPerScaleGroup == 0);
+  const int num_scale_groups = num_blocks / kBlocksPerScaleGroup;
+  parallel_chunks(num_scale_groups, 64, [&](int begin, int end) {
+    for (int g = begin; g < end; g++) {
+      // one row per group of a block
+      std::array<float, kScaleGroupSize * kBlockCols> unquanted_scales;
+      std::array<float, kBlocksPerScaleGroup * KT * kBlockCols> block_datas;
+      for (int blk = 0; blk < kBlocksPerScaleGroup; blk++) {
+        const int block_id = g * kBlocksPerScaleGroup + blk;
+        const int row = block_id / (N / kBlockCols);
+        const int col = block_id % (N / kBlockCols);
+        float *block_data = block_datas.data() + blk * KT * kBlockCols;
+        for (int c = 0; c < KT; c++) {
+          std::copy_n(ptr0 + static_cast<size_t>(row * KT + c) * N +
+                          col * kBlockCols,
+                      kBlockCols, block_data + c * kBlockCols);
         }
-
-        // a column --> two scales/zero_points
-        // calculate scale and zero point
-        // float[i] = int[i] * scale + zero_point
-        // int[i] = (float[i] - zero_point) / scale
-        // scale = (max - min) / 255
-        for (int col = 0; col < kBlockCols; col++) {
-          const auto &col_data = col_datas[col];
-          RV_CHECK(col_data.size() == 64);
-          for (int group = 0; group < kGroupNum; group++) {
-            float scale;
-            float zero_point;
-            float max = col_data[group * kGroupSize];
-            float min = col_data[group * kGroupSize];
-            for (int i = group * kGroupSize + 1; i < group * kGroupSize + kGroupSize; i++) {
-              if (col_data[i] > max) {
-                max = col_data[i];
-              }
-              if (col_data[i] < min) {
-                min = col_data[i];
-              }
-            }
-            if (max == min) {
-              scale = 1.f;
-            } else {
-              scale = std::max(std::abs(max), std::abs(min));
+        // every (kGroupSize, 1) group of the (KT, kBlockCols) block has a
+        // scale. NOTE(daquexian): we do not need zero_point because we assume
+        // the distribution is already normal distribution, needed by nf4.
+        for (int group = 0; group < kGroupNum; group++) {
+          std::array<float, kBlockCols> max;
+          std::array<float, kBlockCols> min;
+          const float *group_data = block_data + group * kGroupSize * kBlockCols;
+          std::copy_n(group_data, kBlockCols, max.begin());
+          std::copy_n(group_data, kBlockCols, min.begin());
+          for (int i = 1; i < kGroupSize; i++) {
+            for (int j = 0; j < kBlockCols; j++) {
+              max[j] = std::max(max[j], group_data[i * kBlockCols + j]);
+              min[j] = std::min(min[j], group_data[i * kBlockCols + j]);
             }
-            col_scales[group][col] = scale;
           }
-        }
-
-        return col_scales;
-      }();
-
-      for (const auto& x : col_scales) {
-        unquanted_scales_buffer.push_back(x);
-      }
-      // NOTE(daquexian): we do not need zero_point because we assume the distribution is 
-      // already normal distribution, needed by nf4.
-      if (unquanted_scales_buffer.size() == kScaleGroupSize) {
-        std::array<float16, kBlockCols> this_dq_scales;
-        for (int i = 0; i < kBlockCols; i++) {
-          float max = std::abs(unquanted_scales_buffer[0][i]);
-          for (int j = 1; j < kScaleGroupSize; j++) {
-            if (std::abs(unquanted_scales_buffer[j][i]) > max) {
-              max = std::abs(unquanted_scales_buffer[j][i]);
-            }
+          float *scales =
+              unquanted_scales.data() + (blk * kGroupNum + group) * kBlockCols;
+          for (int j = 0; j < kBlockCols; j++) {
+            scales[j] = max[j] == min[j]
+                            ? 1.f
+                            : std::max(std::abs(max[j]), std::abs(min[j]));
+          }
+          if (act != nullptr) {
+            clip_nf4_scales<kGroupSize, kBlockCols>(
+                group_data, act + row * KT + group * kGroupSize, scales);
           }
-          this_dq_scales[i] = max / 127.f;
-          // we maintain nf4 table as int8, [-127, 127], instead of [-1, 1], so we want the scales
-          // to be 1/127 of the original scales
-          dq_scales_vec.push_back(this_dq_scales[i] / float16(127.f));
         }
+      }
 
+      int8_t *scales_out = static_cast<int8_t *>(scales_t.data_ptr()) +
+                           g * kScaleGroupSize * kBlockCols;
+      float16 *dq_scales_out = dq_scales_t.data_ptr<float16>() + g * kBlockCols;
+      for (int j = 0; j < kBlockCols; j++) {
+        float max = unquanted_scales[j];
+        for (int i = 1; i < kScaleGroupSize; i++) {
+          max = std::max(max, unquanted_scales[i * kBlockCols + j]);
+        }
+        const float16 dq_scale(max / 127.f);
+        // we maintain nf4 table as int8, [-127, 127], instead of [-1, 1], so
+        // we want the scales to be 1/127 of the original scales
+        dq_scales_out[j] = dq_scale / float16(127.f);
         for (int i = 0; i < kScaleGroupSize; i++) {
-          for (int j = 0; j < kBlockCols; j++) {
-            float dq_scale = this_dq_scales[j];
-            float unquanted_scale = unquanted_scales_buffer[i][j];
-            int quantized_scale = std::lround(unquanted_scale / dq_scale);
-            RV_CHECK(quantized_scale <= 127 && quantized_scale >= -127) << "unquanted_scale = " << unquanted_scale << ", dq_scale = " << dq_scale;
-            scales_vec.push_back(quantized_scale);
-          }
+          const float unquanted_scale = unquanted_scales[i * kBlockCols + j];
+          const int quantized_scale =
+              std::lround(unquanted_scale / static_cast<float>(dq_scale));
+          RV_CHECK(quantized_scale <= 127 && quantized_scale >= -127)
+              << "unquanted_scale = " << unquanted_scale
+              << ", dq_scale = " << dq_scale;
+          scales_out[i * kBlockCols + j] = quantized_scale;
         }
-
-        unquanted_scales_buffer.clear();
       }
 
-      block_id++;
-
-      const int kSubBlockSize = 16;
-      // In block_data (traversed by i) which has (KT, kBlockCols) unpacked int8 elems,
-      // a ((16 / kBlockCols), kBlockCols) subblock (traversed by j) and another ((16 / kBlockCols), kBlockCols) subblock under it are packed elementwisely
-      // 16 comes from 128 (simd reg bits) / 4 (int4 bits) / 2 (two subblocks)
-      for (int i = 0; i < KT / (kSubBlockSize / kBlockCols * 2); i++) {
-        for (int j = 0; j < kSubBlockSize; j++) {
-          int idx1 = i * kSubBlockSize * 2 + j;
-          int idx2 = idx1 + kSubBlockSize;
-          RV_CHECK(idx1 < KT * kBlockCols);
-          float scale = col_scales[(idx1 / kBlockCols) / kGroupSize][idx1 % kBlockCols];
-          block_data[idx1] = block_data[idx1] / scale;
-          uint8_t tmp1 = quantize_nf4(block_data[idx1]);
-          RV_CHECK(tmp1 >= 0 && tmp1 <= 15);
-
-          RV_CHECK(idx2 < KT * kBlockCols);
-          scale = col_scales[(idx2 / kBlockCols) / kGroupSize][idx2 % kBlockCols];
-          block_data[idx2] = block_data[idx2] / scale;
-          uint8_t tmp2 = quantize_nf4(block_data[idx2]);
-          RV_CHECK(tmp2 >= 0 && tmp2 <= 15);
-
-          RV_CHECK((ptr - B_int4_t.data_ptr<uint8_t>()) <
-                   B_int4_t.numel());
-          *ptr++ = (tmp2 << 4) + tmp1;
+      for (int blk = 0; blk < kBlocksPerScaleGroup; blk++) {
+        float *block_data = block_datas.data() + blk * KT * kBlockCols;
+        const float *scales =
+            unquanted_scales.data() + blk * kGroupNum * kBlockCols;
+        for (int i = 0; i < KT * kBlockCols; i++) {
+          block_data[i] /= scales[i / (kGroupSize * kBlockCols) * kBlockCols +
+                                  i % kBlockCols];
+        }
+        if (act != nullptr) {
+          // the clipped weights
+          for (int i = 0; i < KT * kBlockCols; i++) {
+            block_data[i] = std::clamp(block_data[i], -1.f, 1.f);
+          }
+        }
+        std::array<uint8_t, KT * kBlockCols> codes;
+        quantize_nf4(block_data, KT * kBlockCols, codes.data());
+
+        const int kSubBlockSize = 16;
+        // In block_data (traversed by i) which has (KT, kBlockCols) unpacked
+        // int8 elems, a ((16 / kBlockCols), kBlockCols) subblock (traversed by
+        // j) and another ((16 / kBlockCols), kBlockCols) subblock under it are
+        // packed elementwisely. 16 comes from 128 (simd reg bits) / 4 (int4
+        // bits) / 2 (two subblocks)
+        uint8_t *ptr = B_int4_t.data_ptr<uint8_t>() +
+                       static_cast<size_t>(g * kBlocksPerScaleGroup + blk) *
+                           (KT * kBlockCols / 2);
+        for (int i = 0; i < KT * kBlockCols; i += kSubBlockSize * 2) {
+          for (int j = 0; j < kSubBlockSize; j++) {
+            *ptr++ = (codes[i + j + kSubBlockSize] << 4) + codes[i + j];
+          }
         }
       }
     }
-  }
-
-  RV_CHECK(unquanted_scales_buffer.empty());
-  RV_CHECK(scales_vec.size() == scales_t.numel());
-  memcpy(scales_t.data_ptr(), scales_vec.data(), scales_t.numel() * scales_t.elem_size());
+  });
 
-  RV_CHECK(dq_scales_vec.size() == dq_scales_t.numel());
-  memcpy(dq_scales_t.data_ptr(), dq_scales_vec.data(), dq_scales_t.numel() * dq_scales_t.elem_size());
+  return {B_int4_t, scales_t, dq_scales_t};
+}
 
+Tensor gemv_a32w4(const Tensor &a, const Tensor &b) {
+  const int K = b.shape()[0];
+  const int N = b.shape()[1];
+  constexpr int kGroupSize = 8;
+  constexpr int kScaleGroupSize = 16;
+  const auto weight = quantize_int4(b, find_act_stats(b));
   PRINT_OP_TYPE_AND_NAME("GemvA32W4", 1, 1);
-  append_data_to_bin_file(B_int4_t, true);
-  append_data_to_bin_file(scales_t, false);
-  append_data_to_bin_file(dq_scales_t, false);
+  append_data_to_bin_file(weight.codes, true);
+  append_data_to_bin_file(weight.scales, false);
+  append_data_to_bin_file(weight.dq_scales, false);
   auto output = Tensor::Empty({N}, DType::kFloat32, Device::kNCNNMeta);
   fprintf(pp, " %s", a.name.c_str());
   fprintf(pp, " %s", output.name.c_str());
@@ -483,12 +515,13 @@ Tensor gemv_a32w4(const Tensor &a, const Tensor &b) {
 }
 
 // The code here is highly coupled with the kernel implementation.
-Tensor gemv_a32w8(const Tensor &a, const Tensor &b) {
+Int8Weight quantize_int8(const Tensor &b, const float *act) {
   RV_CHECK(b.device() == Device::kCPU);
   const float *const ptr0 = b.data_ptr<float>();
   const int K = b.shape()[0];
   const int N = b.shape()[1];
-  static const int KT = 64;
+  static constexpr int KT = 64;
+  static constexpr int kBlockCols = 4;
   Tensor B_int8_t = Tensor::Empty({K, N}, DType::kInt8, Device::kCPU);
   Tensor scales_t = Tensor::Empty({K * N / KT}, DType::kFloat32, Device::kCPU);
   float *scales = scales_t.data_ptr<float>();
@@ -499,90 +532,71 @@ Tensor gemv_a32w8(const Tensor &a, const Tensor &b) {
   // (K, N)
   // (K / 64, N / 4, 64, 4)
   // int8
-  for (int a = 0; a < K / KT; a++) {
-    uint8_t *ptr = static_cast<uint8_t *>(B_int8_t.data_ptr()) + a * KT * N;
-    int block_id = a * (N / 4);
-    for (int b = 0; b < N / 4; b++) {
-      std::array<float, KT * 4> block_data;
-      int index = 0;
-      // every (64, 1) block in (64, 4) superblock has a scale and a zero_point
+  const int num_blocks = (K / KT) * (N / kBlockCols);
+  parallel_chunks(num_blocks, 256, [&](int begin, int end) {
+    for (int block_id = begin; block_id < end; block_id++) {
+      const int row = block_id / (N / kBlockCols);
+      const int col = block_id % (N / kBlockCols);
+      std::array<float, KT * kBlockCols> block_data;
       for (int c = 0; c < KT; c++) {
-        for (int d = 0; d < 4; d++) {
-          int k = a * KT + c;
-          int n = b * 4 + d;
-          block_data[index++] = ptr0[k * N + n];
-        }
+        std::copy_n(ptr0 + static_cast<size_t>(row * KT + c) * N +
+                        col * kBlockCols,
+                    kBlockCols, block_data.data() + c * kBlockCols);
       }
 
-      const auto [col_scales, col_zeropoints] =
-          [&]() -> std::pair<std::array<float, 4>, std::array<float, 4>> {
-        std::array<std::array<float, KT>, 4> col_datas;
-        std::array<float, 4> col_scales;
-        std::array<float, 4> col_zeropoints;
-
-        for (int i = 0; i < KT * 4; i++) {
-          col_datas[i % 4][i / 4] = block_data[i];
-        }
-
-        // calculate scale and zero point
-        // float[i] = int[i] * scale + zero_point
-        // int[i] = (float[i] - zero_point) / scale
-        // scale = (max - min) / 255
-        for (int col = 0; col < 4; col++) {
-          const auto &col_data = col_datas[col];
-          float scale;
-          float zero_point;
-          float max = col_data[0];
-          float min = col_data[0];
-          for (int i = 1; i < static_cast<int>(col_data.size()); i++) {
-            if (col_data[i] > max) {
-              max = col_data[i];
-            }
-            if (col_data[i] < min) {
-              min = col_data[i];
-            }
-          }
-          // std::cout << "max = " << max << std::endl;
-          // std::cout << "min = " << min << std::endl;
-          if (max == min) {
-            scale = 1.f;
-          } else {
-            scale = (max - min) / 255.f;
-          }
-          zero_point = min;
-          col_scales[col] = scale;
-          col_zeropoints[col] = zero_point;
-
-          scales[block_id * 4 + col] = scale;
-          zero_points[block_id * 4 + col] = zero_point;
+      // every (64, 1) block in (64, 4) superblock has a scale and a
+      // zero_point
+      // float[i] = int[i] * scale + zero_point
+      // int[i] = (float[i] - zero_point) / scale
+      // scale = (max - min) / 255
+      std::array<float, kBlockCols> max;
+      std::array<float, kBlockCols> min;
+      std::copy_n(block_data.begin(), kBlockCols, max.begin());
+      std::copy_n(block_data.begin(), kBlockCols, min.begin());
+      for (int i = 1; i < KT; i++) {
+        for (int j = 0; j < kBlockCols; j++) {
+          max[j] = std::max(max[j], block_data[i * kBlockCols + j]);
+          min[j] = std::min(min[j], block_data[i * kBlockCols + j]);
         }
+      }
+      if (act != nullptr) {
+        clip_int8_ranges<KT, kBlockCols>(block_data.data(), act + row * KT,
+                                         min.data(), max.data());
+      }
+      std::array<float, kBlockCols> col_scales;
+      for (int j = 0; j < kBlockCols; j++) {
+        col_scales[j] = max[j] == min[j] ? 1.f : (max[j] - min[j]) / 255.f;
+        scales[block_id * kBlockCols + j] = col_scales[j];
+        zero_points[block_id * kBlockCols + j] = min[j];
+      }
 
-        return {col_scales, col_zeropoints};
-      }();
-
-      // std::cout << "scales[" << block_id << "] = " << scale << std::endl;
-      // std::cout << "zero_points[" << block_id << "] = " << zero_point <<
-      // std::endl;
-      block_id++;
-
-      for (int i = 0; i < KT * 4; i++) {
-        // std::cout << "pre quant, col_datas[" << i << "] = " << col_datas[i]
-        // << std::endl;
-        block_data[i] =
-            (block_data[i] - col_zeropoints[i % 4]) / col_scales[i % 4];
-        assert(block_data[i] >= 0 && block_data[i] <= 255);
-        *ptr++ = std::lround(block_data[i]);
-        // std::cout << "col_datas[" << i << "] = " << col_datas[i] <<
-        // std::endl; std::cout << "(int)col_datas[" << i << "] = " <<
-        // std::lround(col_datas[i]) << std::endl;
+      uint8_t *ptr = B_int8_t.data_ptr<uint8_t>() +
+                     static_cast<size_t>(block_id) * KT * kBlockCols;
+      for (int i = 0; i < KT * kBlockCols; i++) {
+        // the weights are clipped if the ranges are
+        const float w = act == nullptr
+                            ? block_data[i]
+                            : std::clamp(block_data[i], min[i % kBlockCols],
+                                         max[i % kBlockCols]);
+        const float x = (w - min[i % kBlockCols]) / col_scales[i % kBlockCols];
+        // std::lround for x >= 0, without the libm call
+        const int t = static_cast<int>(x);
+        ptr[i] = t + (x - t >= 0.5f);
       }
     }
-  }
+  });
 
+  return {B_int8_t, scales_t, zero_points_t};
+}
+
+Tensor gemv_a32w8(const Tensor &a, const Tensor &b) {
+  const int K = b.shape()[0];
+  const int N = b.shape()[1];
+  const auto weight = quantize_int8(b, find_act_stats(b));
   PRINT_OP_TYPE_AND_NAME("GemvA32W8", 1, 1);
-  append_data_to_bin_file(B_int8_t, true);
-  append_data_to_bin_file(scales_t, false);
-  append_data_to_bin_file(zero_points_t, false);
+  append_data_to_bin_file(weight.codes, true);
+  append_data_to_bin_file(weight.scales, false);
+  append_data_to_bin_file(weight.zero_points, false);
   auto output = Tensor::Empty({N}, DType::kFloat32, Device::kNCNNMeta);
   fprintf(pp, " %s", a.name.c_str());
   fprintf(pp, " %s", output.name.c_str());
@@ -652,18 +666,43 @@ Tensor gemm(const Tensor &a, const Tensor &b) {
   }
 }
 
+std::pair<Tensor, Tensor> split2(const Tensor &x);
+Tensor mark_as_output(const Tensor &x, const std::string &name);
+
+DType matmul_weight_dtype(const Tensor &b) {
+  if (auto dtype = _quant_plan.Get(b.name, _n_layer)) {
+    // ncnn has no fp32 weights, gemm stores them in fp16
+    return *dtype == DType::kFloat32 ? DType::kFloat16 : *dtype;
+  }
+  // int4 hurts the quality of the head too much
+  if (_weight_dtype == DType::kInt4 && b.name == "head.weight") {
+    return DType::kInt8;
+  }
+  return _weight_dtype;
+}
+
 Tensor matmul(const Tensor &a, const Tensor &b) {
-  if (_weight_dtype == DType::kInt4 && a.shape().size() == 1 &&
-      b.shape().size() == 2 && b.device() == Device::kCPU) {
-    if(*get_disable_int4()) {
-      return gemv_a32w8(a, b);
-    } else {
+  // the input is also an output, see ExportCalibrationModel
+  if (_calibration && a.shape().size() == 1 && b.shape().size() == 2 &&
+      b.device() == Device::kCPU) {
+    auto [input, act] = split2(a);
+    mark_as_output(act, "act_" + b.name);
+    return gemm(input, b);
+  }
+  if (a.shape().size() == 1 && b.shape().size() == 2 &&
+      b.device() == Device::kCPU) {
+    const DType dtype = matmul_weight_dtype(b);
+    if (dtype == DType::kInt4) {
+      _config_weight_dtype = DType::kInt4;
       return gemv_a32w4(a, b);
+    } else if (dtype == DType::kInt8) {
+      if (_config_weight_dtype != DType::kInt4) {
+        _config_weight_dtype = DType::kInt8;
+      }
+      return gemv_a32w8(a, b);
     }
-  } else if (_weight_dtype == DType::kInt8 && a.shape().size() == 1 &&
-             b.shape().size() == 2 && b.device() == Device::kCPU) {
-    return gemv_a32w8(a, b);
-  } else if (a.shape().size() <= 2 && b.shape().size() <= 2) {
+  }
+  if (a.shape().size() <= 2 && b.shape().size() <= 2) {
     return gemm(a, b);
   } else {
     return batch_matmul(a, b);
@@ -672,7 +711,7 @@ Tensor matmul(const Tensor &a, const Tensor &b) {
 
 Tensor Embedding(const Tensor &weight, const Tensor &id) {
   RV_CHECK(weight.device() == Device::kCPU);
-  auto output = Tensor::Empty({1, weight.shape()[1]},
+  auto output = Tensor::Empty({id.numel(), weight.shape()[1]},
                               DType::kFloat32, Device::kNCNNMeta);
   PRINT_OP_TYPE_AND_NAME("Embed", 1, 1);
   fprintf(pp, " %s", id.name.c_str());
@@ -709,8 +748,8 @@ Tensor Embedding(const Tensor &weight, const Tensor &id) {
   append_data_to_bin_file(quanted_weight, true);
   append_data_to_bin_file(scales, true);
   fprintf(pp, " 0=%d 1=%d 3=%d 4=%d\n", (int)weight.shape()[1], (int)weight.shape()[0], (int)weight.numel(), kGroupSize);
-  // flatten to 1d
-  return output.flatten();
+  // flatten to 1d if there is only one id
+  return id.numel() == 1 ? output.flatten() : output;
 }
 
 Tensor MemoryData(const Tensor &x) {
@@ -996,6 +1035,94 @@ std::tuple<Tensor, Tensor, Tensor, Tensor, Tensor, Tensor> split6(const Tensor &
   return {output1, output2, output3, output4, output5, output6};
 }
 
+// slice x along dim 0 into parts of `sizes`
+std::vector<Tensor> split_dim0(const Tensor &x, const std::vector<int> &sizes) {
+  Tensor meta_x = x.device() == Device::kCPU ? MemoryData(x) : x;
+  PRINT_OP_TYPE_AND_NAME("Slice", 1, static_cast<int>(sizes.size()));
+  fprintf(pp, " %s", meta_x.name.c_str());
+  std::vector<Tensor> outputs;
+  for (int size : sizes) {
+    auto shape = meta_x.shape();
+    shape[0] = size;
+    outputs.push_back(
+        Tensor::Empty(shape, DType::kFloat32, Device::kNCNNMeta));
+    fprintf(pp, " %s", outputs.back().name.c_str());
+  }
+  fprintf(pp, " -23300=%d", static_cast<int>(sizes.size()));
+  for (int size : sizes) {
+    fprintf(pp, ",%d", size);
+  }
+  fprintf(pp, " 1=0");
+  fprintf(pp, "\n");
+  return outputs;
+}
+
+Tensor concat_dim0(const std::vector<Tensor> &xs) {
+  auto shape = xs[0].shape();
+  shape[0] = 0;
+  for (const auto &x : xs) {
+    RV_CHECK(x.device() == Device::kNCNNMeta);
+    shape[0] += x.size(0);
+  }
+  PRINT_OP_TYPE_AND_NAME("Concat", static_cast<int>(xs.size()), 1);
+  auto output = Tensor::Empty(shape, DType::kFloat32, Device::kNCNNMeta);
+  for (const auto &x : xs) {
+    fprintf(pp, " %s", x.name.c_str());
+  }
+  fprintf(pp, " %s", output.name.c_str());
+  fprintf(pp, " 0=0");
+  fprintf(pp, "\n");
+  return output;
+}
+
+// only slicing along dim 0 with interval 1 is supported
+Tensor slice(const Tensor &x, const std::vector<Range> &ranges) {
+  RV_CHECK(x.shape().size() == ranges.size());
+  const auto is_all = [](const Range &range) {
+    return range.start == 0 && range.interval == 0 && range.end == 0;
+  };
+  for (int i = 1; i < ranges.size(); i++) {
+    RV_CHECK(is_all(ranges[i]));
+  }
+  if (is_all(ranges[0])) {
+    return x;
+  }
+  const int n = x.size(0);
+  auto [start, interval, end] = ranges[0];
+  if (start < 0) {
+    start += n;
+  }
+  if (end < 0) {
+    end += n;
+  }
+  RV_CHECK(interval == 1 && start >= 0 && start < end && end <= n);
+  if (start == 0 && end == n) {
+    return x;
+  }
+  std::vector<int> sizes;
+  if (start > 0) {
+    sizes.push_back(start);
+  }
+  sizes.push_back(end - start);
+  if (end < n) {
+    sizes.push_back(n - end);
+  }
+  return split_dim0(x, sizes)[start > 0 ? 1 : 0];
+}
+
+// layernorm without affine over the last dim of each row
+Tensor layernorm_rows(const Tensor &x, float eps) {
+  PRINT_OP_TYPE_AND_NAME("LayerNorm", 1, 1);
+  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
+  fprintf(pp, " %s %s", x.name.c_str(), output.name.c_str());
+
+  fprintf(pp, " 0=%d", static_cast<int>(x.size(x.shape().size() - 1)));
+  fprintf(pp, " 1=%e", eps);
+  fprintf(pp, " 2=0");
+  fprintf(pp, "\n");
+  return output;
+}
+
 std::tuple<Tensor, Tensor, Tensor, Tensor, Tensor>
 att(const Tensor &x, const Tensor &sx, const Tensor &aa, const Tensor &bb,
     const Tensor &pp, const Tensor &ln_w, const Tensor &ln_b,
@@ -1302,6 +1429,123 @@ att_one_v7(const Tensor &x, const Tensor &sx, const Tensor &s,
 
 KernelRegister att_v7_reg("att_one_v7", Device::kNCNNMeta, att_one_v7);
 
+// att_one_v7 over x of [T, C]. The projections are Gemm over all the T
+// tokens, only the state update is unrolled T times.
+std::tuple<Tensor, Tensor, Tensor, Tensor>
+att_seq_v7(const Tensor &x, const Tensor &sx, const Tensor &s,
+            Tensor &v_first, const int layer_id,
+            const Tensor &ln_w, const Tensor &ln_b, const Tensor &lx_w,
+            const Tensor &lx_b, const Tensor &x_r, const Tensor &x_w,
+            const Tensor &x_k, const Tensor &x_v, const Tensor &x_a, const Tensor &x_g,
+            const Tensor &a0, const Tensor &a1, const Tensor &a2,
+            const Tensor &v0, const Tensor &v1, const Tensor &v2,
+            const Tensor &w0, const Tensor &w1, const Tensor &w2,
+            const Tensor &g1, const Tensor &g2, const Tensor &k_k,
+            const Tensor &k_a, const Tensor &r_k,
+            const Tensor &kw, const Tensor &vw, const Tensor &rw,
+            const Tensor &ow) {
+  RV_CHECK(x.shape().size() == 2);
+  const int T = x.size(0);
+  const int C = x.size(1);
+  RV_CHECK(T > 1);
+  const int H = r_k.size(0);
+  const int S = r_k.size(1);
+  // ncnn broadcasts a 1d blob along the rows of a 2d blob, so the parameters
+  // are made [1, C]
+  const auto row = [](const Tensor &param) {
+    return param.view({1, param.numel()});
+  };
+
+  auto [x_s1, x_s2] = split2(x);
+  auto xx = layernorm(x_s1, ln_w, ln_b);
+  auto [xx1, xx2, xx3] = split3(xx);
+  // token shift: the previous token of row 0 is sx, and the new sx is the
+  // last row
+  auto xx3_rows = split_dim0(xx3, {T - 1, 1});
+  auto xx_prev = concat_dim0({sx.view({1, C}), xx3_rows[0]});
+  auto xx_out = xx3_rows[1].view({C});
+  auto [xx11, xx12, xx13, xx14, xx15, xx16] = split6(xx1);
+  auto xx_sx = xx_prev - xx2;
+  auto [xx_sx_s1, xx_sx_s2, xx_sx_s3, xx_sx_s4, xx_sx_s5, xx_sx_s6]
+     = split6(xx_sx);
+
+  auto xr = xx11 + xx_sx_s1 * row(x_r);
+  auto xw = xx12 + xx_sx_s2 * row(x_w);
+  auto xk = xx13 + xx_sx_s3 * row(x_k);
+  auto xv = xx14 + xx_sx_s4 * row(x_v);
+  auto xa = xx15 + xx_sx_s5 * row(x_a);
+  auto xg = xx16 + xx_sx_s6 * row(x_g);
+
+  auto [xv_1, xv_2] = split2(xv);
+
+  auto r = matmul(xr, rw);
+  auto k = matmul(xk, kw);
+  auto v = matmul(xv_1, vw);
+
+  auto w = exp(sigmoid(row(w0) + matmul(tanh(matmul(xw, w1)), w2)), -0.606531f);
+  auto a = sigmoid(row(a0) + matmul(matmul(xa, a1), a2));
+  auto g = matmul(sigmoid(matmul(xg, g1)), g2);
+
+  auto [k_1, k_2] = split2(k);
+  auto [a_1, a_2] = split2(a);
+  auto kk = l2norm((k_2 * row(k_k)).view({T * H, 1, S})).view({T, C});
+  auto k_final = k_1 * (1.0f + (-1.0f + a_2) * row(k_a));
+
+  Tensor v_final = Tensor::Empty({T, C}, DType::kFloat32, Device::kNCNNMeta);
+  Tensor v_first_out = Tensor::Empty({T, C}, DType::kFloat32, Device::kNCNNMeta);
+  if (layer_id == 0) {
+    auto [v_out_1, v_out_2] = split2(v);
+    v_final = v_out_1;
+    v_first_out = v_out_2;
+  } else {
+    auto [v_1, v_2] = split2(v);
+    auto [v_first_in, v_first_1] = split2(v_first);
+    v_final = v_1 + (v_first_in - v_2) * sigmoid(row(v0) + matmul(matmul(xv_2, v1), v2));
+    v_first_out = v_first_1;
+  }
+
+  auto [k_final_1, k_final_2] = split2(k_final);
+  auto [v_final_1, v_final_2] = split2(v_final);
+  auto [kk_1, kk_2] = split2(kk);
+  auto [r_1, r_2] = split2(r);
+  // everything but the state update is computed for all the steps at once,
+  // and sliced into T parts of [H, ...]
+  const std::vector<int> steps(T, H);
+  auto vk = split_dim0(matmul(v_final_1.view({T * H, S, 1}),
+                              k_final_1.view({T * H, 1, S})),
+                       steps);
+  auto ab = split_dim0(matmul((-1.0f * kk_1).view({T * H, S, 1}),
+                              (kk_2 * a_1).view({T * H, 1, S})),
+                       steps);
+  auto ws = split_dim0(w.view({T * H, 1, S}), steps);
+  auto rs = split_dim0(r_1.view({T * H, 1, S}), steps);
+
+  Tensor state = s;
+  std::vector<Tensor> outs;
+  for (int t = 0; t < T; t++) {
+    auto [s_s1, s_s2] = split2(state);
+    auto s_res = s_s1 * ws[t] + vk[t] + matmul(s_s2, ab[t]);
+    auto [s_res_1, s_res_2] = split2(s_res);
+    outs.push_back(matmul(rs[t], s_res_1));
+    state = s_res_2;
+  }
+  // the groupnorm of every head of every step, i.e. a layernorm over the rows
+  // of [T * H, S]
+  auto out = layernorm_rows(concat_dim0(outs).view({T * H, S}), 64e-5f)
+                 .view({T, C});
+  out = out * row(lx_w) + row(lx_b);
+
+  out = out + (sum((r_2 * k_final_2 * row(r_k)).view({T * H, S})) *
+               v_final_2.view({T * H, S}))
+                  .view({T, C});
+  out = out * g;
+  out = matmul(out, ow);
+
+  return {x_s2 + out, xx_out, state, v_first_out};
+}
+
+KernelRegister att_seq_v7_reg("att_seq_v7", Device::kNCNNMeta, att_seq_v7);
+
 std::tuple<Tensor, Tensor> ffn(const Tensor &x, const Tensor &sx,
                                const Tensor &ln_w, const Tensor &ln_b,
                                const Tensor &k_mix, const Tensor &r_mix,
@@ -1366,6 +1610,30 @@ std::tuple<Tensor, Tensor> ffn_v7(const Tensor &x, const Tensor &sx,
 
 KernelRegister ffn_v7_reg("ffn_v7", Device::kNCNNMeta, ffn_v7);
 
+std::tuple<Tensor, Tensor> ffn_seq_v7(const Tensor &x, const Tensor &sx,
+                                      const Tensor &ln_w, const Tensor &ln_b,
+                                      const Tensor &k_mix,
+                                      const Tensor &kw, const Tensor &vw) {
+  RV_CHECK(x.shape().size() == 2);
+  const int T = x.size(0);
+  const int C = x.size(1);
+  RV_CHECK(T > 1);
+  auto [x_s1, x_s2] = split2(x);
+  auto xx = layernorm(x_s1, ln_w, ln_b);
+  auto [xx_s1, xx_s2, xx_s3] = split3(xx);
+  auto xx_s3_rows = split_dim0(xx_s3, {T - 1, 1});
+  auto xx_prev = concat_dim0({sx.view({1, C}), xx_s3_rows[0]});
+  auto xx_sx = xx_prev - xx_s2;
+  auto kx = xx_s1 + xx_sx * k_mix.view({1, C});
+
+  auto vx = relu(matmul(kx, kw));
+  vx = vx * vx;
+  auto out = matmul(vx, vw);
+  return {x_s2 + out, xx_s3_rows[1].view({C})};
+}
+
+KernelRegister ffn_seq_v7_reg("ffn_seq_v7", Device::kNCNNMeta, ffn_seq_v7);
+
 KernelRegister allocator_reg("allocator", Device::kNCNNMeta, null_allocator);
 
 KernelRegister layernorm_reg("layernorm", Device::kNCNNMeta, layernorm);
@@ -1386,6 +1654,7 @@ KernelRegister tanh_reg("tanh", Device::kNCNNMeta, tanh);
 KernelRegister sum_reg("sum", Device::kNCNNMeta, sum);
 KernelRegister sigmoid_reg("sigmoid", Device::kNCNNMeta, sigmoid);
 KernelRegister reshape_reg("reshape", Device::kNCNNMeta, reshape);
+KernelRegister slice_reg("slice", Device::kNCNNMeta, slice);
 KernelRegister mark_as_output_reg("mark_as_output", Device::kNCNNMeta,
                                   mark_as_output);
 
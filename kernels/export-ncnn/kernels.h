@@ -1,3 +1,7 @@
+#include <map>
+#include <string>
+#include <vector>
+
 #include <tensor.h>
 
 namespace rwkv {
@@ -6,8 +10,26 @@ Tensor add_input(const Shape &shape, const std::string &name);
 Tensor Embedding(const Tensor &weight, const Tensor &id);
 Tensor MemoryData(const Tensor &x);
 
+// The mean of x^2 of every input channel of the matmuls, by the name of the
+// weight (e.g. "blocks.0.att.key.weight"). It is stored as a msgpack map.
+using ActStats = std::map<std::string, std::vector<float>>;
+
+// If `seq_len` > 1, a graph which runs `seq_len` tokens at once is also
+// exported to <output_prefix>.seq.{param,bin}, and used for prefill.
+// If `act_stats_path` is not empty, the int4/int8 scales of the weights in
+// it are clipped to minimize the output error weighted by the statistics,
+// instead of covering the whole range of the weights.
+// If `quant_plan_path` is not empty, the weights in the QuantPlan (see
+// quant_plan.h) use the dtypes in it instead of `weight_dtype`. Otherwise
+// head.weight is int8 in an int4 model.
 void ExportModel(const std::string &input_path, DType weight_dtype,
-                 const std::string &output_prefix);
-void disable_int4(bool use_fp16);
+                 const std::string &output_prefix, int seq_len = 0,
+                 const std::string &act_stats_path = "",
+                 const std::string &quant_plan_path = "");
+// Export an fp16 graph which also outputs the input of every matmul as
+// "act_<weight name>", to collect ActStats on the ncnn backend (see
+// tools/collect_act_stats.cpp).
+void ExportCalibrationModel(const std::string &input_path,
+                            const std::string &output_prefix);
 } // namespace ncnnmeta
 } // namespace rwkv
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include <check.h>
+#include <tensor.h>
+
+// The quantization of the weights of the ncnn export, in the layouts of the
+// GemvA32W4 and GemvA32W8 layers. They are pure functions of the weights (and
+// the activation statistics), so that they can be tested without exporting a
+// model.
+
+namespace rwkv {
+namespace ncnnmeta {
+
+// The upper bounds of the nf4 codes, sorted, so that the code of x is the
+// number of bounds below it. They are from the binary search tree in
+// https://github.com/TimDettmers/bitsandbytes/blob/main/csrc/kernels.cu#L278
+// (generated by test_normal_map_tree in tests/test_functional.py).
+constexpr float kNf4Bounds[15] = {
+    -0.8480964004993439f,  -0.6106329262256622f,  -0.4599952697753906f,
+    -0.33967943489551544f, -0.23460740596055984f, -0.13791173323988914f,
+    -0.045525018125772476f, 0.03979014977812767f, 0.1202552504837513f,
+    0.2035212516784668f,   0.2920137718319893f,   0.3893125355243683f,
+    0.5016634166240692f,   0.6427869200706482f,   0.8614784181118011f};
+
+// The nf4 codes of `n` values in [-1, 1]. Counting the bounds instead of
+// walking the tree has no branches, so it vectorizes.
+inline void quantize_nf4(const float *x, int n, uint8_t *codes) {
+  float max_abs = 0.f;
+  for (int i = 0; i < n; i++) {
+    max_abs = std::max(max_abs, std::abs(x[i]));
+    codes[i] = 0;
+  }
+  RV_CHECK(max_abs <= 1);
+  for (const float bound : kNf4Bounds) {
+    for (int i = 0; i < n; i++) {
+      codes[i] += x[i] > bound;
+    }
+  }
+}
+
+// The values of the nf4 codes
+constexpr float kNf4Values[16] = {
+    -1.f,          -0.69619280f, -0.52507305f, -0.39491749f,
+    -0.28444138f,  -0.18477343f, -0.09105004f, 0.f,
+    0.07958030f,   0.16093020f,  0.24611230f,  0.33791524f,
+    0.44070983f,   0.56261700f,  0.72295684f,  1.f};
+
+// The scales are clipped to one of these ratios of the range of the weights
+// when there are activation statistics.
+constexpr int kNumClipRatios = 20;
+inline float clip_ratio(int i) { return 1.f - 0.025f * i; }
+
+// Clip the absmax `scales` of a (rows, cols) group, whose rows are the input
+// channels with statistics `act`, to minimize
+// sum(act * (w - dequantized w)^2) of each column.
+template <int kRows, int kCols>
+void clip_nf4_scales(const float *data, const float *act, float *scales) {
+  std::array<float, kCols> best_error;
+  std::array<float, kCols> best_scale;
+  for (int i = 0; i < kNumClipRatios; i++) {
+    std::array<float, kCols> error{};
+    std::array<float, kCols> scale;
+    for (int j = 0; j < kCols; j++) {
+      scale[j] = scales[j] * clip_ratio(i);
+    }
+    for (int r = 0; r < kRows; r++) {
+      std::array<float, kCols> x;
+      std::array<uint8_t, kCols> codes;
+      for (int j = 0; j < kCols; j++) {
+        x[j] = std::clamp(data[r * kCols + j] / scale[j], -1.f, 1.f);
+      }
+      quantize_nf4(x.data(), kCols, codes.data());
+      for (int j = 0; j < kCols; j++) {
+        const float diff =
+            data[r * kCols + j] - kNf4Values[codes[j]] * scale[j];
+        error[j] += act[r] * diff * diff;
+      }
+    }
+    for (int j = 0; j < kCols; j++) {
+      if (i == 0 || error[j] < best_error[j]) {
+        best_error[j] = error[j];
+        best_scale[j] = scale[j];
+      }
+    }
+  }
+  std::copy(best_scale.begin(), best_scale.end(), scales);
+}
+
+// Shrink the [min, max] ranges of the columns of a (rows, cols) block around
+// their centers, like clip_nf4_scales but for the asymmetric int8
+// quantization. Constant columns are kept.
+template <int kRows, int kCols>
+void clip_int8_ranges(const float *data, const float *act, float *min,
+                      float *max) {
+  std::array<float, kCols> best_error;
+  std::array<float, kCols> best_min;
+  std::array<float, kCols> best_max;
+  for (int i = 0; i < kNumClipRatios; i++) {
+    std::array<float, kCols> error{};
+    std::array<float, kCols> lo;
+    std::array<float, kCols> hi;
+    std::array<float, kCols> scale;
+    for (int j = 0; j < kCols; j++) {
+      const float center = (min[j] + max[j]) / 2;
+      const float half_range = (max[j] - min[j]) / 2 * clip_ratio(i);
+      lo[j] = i == 0 ? min[j] : center - half_range;
+      hi[j] = i == 0 ? max[j] : center + half_range;
+      // avoid 0 / 0 in constant columns, which are never clipped
+      scale[j] = min[j] == max[j] ? 1.f : (hi[j] - lo[j]) / 255.f;
+    }
+    for (int r = 0; r < kRows; r++) {
+      for (int j = 0; j < kCols; j++) {
+        const float w = data[r * kCols + j];
+        const float q =
+            std::round((std::clamp(w, lo[j], hi[j]) - lo[j]) / scale[j]);
+        const float diff = w - (q * scale[j] + lo[j]);
+        error[j] += act[r] * diff * diff;
+      }
+    }
+    for (int j = 0; j < kCols; j++) {
+      if (i == 0 || error[j] < best_error[j]) {
+        best_error[j] = error[j];
+        best_min[j] = lo[j];
+        best_max[j] = hi[j];
+      }
+    }
+  }
+  std::copy(best_min.begin(), best_min.end(), min);
+  std::copy(best_max.begin(), best_max.end(), max);
+}
+
+// A (K, N) weight quantized for GemvA32W4: nf4 `codes` packed two per byte,
+// the int8 `scales` of every (8, 1) group, and the fp16 scales of `scales`
+// (double quantization).
+struct Int4Weight {
+  Tensor codes;
+  Tensor scales;
+  Tensor dq_scales;
+};
+
+// A (K, N) weight quantized for GemvA32W8: uint8 `codes` with a float scale
+// and zero point for every (64, 1) block.
+struct Int8Weight {
+  Tensor codes;
+  Tensor scales;
+  Tensor zero_points;
+};
+
+// `act` is the ActStats of the K input channels of `weight`, or null.
+Int4Weight quantize_int4(const Tensor &weight, const float *act);
+Int8Weight quantize_int8(const Tensor &weight, const float *act);
+
+} // namespace ncnnmeta
+} // namespace rwkv
@@ -5,6 +5,7 @@
 #include <kernels/allocator.h>
 #include <kernels/registry.h>
 #include <string>
+#include <strategy.h>
 #include <tensor.h>
 
 namespace rwkv {
@@ -111,6 +112,26 @@ att_one_v7(const Tensor &x, const Tensor &sx, const Tensor &s,
              kw, vw, rw, ow);
 }
 
+inline std::tuple<Tensor, Tensor, Tensor, Tensor>
+att_seq_v7(const Tensor &x, const Tensor &sx, const Tensor &s,
+            Tensor &v_first, const int layer_id,
+            const Tensor &ln_w, const Tensor &ln_b, const Tensor &lx_w,
+            const Tensor &lx_b, const Tensor &x_r, const Tensor &x_w,
+            const Tensor &x_k, const Tensor &x_v, const Tensor &x_a, const Tensor &x_g,
+            const Tensor &a0, const Tensor &a1, const Tensor &a2,
+            const Tensor &v0, const Tensor &v1, const Tensor &v2,
+            const Tensor &w0, const Tensor &w1, const Tensor &w2,
+            const Tensor &g1, const Tensor &g2, const Tensor &k_k,
+            const Tensor &k_a, const Tensor &r_k,
+            const Tensor &kw, const Tensor &vw, const Tensor &rw,
+            const Tensor &ow) {
+  auto tmp = KernelRegistry::Instance().Get<decltype(att_one_v7) *>(
+      "att_seq_v7", x.device());
+  return tmp(x, sx, s, v_first, layer_id, ln_w, ln_b, lx_w, lx_b, x_r, x_w, x_k, x_v, x_a, x_g,
+             a0, a1, a2, v0, v1, v2, w0, w1, w2, g1, g2, k_k, k_a, r_k,
+             kw, vw, rw, ow);
+}
+
 //         def cuda_ffn_one_fp16(self, x, sx, ln_w, ln_b, k_mix, r_mix, kw, vw,
 //         rw, kmx, krx, kmy, kry, vmx, vrx, vmy, vry, rmx, rrx, rmy, rry):
 inline std::tuple<Tensor, Tensor> ffn(const Tensor &x, const Tensor &sx,
@@ -150,6 +171,15 @@ ffn_seq(const Tensor &x, const Tensor &sx, const Tensor &ln_w,
   return tmp(x, sx, ln_w, ln_b, k_mix, r_mix, kw, vw, rw);
 }
 
+inline std::tuple<Tensor, Tensor>
+ffn_seq_v7(const Tensor &x, const Tensor &sx, const Tensor &ln_w,
+           const Tensor &ln_b, const Tensor &k_mix, const Tensor &kw,
+           const Tensor &vw) {
+  auto tmp = KernelRegistry::Instance().Get<decltype(ffn_v7) *>("ffn_seq_v7",
+                                                                x.device());
+  return tmp(x, sx, ln_w, ln_b, k_mix, kw, vw);
+}
+
 inline Tensor cast_dtype(const Tensor &x, DType dtype) {
   return KernelRegistry::Instance().Get<decltype(cast_dtype) *>(
       "cast_dtype", x.device())(x, dtype);
@@ -250,6 +280,16 @@ inline Tensor softmax(const Tensor &x, float temperature) {
       "softmax", x.device())(x, temperature);
 }
 
+// The `k` largest entries of `x @ weight` in descending order as values
+// (float32) and ids (int32) on CPU, and the log-sum-exp of all entries. The
+// logits are computed tile by tile and never materialized.
+inline std::tuple<Tensor, Tensor, float> head_topk(const Tensor &x,
+                                                   const Tensor &weight,
+                                                   int k) {
+  return KernelRegistry::Instance().Get<decltype(head_topk) *>(
+      "head_topk", x.device())(x, weight, k);
+}
+
 inline Tensor reshape(const Tensor &x, const Shape &shape) {
   return KernelRegistry::Instance().Get<decltype(reshape) *>(
       "reshape", x.device())(x, shape);
@@ -331,9 +371,9 @@ inline Tensor mark_as_output(const Tensor &x, const std::string &name) {
 class Model;
 
 inline void init_model(Model *model, Device device, const std::string &path,
-                       const std::string &strategy, const std::any &extra) {
+                       const StrategyOptions &options, const std::any &extra) {
   KernelRegistry::Instance().Get<decltype(init_model) *>("init_model", device)(
-      model, device, path, strategy, extra);
+      model, device, path, options, extra);
 }
 
 inline Tensor ModelForward(Model *model, Device device, int id) {
@@ -348,6 +388,38 @@ inline Tensor ModelForwardSeq(Model *model, Device device,
       "model_forward_seq", device)(model, device, id, full_output);
 }
 
+// Run layers [layer_begin, layer_end) on the residual `x` with the given
+// states. Together with ModelForwardHead it allows a forward to be split into
+// pipeline stages.
+inline Tensor ModelForwardLayers(Model *model, Device device, Tensor x,
+                                 std::vector<std::vector<Tensor>> &states,
+                                 int layer_begin, int layer_end,
+                                 Tensor &v_first) {
+  return KernelRegistry::Instance().Get<decltype(ModelForwardLayers) *>(
+      "model_forward_layers", device)(model, device, x, states, layer_begin,
+                                      layer_end, v_first);
+}
+
+inline Tensor ModelForwardHead(Model *model, Device device, Tensor x) {
+  return KernelRegistry::Instance().Get<decltype(ModelForwardHead) *>(
+      "model_forward_head", device)(model, device, x);
+}
+
+// ModelForwardHead with `head_weight` (e.g. some columns of the head) instead
+// of the head of the model
+inline Tensor ModelForwardHeadSlice(Model *model, Device device, Tensor x,
+                                    const Tensor &head_weight) {
+  return KernelRegistry::Instance().Get<decltype(ModelForwardHeadSlice) *>(
+      "model_forward_head_slice", device)(model, device, x, head_weight);
+}
+
+// ModelForwardHead followed by head_topk
+inline std::tuple<Tensor, Tensor, float>
+ModelForwardHeadTopK(Model *model, Device device, Tensor x, int k) {
+  return KernelRegistry::Instance().Get<decltype(ModelForwardHeadTopK) *>(
+      "model_forward_head_topk", device)(model, device, x, k);
+}
+
 inline Allocator &allocator(Device device) {
   return KernelRegistry::Instance().Get<Allocator &(*)()>("allocator",
                                                           device)();
@@ -1,8 +1,14 @@
+#include <map>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace ncnn {
+class CpuSet;
 class Net;
+class PoolAllocator;
+class UnlockedPoolAllocator;
 };
 
 struct NcnnExtra {
@@ -12,6 +18,29 @@ struct NcnnExtra {
   int output_blob_id;
   std::vector<std::vector<int>> output_state_ids;
   int ncnn_impl_version;
+  // the graph which runs `seq_len` tokens at once, null if it is not exported
+  std::shared_ptr<ncnn::Net> seq_net;
+  int seq_len = 0;
+  int seq_input_blob_id;
+  std::vector<std::vector<int>> seq_state_ids;
+  int seq_output_blob_id;
+  std::vector<std::vector<int>> seq_output_state_ids;
+  // Every extractor allocates from these pools, so that a decoding step in
+  // the steady state allocates nothing. The blob pool is locked because the
+  // new states are blobs, and they are released outside of the runs (e.g. by
+  // a Session). The tensors of the states and the outputs hold a reference
+  // to it, so they can outlive the model.
+  std::shared_ptr<ncnn::PoolAllocator> blob_allocator;
+  std::shared_ptr<ncnn::UnlockedPoolAllocator> workspace_allocator;
+  bool lightmode = true;
+  // the threads of every run are bound to these cpus, null if not bound
+  std::shared_ptr<ncnn::CpuSet> cpu_affinity;
+  // The "act_<weight name>" outputs of a calibration graph (see
+  // ncnnmeta::ExportCalibrationModel), and the sums of their squares over
+  // `num_act_samples` runs.
+  std::vector<std::pair<std::string, int>> act_blob_ids;
+  std::map<std::string, std::vector<double>> act_sum_squares;
+  int num_act_samples = 0;
   NcnnExtra(const std::shared_ptr<ncnn::Net> &net, int input_blob_id,
             const std::vector<std::vector<int>> &state_ids, int output_blob_id,
             const std::vector<std::vector<int>> &output_state_ids,
@@ -1,11 +1,16 @@
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <sstream>
+#if defined __ANDROID__ || defined __linux__
+#include <sched.h>
+#endif
 #include <codecvt>
 #ifdef FR_ENABLE_ANDROID_ASSET
 #include <android/asset_manager.h>
 #endif
 
+#include <allocator.h>
 #include <cpu.h>
 #include <net.h>
 
@@ -23,13 +28,77 @@ namespace _ncnn {
 
 static const bool kDebug = std::getenv("FR_DEBUG") != nullptr;
 
-void init_model(Model *model, Device device, const std::string &_path,
-                const std::string &strategy, const std::any &extra) {
-  // use all big cores
+// The ncnn-only options of the strategy, e.g. "ncnn fp16 bf16=0 lightmode=0".
+// The defaults are the behavior without any option.
+struct NetOptions {
+  // bf16 storage for fp16 weights, ignored with vulkan
+  bool bf16 = true;
+  bool lightmode = true;
+  // load the sequence graph (<path>.seq.*) if it is exported. It has its own
+  // fp16 copy of the weights, so it can be skipped to save memory.
+  bool seq = true;
+  // the cores of ncnn::get_cpu_thread_affinity_mask (0 = all, 1 = little,
+  // 2 = big) if `cpus` is not set
 #ifdef __ANDROID__
-  ncnn::set_cpu_powersave(2);
+  std::optional<int> powersave = 2;
+#else
+  std::optional<int> powersave;
 #endif
+};
+
+static NetOptions ParseNetOptions(const StrategyOptions &options) {
+  NetOptions net_options;
+  for (const auto &[key, value] : options.backend_options) {
+    if (key == "powersave") {
+      RV_CHECK(value == "0" || value == "1" || value == "2")
+          << "the value of ncnn option \"powersave\" should be 0, 1 or 2";
+      net_options.powersave = std::stoi(value);
+      continue;
+    }
+    RV_CHECK(value == "0" || value == "1")
+        << "the value of ncnn option \"" << key << "\" should be 0 or 1";
+    const bool on = value == "1";
+    if (key == "bf16") {
+      net_options.bf16 = on;
+    } else if (key == "lightmode") {
+      net_options.lightmode = on;
+    } else if (key == "seq") {
+      net_options.seq = on;
+    } else {
+      RV_UNIMPLEMENTED() << "unknown ncnn option: " << key;
+    }
+  }
+  return net_options;
+}
+
+#if defined __ANDROID__ || defined __linux__
+// Binds the calling thread and its OpenMP threads to `cpus` in its scope, so
+// that the memory they touch first is allocated on the NUMA node of `cpus`.
+class ScopedThreadAffinity {
+public:
+  explicit ScopedThreadAffinity(const ncnn::CpuSet &cpus) {
+    cpu_set_t old_set;
+    CPU_ZERO(&old_set);
+    RV_CHECK(sched_getaffinity(0, sizeof(old_set), &old_set) == 0);
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &old_set)) {
+        _old_cpus.enable(i);
+      }
+    }
+    RV_CHECK(ncnn::set_cpu_thread_affinity(cpus) == 0)
+        << "failed to set the cpu affinity";
+  }
+  ~ScopedThreadAffinity() { ncnn::set_cpu_thread_affinity(_old_cpus); }
+  ScopedThreadAffinity(const ScopedThreadAffinity &) = delete;
+  ScopedThreadAffinity &operator=(const ScopedThreadAffinity &) = delete;
 
+private:
+  ncnn::CpuSet _old_cpus;
+};
+#endif
+
+void init_model(Model *model, Device device, const std::string &_path,
+                const StrategyOptions &options, const std::any &extra) {
   auto [path, android_asset] = [&]() {
     if (_path.substr(0, 6) == "asset:") {
       return std::make_pair(_path.substr(6), true);
@@ -117,6 +186,7 @@ void init_model(Model *model, Device device, const std::string &_path,
     }
   }
   int ncnn_impl_version = 1;
+  int seq_len = 0;
   if (!config.empty()) {
     const auto get_value = [&config](const std::string &key,
                                      std::optional<std::string> default_value =
@@ -161,6 +231,21 @@ void init_model(Model *model, Device device, const std::string &_path,
     model->_n_att = std::stoi(get_value("n_att"));
     model->_n_ffn = std::stoi(get_value("n_ffn"));
     ncnn_impl_version = std::stoi(get_value("ncnn_impl_version", "1"));
+    seq_len = std::stoi(get_value("seq_len", "0"));
+  }
+  const auto net_options = ParseNetOptions(options);
+  const bool use_vulkan =
+      options.vulkan.value_or(std::getenv("FR_VULKAN") != nullptr);
+  // the cpus of every run, null if the threads are not bound
+  std::shared_ptr<ncnn::CpuSet> cpu_affinity;
+  if (!options.cpus.empty()) {
+    cpu_affinity = std::make_shared<ncnn::CpuSet>();
+    for (int cpu : options.cpus) {
+      cpu_affinity->enable(cpu);
+    }
+  } else if (net_options.powersave.has_value()) {
+    cpu_affinity = std::make_shared<ncnn::CpuSet>(
+        ncnn::get_cpu_thread_affinity_mask(*net_options.powersave));
   }
   auto net = std::make_shared<ncnn::Net>();
   if (model->_weight_dtype == DType::kInt8 ||
@@ -180,85 +265,133 @@ void init_model(Model *model, Device device, const std::string &_path,
     net->opt.use_fp16_packed = false;
     net->opt.use_fp16_arithmetic = false;
     net->opt.use_fp16_storage = false;
-    net->opt.use_vulkan_compute = (std::getenv("FR_VULKAN") != nullptr);
+    net->opt.use_vulkan_compute = use_vulkan;
     // vulkan compute does not support bf16 storage
-    if (!net->opt.use_vulkan_compute) {
-      net->opt.use_bf16_storage = true;
-    }
+    net->opt.use_bf16_storage = !use_vulkan && net_options.bf16;
   } else {
     RV_CHECK(model->_weight_dtype == DType::kFloat32);
     net->opt.use_fp16_packed = false;
     net->opt.use_fp16_arithmetic = false;
     net->opt.use_fp16_storage = false;
     net->opt.use_bf16_storage = false;
-    net->opt.use_vulkan_compute = (std::getenv("FR_VULKAN") != nullptr);
+    net->opt.use_vulkan_compute = use_vulkan;
   }
-  if (std::getenv("FR_THREADS")) {
+  net->opt.lightmode = net_options.lightmode;
+  if (options.threads > 0) {
+    net->opt.num_threads = options.threads;
+  } else if (std::getenv("FR_THREADS")) {
     net->opt.num_threads = std::stoi(std::getenv("FR_THREADS"));
+  } else if (!options.cpus.empty()) {
+    net->opt.num_threads = options.cpus.size();
   }
+  const auto load_net = [&](ncnn::Net &ncnn_net,
+                            const std::string &param_path,
+                            const std::string &bin_path) {
 #ifdef FR_ENABLE_ANDROID_ASSET
-  if (android_asset) {
-    auto *mgr = std::any_cast<AAssetManager *>(extra);
-    AAsset *asset =
-        AAssetManager_open(mgr, param_path.c_str(), AASSET_MODE_BUFFER);
-    RV_CHECK(!net->load_param(mgr, param_path.c_str()));
-    RV_CHECK(!net->load_model(mgr, bin_path.c_str()));
-  } else {
+    if (android_asset) {
+      auto *mgr = std::any_cast<AAssetManager *>(extra);
+      RV_CHECK(!ncnn_net.load_param(mgr, param_path.c_str()));
+      RV_CHECK(!ncnn_net.load_model(mgr, bin_path.c_str()));
+    } else {
 #else
-  {
+    {
 #endif
-    RV_CHECK(file_exists(param_path))
-        << "File \"" << param_path << "\" does not exist";
-    RV_CHECK(file_exists(bin_path))
-        << "File \"" << bin_path << "\" does not exist";
+      RV_CHECK(file_exists(param_path))
+          << "File \"" << param_path << "\" does not exist";
+      RV_CHECK(file_exists(bin_path))
+          << "File \"" << bin_path << "\" does not exist";
 
 #ifdef _WIN32
-    auto param_buffer = std::make_shared<std::vector<uint8_t>>(
-        read_file_to_vector(param_path));
+      auto param_buffer = std::make_shared<std::vector<uint8_t>>(
+          read_file_to_vector(param_path));
 
-    auto bin_wpath = std::wstring_convert<std::codecvt_utf8<wchar_t>>()
-                         .from_bytes(bin_path);
-    FILE *bin_fp = _wfopen(bin_wpath.c_str(), L"rb");
+      auto bin_wpath = std::wstring_convert<std::codecvt_utf8<wchar_t>>()
+                           .from_bytes(bin_path);
+      FILE *bin_fp = _wfopen(bin_wpath.c_str(), L"rb");
 
-    RV_CHECK(!net->load_param_mem((const char*)param_buffer->data()));
-    RV_CHECK(!net->load_model(bin_fp));
+      RV_CHECK(!ncnn_net.load_param_mem((const char*)param_buffer->data()));
+      RV_CHECK(!ncnn_net.load_model(bin_fp));
 #else
-    RV_CHECK(!net->load_param(param_path.c_str()));
-    RV_CHECK(!net->load_model(bin_path.c_str()));
+      RV_CHECK(!ncnn_net.load_param(param_path.c_str()));
+      RV_CHECK(!ncnn_net.load_model(bin_path.c_str()));
 #endif
+    }
+  };
+  // the ids of the input, the states, the output and the new states
+  const auto find_blobs = [&](const ncnn::Net &ncnn_net,
+                              int &input_blob_id,
+                              std::vector<std::vector<int>> &state_ids,
+                              int &output_blob_id,
+                              std::vector<std::vector<int>> &output_state_ids) {
+    for (int i = 0; i < ncnn_net.input_names().size(); i++) {
+      auto name = std::string(ncnn_net.input_names()[i]);
+      if (ncnn_impl_version == 2 && name == "input_id") {
+        input_blob_id = ncnn_net.input_indexes()[i];
+      } else if (ncnn_impl_version == 1 && name == "input") {
+        input_blob_id = ncnn_net.input_indexes()[i];
+      } else if (name.find("state_") != std::string::npos) {
+        auto tmp = name.substr(name.find("state_"));
+        auto layer_id = std::stoi(tmp.substr(6, tmp.find("_", 6) - 6));
+        state_ids.resize(layer_id + 1);
+        state_ids[layer_id].push_back(ncnn_net.input_indexes()[i]);
+      }
+    }
+    for (int i = 0; i < ncnn_net.output_names().size(); i++) {
+      auto name = std::string(ncnn_net.output_names()[i]);
+      if (name == "output") {
+        output_blob_id = ncnn_net.output_indexes()[i];
+      } else if (name.find("output_state_") != std::string::npos) {
+        auto tmp = name.substr(name.find("output_state_"));
+        auto layer_id = std::stoi(tmp.substr(13, tmp.find("_", 13) - 13));
+        output_state_ids.resize(layer_id + 1);
+        output_state_ids[layer_id].push_back(ncnn_net.output_indexes()[i]);
+      }
+    }
+  };
+
+#if defined __ANDROID__ || defined __linux__
+  std::optional<ScopedThreadAffinity> numa_affinity;
+  if (options.numa) {
+    numa_affinity.emplace(*cpu_affinity);
   }
+#else
+  RV_CHECK(!options.numa) << "numa=1 is only supported on Linux";
+#endif
+  load_net(*net, param_path, bin_path);
   int input_blob_id;
   std::vector<std::vector<int>> state_ids;
   int output_blob_id;
   std::vector<std::vector<int>> output_state_ids;
-  for (int i = 0; i < net->input_names().size(); i++) {
-    auto name = std::string(net->input_names()[i]);
-    if (ncnn_impl_version == 2 && name == "input_id") {
-      input_blob_id = net->input_indexes()[i];
-    } else if (ncnn_impl_version == 1 && name == "input") {
-      input_blob_id = net->input_indexes()[i];
-    } else if (name.find("state_") != std::string::npos) {
-      auto tmp = name.substr(name.find("state_"));
-      auto layer_id = std::stoi(tmp.substr(6, tmp.find("_", 6) - 6));
-      state_ids.resize(layer_id + 1);
-      state_ids[layer_id].push_back(net->input_indexes()[i]);
-    }
-  }
-  for (int i = 0; i < net->output_names().size(); i++) {
-    auto name = std::string(net->output_names()[i]);
-    if (name == "output") {
-      output_blob_id = net->output_indexes()[i];
-    } else if (name.find("output_state_") != std::string::npos) {
-      auto tmp = name.substr(name.find("output_state_"));
-      auto layer_id = std::stoi(tmp.substr(13, tmp.find("_", 13) - 13));
-      output_state_ids.resize(layer_id + 1);
-      output_state_ids[layer_id].push_back(net->output_indexes()[i]);
-    }
-  }
+  find_blobs(*net, input_blob_id, state_ids, output_blob_id, output_state_ids);
 
-  model->_extra =
+  auto ncnn_extra =
       std::make_shared<NcnnExtra>(net, input_blob_id, state_ids, output_blob_id,
                                   output_state_ids, ncnn_impl_version);
+  for (int i = 0; i < net->output_names().size(); i++) {
+    const std::string name(net->output_names()[i]);
+    if (name.substr(0, 4) == "act_") {
+      ncnn_extra->act_blob_ids.emplace_back(name.substr(4),
+                                            net->output_indexes()[i]);
+    }
+  }
+  if (seq_len > 1 && net_options.seq) {
+    auto seq_net = std::make_shared<ncnn::Net>();
+    seq_net->opt = net->opt;
+    load_net(*seq_net, path + ".seq.param", path + ".seq.bin");
+    find_blobs(*seq_net, ncnn_extra->seq_input_blob_id,
+               ncnn_extra->seq_state_ids, ncnn_extra->seq_output_blob_id,
+               ncnn_extra->seq_output_state_ids);
+    ncnn_extra->seq_net = seq_net;
+    ncnn_extra->seq_len = seq_len;
+  }
+  if (options.arena) {
+    ncnn_extra->blob_allocator = std::make_shared<ncnn::PoolAllocator>();
+    ncnn_extra->workspace_allocator =
+        std::make_shared<ncnn::UnlockedPoolAllocator>();
+  }
+  ncnn_extra->lightmode = net_options.lightmode;
+  ncnn_extra->cpu_affinity = cpu_affinity;
+  model->_extra = ncnn_extra;
 }
 
 KernelRegister init_model_reg("init_model", Device::kNCNN, init_model);
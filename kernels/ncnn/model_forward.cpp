@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
+#include <allocator.h>
+#include <cpu.h>
 #include <net.h>
 
 #include "extra.h"
@@ -22,6 +25,8 @@ namespace rwkv {
 // And register the backend with:
 // KernelRegister xxxxx_model_forward_reg("model_forward", Device::kXXX,
 //         GraphBackendForward<T>);
+// ncnn registers its own variant of GraphBackendForward, see
+// _ncnn::ModelForward.
 
 // NOTE: the memory is shared here. You can also copy it if you want.
 template <> ncnn::Mat Tensor::FromTensor() const {
@@ -41,8 +46,15 @@ template <> ncnn::Mat Tensor::FromTensor() const {
   }
 }
 
-// NOTE: the memory is not shared, otherwise the data may be released
-template <> Tensor Tensor::ToTensor(const ncnn::Mat &ncnn_mat) {
+namespace _ncnn {
+// NOTE: the memory is shared: the tensor holds a reference to the ncnn::Mat,
+// so ncnn neither frees nor reuses it while the tensor is alive. The new
+// states of a step therefore stay where ncnn wrote them, and are passed back
+// by FromTensor in the next step without any copy.
+// The tensor also keeps `allocator`, the pool the Mat is allocated from (if
+// any), alive, so that the states can outlive the model.
+static Tensor MatToTensor(const ncnn::Mat &ncnn_mat,
+                          std::shared_ptr<ncnn::PoolAllocator> allocator) {
   Shape shape;
   if (ncnn_mat.dims == 1) {
     shape = {ncnn_mat.w};
@@ -53,9 +65,60 @@ template <> Tensor Tensor::ToTensor(const ncnn::Mat &ncnn_mat) {
   } else {
     RV_UNIMPLEMENTED();
   }
-  return Copy(
-      Tensor::FromPtr(ncnn_mat.data, shape, DType::kFloat32, Device::kCPU),
-      Device::kCPU, /*always_copy=*/true);
+  RV_CHECK(ncnn_mat.elemsize == 4 && ncnn_mat.elempack == 1);
+  const size_t channel_size = static_cast<size_t>(ncnn_mat.w) * ncnn_mat.h;
+  if (ncnn_mat.dims == 3 && ncnn_mat.cstep != channel_size) {
+    // the channels are padded for alignment, only a copy is contiguous
+    auto tensor = Tensor::Empty(shape, DType::kFloat32, Device::kCPU);
+    for (int q = 0; q < ncnn_mat.c; q++) {
+      const float *channel = ncnn_mat.channel(q);
+      std::copy_n(channel, channel_size,
+                  tensor.data_ptr<float>() + q * channel_size);
+    }
+    return tensor;
+  }
+  struct Owner {
+    // declared first so that it is destroyed after the Mat
+    std::shared_ptr<ncnn::PoolAllocator> allocator;
+    ncnn::Mat mat;
+  };
+  return Tensor::FromPtr(
+      ncnn_mat.data, shape, DType::kFloat32, Device::kCPU,
+      std::make_shared<Owner>(Owner{std::move(allocator), ncnn_mat}));
+}
+} // namespace _ncnn
+
+template <> Tensor Tensor::ToTensor(const ncnn::Mat &ncnn_mat) {
+  return _ncnn::MatToTensor(ncnn_mat, nullptr);
+}
+
+// an extractor of `net` which allocates from the pools in `extra`, and runs on
+// the cpus of `extra`
+static ncnn::Extractor CreateExtractor(const NcnnExtra &extra,
+                                       const ncnn::Net &net) {
+  // The affinity belongs to the OpenMP threads of the calling thread, which
+  // may run other models, so it is set again whenever the model changes. A
+  // model without an affinity gets the default (all cores) back.
+  thread_local std::weak_ptr<ncnn::CpuSet> bound_affinity;
+  thread_local bool affinity_bound = false;
+  if (extra.cpu_affinity) {
+    if (bound_affinity.lock() != extra.cpu_affinity) {
+      ncnn::set_cpu_thread_affinity(*extra.cpu_affinity);
+      bound_affinity = extra.cpu_affinity;
+      affinity_bound = true;
+    }
+  } else if (affinity_bound) {
+    ncnn::set_cpu_thread_affinity(ncnn::get_cpu_thread_affinity_mask(0));
+    bound_affinity.reset();
+    affinity_bound = false;
+  }
+  ncnn::Extractor ex = net.create_extractor();
+  ex.set_light_mode(extra.lightmode);
+  if (extra.blob_allocator) {
+    ex.set_blob_allocator(extra.blob_allocator.get());
+    ex.set_workspace_allocator(extra.workspace_allocator.get());
+  }
+  return ex;
 }
 
 template <>
@@ -71,7 +134,7 @@ GraphBackendForwardInternal(const Model *model, int id,
   auto output_blob_id = extra.output_blob_id;
   auto &output_state_ids = extra.output_state_ids;
   int ncnn_impl_version = extra.ncnn_impl_version;
-  ncnn::Extractor ex = net.create_extractor();
+  ncnn::Extractor ex = CreateExtractor(extra, net);
   ncnn::Mat input;
   RV_CHECK(ncnn_impl_version == 1 || ncnn_impl_version == 2) << "Invalid ncnn_impl_version: " << ncnn_impl_version;
   if (ncnn_impl_version == 1) {
@@ -104,11 +167,106 @@ GraphBackendForwardInternal(const Model *model, int id,
       new_states[i].push_back(output_state);
     }
   }
+  if (!extra.act_blob_ids.empty()) {
+    for (const auto &[name, blob_id] : extra.act_blob_ids) {
+      ncnn::Mat act;
+      ex.extract(blob_id, act);
+      auto &sum_squares = extra.act_sum_squares[name];
+      sum_squares.resize(act.w);
+      const float *data = act;
+      for (int i = 0; i < sum_squares.size(); i++) {
+        sum_squares[i] += data[i] * data[i];
+      }
+    }
+    extra.num_act_samples++;
+  }
   RV_CHECK(output.c == 1 && output.d == 1 && output.h == 1);
   return {output, new_states};
 }
 
+namespace def {
+Tensor ModelForwardSeqFallback(Model *model, Device device,
+                               const std::vector<int> &ids, bool full_output);
+}
+
+namespace _ncnn {
+
+// Runs `extra.seq_len` tokens through the sequence graph, which updates the
+// states in place and returns the logits of the last token.
+static Tensor ForwardChunk(Model *model, const NcnnExtra &extra,
+                           const int *ids) {
+  auto &states = model->states();
+  ncnn::Extractor ex = CreateExtractor(extra, *extra.seq_net);
+  ex.input(extra.seq_input_blob_id,
+           ncnn::Mat(extra.seq_len, const_cast<int *>(ids), /*_elemsize=*/4u));
+  for (int i = 0; i < states.size(); i++) {
+    for (int j = 0; j < states[i].size(); j++) {
+      ex.input(extra.seq_state_ids[i][j], states[i][j].FromTensor<ncnn::Mat>());
+    }
+  }
+  ncnn::Mat output;
+  ex.extract(extra.seq_output_blob_id, output);
+  for (int i = 0; i < states.size(); i++) {
+    for (int j = 0; j < states[i].size(); j++) {
+      ncnn::Mat output_state;
+      ex.extract(extra.seq_output_state_ids[i][j], output_state);
+      states[i][j] = MatToTensor(output_state, extra.blob_allocator);
+    }
+  }
+  RV_CHECK(output.c == 1 && output.d == 1 && output.h == 1);
+  return MatToTensor(output, extra.blob_allocator);
+}
+
+// GraphBackendForward, but the tensors of the new states and the output keep
+// the blob pool of the model alive
+static Tensor ModelForward(Model *model, Device device, int id) {
+  auto &extra = *std::any_cast<std::shared_ptr<NcnnExtra>>(model->extra());
+  auto &states = model->states();
+  std::vector<std::vector<ncnn::Mat>> ncnn_states(states.size());
+  for (int i = 0; i < states.size(); i++) {
+    ncnn_states[i].reserve(states[i].size());
+    for (int j = 0; j < states[i].size(); j++) {
+      ncnn_states[i].push_back(states[i][j].FromTensor<ncnn::Mat>());
+    }
+  }
+  auto [output, new_states] =
+      GraphBackendForwardInternal(model, id, std::move(ncnn_states));
+  for (int i = 0; i < states.size(); i++) {
+    for (int j = 0; j < states[i].size(); j++) {
+      states[i][j] = MatToTensor(new_states[i][j], extra.blob_allocator);
+    }
+  }
+  return MatToTensor(output, extra.blob_allocator);
+}
+
+// The prompt is run in chunks of `seq_len` tokens by the sequence graph (if
+// it is exported), and the remaining tokens one by one.
+Tensor ModelForwardSeq(Model *model, Device device, const std::vector<int> &ids,
+                       bool full_output) {
+  auto &extra = *std::any_cast<std::shared_ptr<NcnnExtra>>(model->extra());
+  const int n = ids.size();
+  // the sequence graph only outputs the logits of the last token
+  if (full_output || !extra.seq_net || n < extra.seq_len) {
+    return def::ModelForwardSeqFallback(model, device, ids, full_output);
+  }
+  const int num_chunked = n / extra.seq_len * extra.seq_len;
+  for (int i = 0; i < num_chunked; i += extra.seq_len) {
+    model->CheckCancelled();
+    auto output = ForwardChunk(model, extra, ids.data() + i);
+    if (i + extra.seq_len == n) {
+      return output;
+    }
+  }
+  return def::ModelForwardSeqFallback(
+      model, device, std::vector<int>(ids.begin() + num_chunked, ids.end()),
+      false);
+}
+
+} // namespace _ncnn
+
 KernelRegister ncnn_model_forward_reg("model_forward", Device::kNCNN,
-                                      GraphBackendForward<ncnn::Mat>);
+                                      _ncnn::ModelForward);
+KernelRegister ncnn_model_forward_seq_reg("model_forward_seq", Device::kNCNN,
+                                          _ncnn::ModelForwardSeq);
 
 } // namespace rwkv
@@ -21,7 +21,7 @@ namespace onnx {
 static const bool kDebug = std::getenv("FR_DEBUG") != nullptr;
 
 void init_model(Model *model, Device device, const std::string &path,
-                const std::string &strategy, const std::any &extra) {
+                const StrategyOptions &options, const std::any &extra) {
   auto env = std::make_shared<Ort::Env>();
   Ort::SessionOptions session_options;
   if (std::getenv("VERBOSE") != nullptr) {
@@ -31,6 +31,13 @@ void init_model(Model *model, Device device, const std::string &path,
   }
   // ORT optimization has a bug on rwkv models with layernorm 17
   session_options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_DISABLE_ALL);
+  // cpus and numa are not supported
+  if (options.threads > 0) {
+    session_options.SetIntraOpNumThreads(options.threads);
+  }
+  if (!options.arena) {
+    session_options.DisableCpuMemArena();
+  }
 #ifdef __ANDROID__
   if (std::getenv("NNAPI") != nullptr) {
     uint32_t nnapi_flags = 0;
@@ -25,7 +25,7 @@ namespace _qnn {
 static const bool kDebug = std::getenv("FR_DEBUG") != nullptr;
 
 void init_model(Model *model, Device device, const std::string &_path,
-                const std::string &strategy, const std::any &extra) {
+                const StrategyOptions &options, const std::any &extra) {
 
   auto [path, android_asset] = [&]() {
     if (_path.substr(0, 6) == "asset:") {
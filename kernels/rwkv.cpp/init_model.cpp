@@ -21,7 +21,7 @@ namespace _RwkvCpp {
 static const bool kDebug = std::getenv("FR_DEBUG") != nullptr;
 
 void init_model(Model *model, Device device, const std::string &_path,
-                const std::string &strategy, const std::any &extra) {
+                const StrategyOptions &options, const std::any &extra) {
 
   auto [path, android_asset] = [&]() {
     if (_path.substr(0, 6) == "asset:") {
@@ -107,7 +107,8 @@ void init_model(Model *model, Device device, const std::string &_path,
     RV_UNIMPLEMENTED() << "No config file found";
   }
 
-  model_extra.ctx = rwkv_init_from_file(_path.c_str(), 1, 0);
+  model_extra.ctx = rwkv_init_from_file(
+      _path.c_str(), options.threads > 0 ? options.threads : 1, 0);
   RV_CHECK(model_extra.ctx != nullptr) << "Failed to init rwkv.cpp context from file: " << _path;
 }
 
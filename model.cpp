@@ -2,6 +2,7 @@
 
 #include "check.h"
 #include "kernels/kernels.h"
+#include <kernels/cpu/topk.h>
 #include <tensor.h>
 #include <utils.h>
 
@@ -16,8 +17,11 @@
 #include <kernels/mtk/include/rwkv_mtk.h>
 #include <kernels/mtk/extra.h>
 #endif
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <msgpack.hpp>
 #include <string>
 
@@ -56,7 +60,10 @@ Model::Model(const std::string &path, const std::string &strategy,
   }();
   _act_device = act_device;
   std::tie(_act_dtype, _weight_dtype) = [&]() -> std::pair<DType, DType> {
-    std::string dtype_str = strategy.substr(strategy.find(" ") + 1);
+    // the second word, the backends may accept options after it
+    const auto dtype_begin = strategy.find(" ") + 1;
+    std::string dtype_str = strategy.substr(
+        dtype_begin, strategy.find(" ", dtype_begin) - dtype_begin);
     if (dtype_str == "int4") {
       return {DType::kFloat32, DType::kInt4};
     } else if (dtype_str == "int8") {
@@ -73,7 +80,8 @@ Model::Model(const std::string &path, const std::string &strategy,
     }
   }();
 
-  init_model(this, act_device, path, strategy, extra);
+  _strategy_options = StrategyOptions::Parse(strategy);
+  init_model(this, act_device, path, _strategy_options, extra);
   if (kDebug) {
     std::cout << "Model inited" << std::endl;
     std::cout << "version: " << _version << std::endl;
@@ -139,6 +147,7 @@ void Model::LoadStateFile(const std::string &path) {
 }
 
 void Model::LoadStateFile(const std::string &path, void* asset_manager) {
+  std::lock_guard<std::recursive_mutex> lock(_run_mutex);
   const std::string data = read_file(path, asset_manager);
 
   auto unpacker = msgpack::unpack(data.data(), data.length());
@@ -177,6 +186,7 @@ void Model::LoadStateFile(const std::string &path, void* asset_manager) {
 }
 
 void Model::ResetStates() {
+  std::lock_guard<std::recursive_mutex> lock(_run_mutex);
 #ifdef FR_ENABLE_QNN
   if (_act_device == Device::kQNN) {
     QnnRwkvBackend_t _backend;
@@ -191,7 +201,11 @@ void Model::ResetStates() {
     neuron_rwkv_reset(extra.neuron_runtime);
   }
 #endif
-  _states.clear();
+  _states = InitialStates();
+}
+
+States Model::InitialStates() const {
+  States states;
   // TODO:
   auto device = (_act_device == Device::kNCNN || _act_device == Device::kONNX 
     || _act_device == Device::kQNN || _act_device == Device::kMTK || 
@@ -199,32 +213,43 @@ void Model::ResetStates() {
      ? Device::kCPU : _act_device;
   if (this->_version == "4") {
     for (int i = 0; i < _n_layer; i++) {
-      _states.push_back({});
+      states.push_back({});
       auto s1 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s1, 0), device));
+      states.back().push_back(Copy(fill_(s1, 0), device));
       auto s2 = Tensor::Empty(Shape{_n_att}, DType::kFloat32, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s2, 0), device));
+      states.back().push_back(Copy(fill_(s2, 0), device));
       auto s3 = Tensor::Empty(Shape{_n_att}, DType::kFloat32, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s3, 0), device));
+      states.back().push_back(Copy(fill_(s3, 0), device));
       auto s4 = Tensor::Empty(Shape{_n_att}, DType::kFloat32, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s4, -1e30), device));
+      states.back().push_back(Copy(fill_(s4, -1e30), device));
       auto s5 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s5, 0), device));
+      states.back().push_back(Copy(fill_(s5, 0), device));
     }
   } else {
     RV_CHECK(_version.substr(0, 1) == "5" || _version.substr(0, 1) == "6" || _version.substr(0, 1) == "7");
     for (int i = 0; i < _n_layer; i++) {
-      _states.push_back({});
+      states.push_back({});
       auto s1 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s1, 0), device));
+      states.back().push_back(Copy(fill_(s1, 0), device));
       auto s2 = Tensor::Empty(Shape{this->_head_size, _n_att / this->_head_size,
                                     _n_embd / this->_head_size},
                               DType::kFloat32, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s2, 0), device));
+      states.back().push_back(Copy(fill_(s2, 0), device));
       auto s3 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
-      _states.back().push_back(Copy(fill_(s3, 0), device));
+      states.back().push_back(Copy(fill_(s3, 0), device));
+    }
+  }
+  return states;
+}
+
+States Model::CloneStates() const {
+  States cloned(_states.size());
+  for (int i = 0; i < _states.size(); i++) {
+    for (const auto &s : _states[i]) {
+      cloned[i].push_back(Copy(s, s.device(), /*always_copy=*/true));
     }
   }
+  return cloned;
 }
 
 static Tensor CopyToCPUIfAvailable(Tensor x) {
@@ -236,7 +261,10 @@ static Tensor CopyToCPUIfAvailable(Tensor x) {
   }
 }
 
-Tensor Model::Run(const std::vector<int> &ids) {
+Tensor Model::Run(const std::vector<int> &ids) { return Run(ids, false); }
+
+Tensor Model::Run(const std::vector<int> &ids, bool full_output) {
+  std::lock_guard<std::recursive_mutex> lock(_run_mutex);
   if (kDebug) {
     std::cout << "[seq mode]Model::Run(";
     for (auto id : ids) {
@@ -245,17 +273,177 @@ Tensor Model::Run(const std::vector<int> &ids) {
     std::cout << ")" << std::endl;
   }
   if (ids.size() == 1) {
-    return CopyToCPUIfAvailable(
+    auto output = CopyToCPUIfAvailable(
         ModelForward(this, this->_act_device, ids[0]));
+    if (full_output) {
+      return Tensor::FromOther(output, {1, output.numel()});
+    }
+    return output;
   } else {
     return CopyToCPUIfAvailable(
-        ModelForwardSeq(this, this->_act_device, ids, false));
+        ModelForwardSeq(this, this->_act_device, ids, full_output));
   }
 }
 
 Tensor Model::Run(int id) {
+  std::lock_guard<std::recursive_mutex> lock(_run_mutex);
   return CopyToCPUIfAvailable(
       ModelForward(this, this->_act_device, id));
 }
 
+template <typename F>
+auto Model::RunInSession(Session &session, const CancellationToken *token,
+                         F fn) {
+  // the states of QNN and MTK models live in their runtimes
+  RV_CHECK(_act_device != Device::kQNN && _act_device != Device::kMTK)
+      << "sessions are not supported on device "
+      << static_cast<int>(_act_device);
+  RV_CHECK(session.states.size() == _states.size());
+  std::lock_guard<std::recursive_mutex> lock(_run_mutex);
+  std::swap(_states, session.states);
+  _cancel_token = token;
+  try {
+    CheckCancelled();
+    auto output = fn();
+    _cancel_token = nullptr;
+    std::swap(_states, session.states);
+    return output;
+  } catch (...) {
+    _cancel_token = nullptr;
+    std::swap(_states, session.states);
+    throw;
+  }
+}
+
+Tensor Model::Run(Session &session, const std::vector<int> &ids,
+                  bool full_output, const CancellationToken *token) {
+  return RunInSession(session, token, [&]() {
+    if (session.head_slice != nullptr) {
+      return RunWithHeadSlice(ids, full_output, *session.head_slice);
+    }
+    return Run(ids, full_output);
+  });
+}
+
+std::shared_ptr<const HeadSlice>
+Model::MakeHeadSlice(const std::vector<int> &ids) const {
+  const int n_vocab = _embd_weights.size();
+  auto slice = std::make_shared<HeadSlice>(
+      HeadSlice{ids, Tensor::Empty({0}, DType::kFloat32, Device::kCPU)});
+  std::sort(slice->ids.begin(), slice->ids.end());
+  slice->ids.erase(std::unique(slice->ids.begin(), slice->ids.end()),
+                   slice->ids.end());
+  RV_CHECK(!slice->ids.empty());
+  RV_CHECK(slice->ids.front() >= 0 && slice->ids.back() < n_vocab)
+      << "token id out of range";
+  if (_act_device != Device::kCPU && _act_device != Device::kCUDA) {
+    return slice;
+  }
+  // head.weight is the last parameter, see init_model
+  const Tensor head = Copy(_params.back(), Device::kCPU);
+  RV_CHECK(head.shape().size() == 2 && head.size(1) == n_vocab);
+  const int n_embd = head.size(0);
+  const int n = slice->ids.size();
+  auto weight = Tensor::Empty({n_embd, n}, head.dtype(), Device::kCPU);
+  const auto elem = head.elem_size();
+  const auto *src = static_cast<const char *>(head.data_ptr());
+  auto *dst = static_cast<char *>(weight.data_ptr());
+  for (int c = 0; c < n_embd; c++) {
+    for (int j = 0; j < n; j++) {
+      memcpy(dst + (static_cast<size_t>(c) * n + j) * elem,
+             src + (static_cast<size_t>(c) * n_vocab + slice->ids[j]) * elem,
+             elem);
+    }
+  }
+  slice->weight = Copy(weight, _act_device);
+  return slice;
+}
+
+Tensor Model::RunWithHeadSlice(const std::vector<int> &ids, bool full_output,
+                               const HeadSlice &slice) {
+  const int n_vocab = _embd_weights.size();
+  const int n = slice.ids.size();
+  const bool fused = !full_output && (_act_device == Device::kCPU ||
+                                      _act_device == Device::kCUDA);
+  Tensor logits = [&]() {
+    if (!fused) {
+      return Copy(Run(ids, full_output), Device::kCPU);
+    }
+    return Copy(ModelForwardHeadSlice(this, _act_device, RunLayers(ids),
+                                      slice.weight),
+                Device::kCPU);
+  }();
+  // rows of the full logits, or one row of the compact logits
+  const int num_rows = fused ? 1 : logits.numel() / n_vocab;
+  Tensor output = Tensor::Empty(
+      full_output ? Shape{num_rows, n_vocab} : Shape{n_vocab},
+      DType::kFloat32, Device::kCPU);
+  auto *out_ptr = output.data_ptr<float>();
+  std::fill_n(out_ptr, output.numel(), -std::numeric_limits<float>::infinity());
+  const auto *in_ptr = logits.data_ptr<float>();
+  for (int r = 0; r < num_rows; r++) {
+    for (int j = 0; j < n; j++) {
+      out_ptr[r * n_vocab + slice.ids[j]] =
+          fused ? in_ptr[j] : in_ptr[r * n_vocab + slice.ids[j]];
+    }
+  }
+  return output;
+}
+
+Tensor Model::RunLayers(const std::vector<int> &ids) {
+  // the logits of the prompt prefix are not needed, but the seq forward
+  // computes them anyway
+  if (ids.size() > 1) {
+    Run(std::vector<int>(ids.begin(), ids.end() - 1));
+  }
+  Tensor v_first = Tensor::Empty({0}, DType::kFloat32, Device::kNCNNMeta);
+  return ModelForwardLayers(this, _act_device, _embd_weights[ids.back()],
+                            _states, 0, _n_layer, v_first);
+}
+
+static TopK ToTopK(const std::tuple<Tensor, Tensor, float> &output) {
+  const auto &[values, indices, log_sum_exp] = output;
+  TopK top_k;
+  top_k.ids.assign(indices.data_ptr<int>(),
+                   indices.data_ptr<int>() + indices.numel());
+  top_k.logits.assign(values.data_ptr<float>(),
+                      values.data_ptr<float>() + values.numel());
+  top_k.log_sum_exp = log_sum_exp;
+  return top_k;
+}
+
+TopK Model::RunTopK(const std::vector<int> &ids, int k) {
+  RV_CHECK(!ids.empty());
+  RV_CHECK(k >= 1);
+  std::lock_guard<std::recursive_mutex> lock(_run_mutex);
+  return ToTopK([&]() -> std::tuple<Tensor, Tensor, float> {
+    if (_act_device == Device::kCPU || _act_device == Device::kCUDA) {
+      return ModelForwardHeadTopK(this, _act_device, RunLayers(ids), k);
+    }
+    // other backends run the whole graph, select on the full logits
+    auto logits = Copy(Run(ids), Device::kCPU);
+    cpu::TopKAccumulator acc(std::min<int>(k, logits.numel()));
+    acc.PushTile(logits.data_ptr<float>(), 0, logits.numel());
+    return acc.Finish();
+  }());
+}
+
+TopK Model::RunTopK(Session &session, const std::vector<int> &ids, int k,
+                    const CancellationToken *token) {
+  if (session.head_slice == nullptr) {
+    return RunInSession(session, token, [&]() { return RunTopK(ids, k); });
+  }
+  // the other tokens are -inf, they add nothing to the log-sum-exp
+  auto logits = Run(session, ids, false, token);
+  cpu::TopKAccumulator acc(std::min<int>(k, session.head_slice->ids.size()));
+  acc.PushTile(logits.data_ptr<float>(), 0, logits.numel());
+  return ToTopK(acc.Finish());
+}
+
+void Model::CheckCancelled() const {
+  if (_cancel_token != nullptr && _cancel_token->cancelled()) {
+    throw FRCancelled() << "the run is cancelled";
+  }
+}
+
 } // namespace rwkv
@@ -1,26 +1,89 @@
 #pragma once
 
 #include <any>
+#include <atomic>
 #include <cassert>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "strategy.h"
 #include "tensor.h"
 
 namespace rwkv {
 using States = std::vector<std::vector<Tensor>>;
+
+// Cooperative cancellation of a run. It is checked between layers and between
+// tokens, and copies of a token share the same flag.
+class CancellationToken {
+public:
+  CancellationToken()
+      : _cancelled(std::make_shared<std::atomic<bool>>(false)) {}
+  void Cancel() { _cancelled->store(true); }
+  bool cancelled() const { return _cancelled->load(); }
+
+private:
+  std::shared_ptr<std::atomic<bool>> _cancelled;
+};
+
+struct Session;
+
+// A compact copy of some columns of the output head, see
+// Session::head_slice.
+struct HeadSlice {
+  // sorted and unique
+  std::vector<int> ids;
+  // [n_embd, ids.size()] on the activation device, empty on backends which
+  // run the whole graph
+  Tensor weight;
+};
+
+// The `k` most likely next tokens of a run, see Model::RunTopK.
+struct TopK {
+  // in descending order of logits
+  std::vector<int> ids;
+  std::vector<float> logits;
+  // log(sum(exp(logit))) over the whole vocabulary, so that
+  // exp(logits[i] - log_sum_exp) is the probability of ids[i]
+  float log_sum_exp;
+};
+
 struct Model {
   Model(const std::string &path, const std::string &strategy);
   Model(const std::string &path, const std::string &strategy, std::any extra);
   Tensor Run(const std::vector<int> &id);
+  // When `full_output` is true, the logits of every token are returned as a
+  // [len(ids), n_vocab] tensor instead of only the last one.
+  Tensor Run(const std::vector<int> &id, bool full_output);
   Tensor Run(int id);
+  // Run `id` with the states of `session` instead of the model's own states.
+  // All runs and state operations on one model are serialized. When `token` is
+  // cancelled the run throws FRCancelled, leaving the session states partially
+  // updated, so the session should be reset before it is reused.
+  Tensor Run(Session &session, const std::vector<int> &id,
+             bool full_output = false,
+             const CancellationToken *token = nullptr);
+  // Like Run(), but only the `k` largest logits are returned. On CPU and CUDA
+  // the head is fused with the selection, so the full logits are never
+  // materialized. It is enough for greedy (k = 1) and small top-k sampling.
+  TopK RunTopK(const std::vector<int> &id, int k);
+  TopK RunTopK(Session &session, const std::vector<int> &id, int k,
+               const CancellationToken *token = nullptr);
+  // Gather the columns `ids` of the output head, to be set as the
+  // `head_slice` of sessions which can only emit these tokens.
+  std::shared_ptr<const HeadSlice>
+  MakeHeadSlice(const std::vector<int> &ids) const;
   void LoadStateFile(const std::string &path);
   void LoadStateFile(const std::string &path, void* asset_manager);
   void SaveStateFile(const std::string &path);
   void ResetStates();
+  // newly initialized states, as set by ResetStates
+  States InitialStates() const;
   void set_states(const States &states);
+  // deep copy of the current states, e.g. for rolling back speculative tokens
+  States CloneStates() const;
   const States &states() const { return _states; }
   States &states() { return _states; }
   const int head_size() const { return _head_size; }
@@ -31,9 +94,15 @@ struct Model {
   const std::string &version() const { return _version; }
   const std::any &extra() const { return _extra; }
   const Device act_device() const { return _act_device; }
+  // the key=value options of the strategy
+  const StrategyOptions &strategy_options() const { return _strategy_options; }
 
   DType weight_dtype() const { return _weight_dtype; }
 
+  // throws FRCancelled if the current run is cancelled, called by the
+  // forward kernels between layers and tokens
+  void CheckCancelled() const;
+
   // TODO:
   std::vector<Tensor> _embd_weights;
 
@@ -51,7 +120,34 @@ private:
   int _head_size = 0;
   int _rescale_layer = 999;
   std::string _version;
+  StrategyOptions _strategy_options;
   std::any _extra;
   States _states;
+  // recursive because Run(Session &, ...) is built on Run()
+  std::recursive_mutex _run_mutex;
+  // swaps in the states of `session` while `fn` runs
+  template <typename F>
+  auto RunInSession(Session &session, const CancellationToken *token, F fn);
+  // Feed `id` through all layers but not the head (CPU and CUDA only), and
+  // return the residual of the last token.
+  Tensor RunLayers(const std::vector<int> &id);
+  // the logits of only `slice.ids`, scattered into [n_vocab] logits where
+  // the other tokens are -inf
+  Tensor RunWithHeadSlice(const std::vector<int> &id, bool full_output,
+                          const HeadSlice &slice);
+  // only set during Run(Session &, ...)
+  const CancellationToken *_cancel_token = nullptr;
+};
+
+// The states of one independent sequence (e.g. a conversation), so that many
+// sequences can share the weights of one model.
+struct Session {
+  explicit Session(const Model &model) : states(model.InitialStates()) {}
+  void Reset(const Model &model) { states = model.InitialStates(); }
+  States states;
+  // When set, only the tokens of the slice can be emitted: the logits of the
+  // other tokens are -inf, and on CPU and CUDA the head only computes the
+  // columns of the slice. A slice can be shared by many sessions.
+  std::shared_ptr<const HeadSlice> head_slice;
 };
 } // namespace rwkv
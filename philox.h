@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace rwkv {
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+// 3"). A counter-based generator: the output is a pure function of (key,
+// counter), so any draw can be computed directly, by any thread, in any
+// order, and is the same on every platform.
+class Philox4x32 {
+public:
+  using Counter = std::array<uint32_t, 4>;
+  using Key = std::array<uint32_t, 2>;
+
+  static Counter Generate(Counter counter, Key key) {
+    for (int i = 0; i < kRounds; i++) {
+      if (i > 0) {
+        key[0] += kWeyl0;
+        key[1] += kWeyl1;
+      }
+      const uint64_t p0 = static_cast<uint64_t>(kMul0) * counter[0];
+      const uint64_t p1 = static_cast<uint64_t>(kMul1) * counter[2];
+      counter = {static_cast<uint32_t>(p1 >> 32) ^ counter[1] ^ key[0],
+                 static_cast<uint32_t>(p1),
+                 static_cast<uint32_t>(p0 >> 32) ^ counter[3] ^ key[1],
+                 static_cast<uint32_t>(p0)};
+    }
+    return counter;
+  }
+
+  // a uniform double in [0, 1) identified by (seed, stream, step), e.g.
+  // (request seed, session or batch row, token index)
+  static double Uniform(uint64_t seed, uint64_t stream, uint64_t step) {
+    const auto out = Generate(
+        {static_cast<uint32_t>(step), static_cast<uint32_t>(step >> 32),
+         static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32)},
+        {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
+    // 53 random bits
+    const uint64_t bits =
+        (static_cast<uint64_t>(out[0]) << 21) | (out[1] >> 11);
+    return static_cast<double>(bits) * (1.0 / 9007199254740992.0);
+  }
+
+private:
+  static constexpr int kRounds = 10;
+  static constexpr uint32_t kMul0 = 0xD2511F53;
+  static constexpr uint32_t kMul1 = 0xCD9E8D57;
+  static constexpr uint32_t kWeyl0 = 0x9E3779B9;
+  static constexpr uint32_t kWeyl1 = 0xBB67AE85;
+};
+
+} // namespace rwkv
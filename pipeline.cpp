@@ -0,0 +1,83 @@
+#include "pipeline.h"
+
+#include <algorithm>
+
+#include <kernels/kernels.h>
+
+namespace rwkv {
+
+PipelineRunner::PipelineRunner(Model &model, int num_stages,
+                               int queue_capacity)
+    : _model(model) {
+  RV_CHECK(model.act_device() == Device::kCPU ||
+           model.act_device() == Device::kCUDA)
+      << "pipeline mode is not supported on device "
+      << static_cast<int>(model.act_device());
+  RV_CHECK(queue_capacity >= 1);
+  const int n_layer = model.n_layer();
+  num_stages = std::clamp(num_stages, 1, n_layer);
+  for (int i = 0; i < num_stages; i++) {
+    _stage_layers.emplace_back(i * n_layer / num_stages,
+                               (i + 1) * n_layer / num_stages);
+  }
+  for (int i = 0; i < num_stages; i++) {
+    _queues.push_back(std::make_unique<Queue>(queue_capacity));
+  }
+  for (int i = 0; i < num_stages; i++) {
+    _threads.emplace_back(&PipelineRunner::StageLoop, this, i);
+  }
+}
+
+PipelineRunner::~PipelineRunner() {
+  _stop.store(true);
+  for (auto &queue : _queues) {
+    queue->Wake();
+  }
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+  // the promises of unfinished tasks are broken when the queues are destroyed
+}
+
+std::future<Tensor> PipelineRunner::Submit(int id, States &states) {
+  RV_CHECK(states.size() == _model.n_layer());
+  auto task = std::make_unique<Task>(
+      Task{_model._embd_weights[id],
+           Tensor::Empty({0}, DType::kFloat32, Device::kNCNNMeta), &states,
+           std::promise<Tensor>()});
+  auto future = task->promise.get_future();
+  std::lock_guard<std::mutex> lock(_submit_mutex);
+  RV_CHECK(_queues[0]->Push(std::move(task), _stop))
+      << "pipeline is stopped";
+  return future;
+}
+
+void PipelineRunner::StageLoop(int stage) {
+  const auto [layer_begin, layer_end] = _stage_layers[stage];
+  const bool is_last = stage == _stage_layers.size() - 1;
+  const Device device = _model.act_device();
+  auto &input = *_queues[stage];
+
+  std::unique_ptr<Task> task;
+  while (input.Pop(task, _stop)) {
+    try {
+      task->x = ModelForwardLayers(&_model, device, task->x, *task->states,
+                                   layer_begin, layer_end, task->v_first);
+      if (is_last) {
+        auto output = ModelForwardHead(&_model, device, task->x);
+        task->promise.set_value(Copy(output, Device::kCPU));
+        task.reset();
+        continue;
+      }
+    } catch (...) {
+      task->promise.set_exception(std::current_exception());
+      task.reset();
+      continue;
+    }
+    if (!_queues[stage + 1]->Push(std::move(task), _stop)) {
+      return;
+    }
+  }
+}
+
+} // namespace rwkv
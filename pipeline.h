@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <check.h>
+#include <model.h>
+
+namespace rwkv {
+
+// Lock-free ring buffer with exactly one producer thread and one consumer
+// thread. Push and Pop spin briefly and then sleep, so that idle threads
+// don't keep their cores busy.
+template <typename T> class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity) : _buffer(capacity + 1) {}
+  FR_DISALLOW_COPY_AND_MOVE(SpscQueue);
+
+  // `item` is moved from only if the push succeeds
+  bool TryPush(T &&item) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    const size_t next = Next(tail);
+    if (next == _head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    _buffer[tail] = std::move(item);
+    _tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T &item) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = std::move(_buffer[head]);
+    _head.store(Next(head), std::memory_order_release);
+    return true;
+  }
+
+  // Blocks until `item` is pushed (returns true) or `stop` is set and Wake is
+  // called (returns false)
+  bool Push(T &&item, const std::atomic<bool> &stop) {
+    return Wait([&]() { return TryPush(std::move(item)); }, stop);
+  }
+
+  // Blocks until an item is popped (returns true) or `stop` is set and Wake
+  // is called (returns false)
+  bool Pop(T &item, const std::atomic<bool> &stop) {
+    return Wait([&]() { return TryPop(item); }, stop);
+  }
+
+  // wakes up the blocked Push and Pop, e.g. after setting their `stop`
+  void Wake() {
+    { std::lock_guard<std::mutex> lock(_mutex); }
+    _cv.notify_all();
+  }
+
+private:
+  template <typename F> bool Wait(F &&try_once, const std::atomic<bool> &stop) {
+    constexpr int kSpinCount = 1000;
+    for (int i = 0; i < kSpinCount; i++) {
+      if (try_once()) {
+        WakeSleepers();
+        return true;
+      }
+      if (stop.load(std::memory_order_relaxed)) {
+        return false;
+      }
+    }
+    bool success = false;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _sleepers.fetch_add(1, std::memory_order_relaxed);
+      // pairs with the fence in WakeSleepers: either the other side sees the
+      // sleeper and notifies under the mutex, or its change is seen here
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      _cv.wait(lock, [&]() {
+        success = try_once();
+        return success || stop.load(std::memory_order_relaxed);
+      });
+      _sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (success) {
+      WakeSleepers();
+    }
+    return success;
+  }
+
+  // Wake, but only if the other side sleeps, so that the common path stays
+  // lock-free
+  void WakeSleepers() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleepers.load(std::memory_order_relaxed) > 0) {
+      Wake();
+    }
+  }
+
+  size_t Next(size_t i) const { return i + 1 == _buffer.size() ? 0 : i + 1; }
+  std::vector<T> _buffer;
+  // on separate cache lines so that the two threads don't share one
+  alignas(64) std::atomic<size_t> _head{0};
+  alignas(64) std::atomic<size_t> _tail{0};
+  // only for sleeping, the queue itself is lock-free
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  // the threads in _cv.wait
+  std::atomic<int> _sleepers{0};
+};
+
+// Layer-pipelined decoding. The layers of the model are split into
+// `num_stages` contiguous ranges, each run by its own thread. With several
+// independent sequences in flight, stage i works on one sequence while stage
+// i+1 works on another one. The residual `x` is handed off between stages
+// through SpscQueue.
+//
+// Only the backends running the default per-layer forward (CPU and CUDA) can
+// be split.
+class PipelineRunner {
+public:
+  PipelineRunner(Model &model, int num_stages, int queue_capacity = 16);
+  ~PipelineRunner();
+  FR_DISALLOW_COPY_AND_MOVE(PipelineRunner);
+
+  // Feed `id` to the sequence whose states are `states` and return the future
+  // logits. `states` is updated in place by the stages, so it must be kept
+  // alive and must not be used elsewhere until the future is ready, i.e. a
+  // sequence can only have one token in flight.
+  std::future<Tensor> Submit(int id, States &states);
+
+  int num_stages() const { return _stage_layers.size(); }
+  // [begin, end) layers of each stage
+  const std::vector<std::pair<int, int>> &stage_layers() const {
+    return _stage_layers;
+  }
+
+private:
+  struct Task {
+    Tensor x;
+    Tensor v_first;
+    States *states;
+    std::promise<Tensor> promise;
+  };
+  using Queue = SpscQueue<std::unique_ptr<Task>>;
+
+  void StageLoop(int stage);
+
+  Model &_model;
+  std::vector<std::pair<int, int>> _stage_layers;
+  // _queues[i] is the input of stage i
+  std::vector<std::unique_ptr<Queue>> _queues;
+  std::vector<std::thread> _threads;
+  std::atomic<bool> _stop{false};
+  // serializes the producers of the first queue
+  std::mutex _submit_mutex;
+};
+
+} // namespace rwkv
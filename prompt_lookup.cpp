@@ -0,0 +1,179 @@
+#include "prompt_lookup.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <check.h>
+
+namespace rwkv {
+
+static const bool kDebug = std::getenv("FR_DEBUG") != nullptr;
+
+NgramIndex::NgramIndex(int min_n, int max_n)
+    : _min_n(min_n), _max_n(max_n), _continuations(max_n + 1) {
+  RV_CHECK(min_n >= 1 && min_n <= max_n)
+      << "invalid n-gram range [" << min_n << ", " << max_n << "]";
+}
+
+// FNV-1a over the n tokens ending (exclusively) at `end`
+uint64_t NgramIndex::hash(int end, int n) const {
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = end - n; i < end; i++) {
+    h ^= static_cast<uint32_t>(_history[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void NgramIndex::Append(int id) {
+  // An n-gram is indexed only when the token following it arrives, so the
+  // suffix being looked up never matches itself.
+  const int end = _history.size();
+  for (int n = _min_n; n <= _max_n && n <= end; n++) {
+    _continuations[n][hash(end, n)] = end;
+  }
+  _history.push_back(id);
+}
+
+void NgramIndex::Append(const std::vector<int> &ids) {
+  for (auto id : ids) {
+    Append(id);
+  }
+}
+
+std::vector<int> NgramIndex::Propose(int max_tokens) const {
+  const int end = _history.size();
+  for (int n = std::min<int>(_max_n, end); n >= _min_n && max_tokens > 0;
+       n--) {
+    auto it = _continuations[n].find(hash(end, n));
+    if (it == _continuations[n].end()) {
+      continue;
+    }
+    const int start = it->second;
+    // verify the match in case of a hash collision
+    if (!std::equal(_history.begin() + start - n, _history.begin() + start,
+                    _history.begin() + end - n)) {
+      continue;
+    }
+    const int len = std::min(max_tokens, end - start);
+    return std::vector<int>(_history.begin() + start,
+                            _history.begin() + start + len);
+  }
+  return {};
+}
+
+PromptLookupDecoder::PromptLookupDecoder(Model &model, Sampler &sampler,
+                                         int num_draft_tokens, int min_ngram,
+                                         int max_ngram)
+    : _model(model), _sampler(sampler), _num_draft_tokens(num_draft_tokens),
+      _min_ngram(min_ngram), _max_ngram(max_ngram) {
+  RV_CHECK(num_draft_tokens >= 1);
+}
+
+std::vector<int>
+PromptLookupDecoder::Generate(const std::vector<int> &prompt_ids,
+                              int max_new_tokens, float temperature, int top_k,
+                              float top_p,
+                              const std::function<bool(int)> &callback) {
+  RV_CHECK(!prompt_ids.empty());
+  std::vector<int> output_ids;
+  if (max_new_tokens <= 0) {
+    return output_ids;
+  }
+  NgramIndex index(_min_ngram, _max_ngram);
+  index.Append(prompt_ids);
+
+  auto sample_row = [&](Tensor &logits, int row) {
+    const auto n_vocab = logits.size(1);
+    auto row_view =
+        Tensor::FromPtr(logits.data_ptr<float>() + row * n_vocab, {n_vocab},
+                        DType::kFloat32, Device::kCPU);
+    return _sampler.Sample(row_view, temperature, top_k, top_p);
+  };
+
+  // `cur` is the last sampled token, which has not been fed to the model yet
+  int cur = _sampler.Sample(_model.Run(prompt_ids), temperature, top_k, top_p);
+  index.Append(cur);
+  output_ids.push_back(cur);
+  _stats.generated_tokens++;
+  if ((callback && !callback(cur)) || max_new_tokens == 1) {
+    return output_ids;
+  }
+
+  // The states of QNN and MTK models live in their runtimes, so
+  // CloneStates can't roll them back. Decode without drafts there.
+  const bool can_rollback = _model.act_device() != Device::kQNN &&
+                            _model.act_device() != Device::kMTK;
+  while (true) {
+    const int remaining = max_new_tokens - output_ids.size();
+    // each verification step emits at most one token more than the draft
+    auto draft =
+        can_rollback
+            ? index.Propose(std::min(_num_draft_tokens, remaining - 1))
+            : std::vector<int>();
+    if (kDebug) {
+      std::cout << "[prompt lookup] draft size: " << draft.size() << std::endl;
+    }
+
+    States snapshot;
+    std::vector<int> step_ids{cur};
+    step_ids.insert(step_ids.end(), draft.begin(), draft.end());
+    if (!draft.empty()) {
+      snapshot = _model.CloneStates();
+    }
+    auto logits = _model.Run(step_ids, /*full_output=*/true);
+    RV_CHECK(logits.device() == Device::kCPU &&
+             logits.dtype() == DType::kFloat32 && logits.shape().size() == 2 &&
+             logits.size(0) == step_ids.size());
+
+    // The sample at position i is drawn from the real distribution of the
+    // model given all previous tokens, so accepting the draft token only when
+    // it equals the sample keeps the output distribution unchanged.
+    std::vector<int> new_ids;
+    int accepted = 0;
+    for (int i = 0; i <= draft.size(); i++) {
+      int id = sample_row(logits, i);
+      new_ids.push_back(id);
+      if (i == draft.size() || id != draft[i]) {
+        break;
+      }
+      accepted++;
+    }
+    _stats.steps++;
+    _stats.drafted_tokens += draft.size();
+    _stats.accepted_tokens += accepted;
+
+    bool stop = false;
+    int emitted = 0;
+    for (auto id : new_ids) {
+      index.Append(id);
+      output_ids.push_back(id);
+      emitted++;
+      if ((callback && !callback(id)) ||
+          output_ids.size() >= max_new_tokens) {
+        stop = true;
+        break;
+      }
+    }
+    _stats.generated_tokens += emitted;
+
+    // The model has consumed `cur` and the whole draft, but it should only
+    // have consumed `cur` and the emitted tokens except the last one. RWKV
+    // states can not be truncated, so roll back and replay the prefix.
+    const int consumed = emitted - 1;
+    if (consumed < draft.size()) {
+      _model.states() = std::move(snapshot);
+      std::vector<int> replay_ids{cur};
+      replay_ids.insert(replay_ids.end(), draft.begin(),
+                        draft.begin() + consumed);
+      _model.Run(replay_ids);
+    }
+    cur = output_ids.back();
+    if (stop) {
+      break;
+    }
+  }
+  return output_ids;
+}
+
+} // namespace rwkv
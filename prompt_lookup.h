@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include <model.h>
+#include <sampler.h>
+
+namespace rwkv {
+
+// Index of all n-grams (min_n <= n <= max_n) in the token history. For every
+// n-gram it remembers where the tokens following its most recent occurrence
+// start, so that a lookup is O(1) per n.
+class NgramIndex {
+public:
+  NgramIndex(int min_n, int max_n);
+  void Append(int id);
+  void Append(const std::vector<int> &ids);
+  // Propose at most `max_tokens` tokens continuing the history, by matching
+  // the longest suffix of the history with an earlier position of it.
+  std::vector<int> Propose(int max_tokens) const;
+  const std::vector<int> &history() const { return _history; }
+
+private:
+  uint64_t hash(int end, int n) const;
+  int _min_n;
+  int _max_n;
+  std::vector<int> _history;
+  // one map per n, from n-gram hash to the start of its continuation
+  std::vector<std::unordered_map<uint64_t, int>> _continuations;
+};
+
+struct SpeculativeStats {
+  // number of verification forwards
+  int64_t steps = 0;
+  int64_t drafted_tokens = 0;
+  int64_t accepted_tokens = 0;
+  int64_t generated_tokens = 0;
+  float acceptance_rate() const {
+    return drafted_tokens == 0 ? 0.f : 1.f * accepted_tokens / drafted_tokens;
+  }
+  float tokens_per_step() const {
+    return steps == 0 ? 0.f : 1.f * generated_tokens / steps;
+  }
+};
+
+// Draft-free speculative decoding ("prompt lookup decoding"). The draft tokens
+// are copied from the prompt/history by NgramIndex and verified in one
+// seq-mode forward with `full_output`. Every position is sampled from the
+// model's own logits and a draft token is accepted only if it equals the
+// sampled one, so the output distribution is the same as plain decoding.
+// On QNN and MTK, whose states can't be rolled back, it falls back to plain
+// decoding.
+class PromptLookupDecoder {
+public:
+  PromptLookupDecoder(Model &model, Sampler &sampler, int num_draft_tokens = 8,
+                      int min_ngram = 1, int max_ngram = 3);
+  // Feed `prompt_ids` and generate at most `max_new_tokens` tokens.
+  // `callback` is called for each generated token and can return false to
+  // stop the generation.
+  std::vector<int>
+  Generate(const std::vector<int> &prompt_ids, int max_new_tokens,
+           float temperature, int top_k, float top_p,
+           const std::function<bool(int)> &callback = nullptr);
+  const SpeculativeStats &stats() const { return _stats; }
+  void ResetStats() { _stats = SpeculativeStats(); }
+
+private:
+  Model &_model;
+  Sampler &_sampler;
+  int _num_draft_tokens;
+  int _min_ngram;
+  int _max_ngram;
+  SpeculativeStats _stats;
+};
+
+} // namespace rwkv
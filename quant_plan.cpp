@@ -0,0 +1,127 @@
+#include "quant_plan.h"
+
+#include <cctype>
+#include <sstream>
+
+#include <check.h>
+#include <utils.h>
+
+namespace rwkv {
+
+namespace {
+DType ParseDType(const std::string &str) {
+  if (str == "fp32") {
+    return DType::kFloat32;
+  } else if (str == "fp16") {
+    return DType::kFloat16;
+  } else if (str == "int8") {
+    return DType::kInt8;
+  } else if (str == "int4") {
+    return DType::kInt4;
+  }
+  RV_UNIMPLEMENTED() << "Only fp32, fp16, int8 and int4 are supported in a "
+                        "quantization plan. But got "
+                     << str << ".";
+}
+
+std::optional<int> ParseIndex(const std::string &str) {
+  if (str.empty()) {
+    return std::nullopt;
+  }
+  size_t pos = 0;
+  int result = 0;
+  try {
+    result = std::stoi(str, &pos);
+  } catch (const std::exception &) {
+  }
+  RV_CHECK(pos == str.size()) << "invalid layer index \"" << str << "\"";
+  return result;
+}
+
+// "-2:" -> {-2, nullopt}
+std::pair<std::optional<int>, std::optional<int>>
+ParseSlice(const std::string &str) {
+  const auto colon = str.find(':');
+  RV_CHECK(colon != std::string::npos)
+      << "invalid layer slice \"{" << str << "}\", it should be like {0:2}";
+  return {ParseIndex(str.substr(0, colon)), ParseIndex(str.substr(colon + 1))};
+}
+
+bool Match(const std::string &pattern, size_t pi, const std::string &name,
+           size_t ni, int n_layer) {
+  if (pi == pattern.size()) {
+    return ni == name.size();
+  }
+  if (pattern[pi] == '*') {
+    for (size_t i = ni; i <= name.size(); i++) {
+      if (Match(pattern, pi + 1, name, i, n_layer)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (pattern[pi] == '{') {
+    const auto close = pattern.find('}', pi);
+    const auto [begin, end] =
+        ParseSlice(pattern.substr(pi + 1, close - pi - 1));
+    size_t digits_end = ni;
+    while (digits_end < name.size() && std::isdigit(name[digits_end])) {
+      digits_end++;
+    }
+    if (digits_end == ni) {
+      return false;
+    }
+    const int index = std::stoi(name.substr(ni, digits_end - ni));
+    const auto resolve = [n_layer](int i) { return i < 0 ? i + n_layer : i; };
+    if (index < resolve(begin.value_or(0)) ||
+        index >= resolve(end.value_or(n_layer))) {
+      return false;
+    }
+    return Match(pattern, close + 1, name, digits_end, n_layer);
+  }
+  return ni < name.size() && pattern[pi] == name[ni] &&
+         Match(pattern, pi + 1, name, ni + 1, n_layer);
+}
+} // namespace
+
+QuantPlan QuantPlan::Parse(const std::string &text) {
+  QuantPlan plan;
+  std::istringstream ss(text);
+  for (std::string line; std::getline(ss, line);) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream line_ss(line);
+    std::string pattern, dtype, extra;
+    if (!(line_ss >> pattern)) {
+      continue;
+    }
+    RV_CHECK(line_ss >> dtype && !(line_ss >> extra))
+        << "invalid line \"" << line
+        << "\" in quantization plan, it should be \"<pattern> <dtype>\"";
+    // check the layer slices once here instead of failing in Get
+    for (size_t pos = pattern.find('{'); pos != std::string::npos;
+         pos = pattern.find('{', pos + 1)) {
+      const auto close = pattern.find('}', pos);
+      RV_CHECK(close != std::string::npos)
+          << "unclosed \"{\" in pattern \"" << pattern << "\"";
+      ParseSlice(pattern.substr(pos + 1, close - pos - 1));
+    }
+    plan._rules.push_back({pattern, ParseDType(dtype)});
+  }
+  return plan;
+}
+
+QuantPlan QuantPlan::FromFile(const std::string &path) {
+  return Parse(read_file(path));
+}
+
+std::optional<DType> QuantPlan::Get(const std::string &name,
+                                    int n_layer) const {
+  for (auto it = _rules.rbegin(); it != _rules.rend(); ++it) {
+    if (Match(it->pattern, 0, name, 0, n_layer)) {
+      return it->dtype;
+    }
+  }
+  return std::nullopt;
+}
+
+} // namespace rwkv
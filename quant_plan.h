@@ -0,0 +1,42 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <tensor.h>
+
+namespace rwkv {
+
+// The dtypes of the weights by their names, e.g.
+//
+//   # the other weights use the dtype of the export or the strategy
+//   blocks.*.att.output.weight  fp16
+//   blocks.{:2}.*               int8
+//   blocks.{-2:}.*              int8
+//   head.weight                 fp16
+//
+// A line is a pattern and one of fp32/fp16/int8/int4. `*` matches any
+// characters, and `{begin:end}` matches a layer index in [begin, end) like a
+// python slice (so negative indices count from the last layer, and
+// `{-2:}` means the last two layers). The last matching line wins.
+class QuantPlan {
+public:
+  QuantPlan() = default;
+  static QuantPlan Parse(const std::string &text);
+  static QuantPlan FromFile(const std::string &path);
+
+  bool empty() const { return _rules.empty(); }
+  // the dtype of the weight `name` of a model with `n_layer` layers, or
+  // nullopt if no line matches it
+  std::optional<DType> Get(const std::string &name, int n_layer) const;
+
+private:
+  struct Rule {
+    std::string pattern;
+    DType dtype;
+  };
+  std::vector<Rule> _rules;
+};
+
+} // namespace rwkv
@@ -1,7 +1,10 @@
 #include "sampler.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <numeric>
 #include <random>
 #include <string>
@@ -9,8 +12,11 @@
 #include <chrono>
 
 #include <check.h>
+#include <philox.h>
 #include <kernels/kernels.h>
+#include <model.h>
 #include <tensor.h>
+#include <thread_pool.h>
 
 namespace rwkv {
 
@@ -32,6 +38,97 @@ int distribution(std::vector<float> probs, std::minstd_rand0 &generator) {
   RV_UNIMPLEMENTED();
 }
 
+namespace {
+
+// exp(x) for x <= 0, using the polynomial of cephes' expf (about 1 ulp error).
+// It is branch-free so that the loops calling it can be auto-vectorized.
+inline float ExpNonPositive(float x) {
+  const float clamped = std::max(x, -87.3f);
+  const float fn = clamped * 1.44269504088896341f;
+  // round to nearest, fn <= 0
+  const int n = static_cast<int>(fn - 0.5f);
+  // Cody-Waite reduction, r = x - n * ln(2)
+  const float r = clamped - n * 0.693359375f + n * 2.12194440e-4f;
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.f;
+  // 2^n
+  const int32_t bits = (n + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return x < -87.3f ? 0.f : p * scale;
+}
+
+// independent accumulators so that the reductions are vectorized without
+// -ffast-math
+constexpr int kLanes = 8;
+
+float Max(const float *x, size_t size) {
+  float lanes[kLanes];
+  std::fill(lanes, lanes + kLanes, x[0]);
+  size_t i = 0;
+  for (; i + kLanes <= size; i += kLanes) {
+    for (int j = 0; j < kLanes; j++) {
+      lanes[j] = std::max(lanes[j], x[i + j]);
+    }
+  }
+  for (; i < size; i++) {
+    lanes[0] = std::max(lanes[0], x[i]);
+  }
+  return *std::max_element(lanes, lanes + kLanes);
+}
+
+// out[i] = exp(x[i] - max), returns the sum of out
+float ExpAndSum(const float *x, float max, float *out, size_t size) {
+  float lanes[kLanes] = {0};
+  size_t i = 0;
+  for (; i + kLanes <= size; i += kLanes) {
+    for (int j = 0; j < kLanes; j++) {
+      out[i + j] = ExpNonPositive(x[i + j] - max);
+      lanes[j] += out[i + j];
+    }
+  }
+  for (; i < size; i++) {
+    out[i] = ExpNonPositive(x[i] - max);
+    lanes[0] += out[i];
+  }
+  return std::accumulate(lanes, lanes + kLanes, 0.f);
+}
+
+// The probabilities are in [0, 1] and the bit patterns of non-negative floats
+// are monotonic, so the top bits (exponent and 5 bits of mantissa) of a
+// probability make a bucket key. Buckets are numbered in descending order.
+constexpr int kBucketShift = 18;
+constexpr int kNumBuckets = (0x3F800000 >> kBucketShift) + 1;
+
+inline int DescendingBucket(float p) {
+  uint32_t bits;
+  memcpy(&bits, &p, sizeof(bits));
+  // clamped in case of a NaN or a rounding error above 1
+  return std::max(0, kNumBuckets - 1 - static_cast<int>(bits >> kBucketShift));
+}
+
+// below this size the buckets cost more than sorting everything
+constexpr size_t kMinSizeForBuckets = 4 * kNumBuckets;
+
+// the draw of the original sampler, kept for reproducibility of seeded runs
+auto MinstdUniform(std::minstd_rand0 &generator) {
+  return [&generator]() {
+    return 1. * (generator() - generator.min()) /
+           (generator.max() - generator.min());
+  };
+}
+
+auto PhiloxUniform(const SampleKey &key) {
+  return [key]() { return Philox4x32::Uniform(key.seed, key.stream, key.step); };
+}
+
+} // namespace
+
 Sampler::Sampler() {
   _generator.seed(std::random_device()());
 }
@@ -42,77 +139,353 @@ int Sampler::Sample(const Tensor &logits, float temperature, int top_k,
     std::cout << "Sample: temperature=" << temperature << ", top_k=" << top_k
               << ", top_p=" << top_p << std::endl;
   }
+  return SampleRow(logits.data_ptr<float>(), logits.numel(), temperature,
+                   top_k, top_p, MinstdUniform(_generator), _scratch);
+}
+
+int Sampler::Sample(const Tensor &logits, float temperature, int top_k,
+                    float top_p, const SampleKey &key) {
+  return SampleRow(logits.data_ptr<float>(), logits.numel(), temperature,
+                   top_k, top_p, PhiloxUniform(key), _scratch);
+}
+
+const float *Sampler::MaskLogits(const Tensor &logits,
+                                const uint64_t *allowed_mask) {
+  RV_CHECK(allowed_mask != nullptr);
+  const size_t size = logits.numel();
+  const float *data = logits.data_ptr<float>();
+  auto &masked = _scratch.masked_logits;
+  masked.resize(size);
+  constexpr float kMinusInf = -std::numeric_limits<float>::infinity();
+  bool any_allowed = false;
+  // whole words are copied or filled, which is the common case with
+  // structured outputs (either almost everything or almost nothing allowed)
+  for (size_t begin = 0; begin < size; begin += 64) {
+    const size_t n = std::min<size_t>(64, size - begin);
+    const uint64_t word = allowed_mask[begin / 64];
+    const uint64_t all = n == 64 ? ~uint64_t{0} : (uint64_t{1} << n) - 1;
+    any_allowed |= (word & all) != 0;
+    if ((word & all) == all) {
+      std::copy_n(data + begin, n, masked.data() + begin);
+    } else if ((word & all) == 0) {
+      std::fill_n(masked.data() + begin, n, kMinusInf);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        masked[begin + i] = (word >> i) & 1 ? data[begin + i] : kMinusInf;
+      }
+    }
+  }
+  RV_CHECK(any_allowed) << "the mask allows none of the " << size
+                        << " tokens, there is nothing to sample";
+  return masked.data();
+}
 
-  size_t size = logits.numel();
+int Sampler::Sample(const Tensor &logits, float temperature, int top_k,
+                    float top_p, const uint64_t *allowed_mask) {
+  return SampleRow(MaskLogits(logits, allowed_mask), logits.numel(),
+                   temperature, top_k, top_p, MinstdUniform(_generator),
+                   _scratch);
+}
+
+int Sampler::Sample(const Tensor &logits, float temperature, int top_k,
+                    float top_p, const uint64_t *allowed_mask,
+                    const SampleKey &key) {
+  return SampleRow(MaskLogits(logits, allowed_mask), logits.numel(),
+                   temperature, top_k, top_p, PhiloxUniform(key), _scratch);
+}
 
+int Sampler::Sample(const TopK &candidates, float temperature, float top_p) {
+  const auto &ids = candidates.ids;
+  const auto &logits = candidates.logits;
+  RV_CHECK(!ids.empty() && ids.size() == logits.size());
+  temperature = std::clamp(temperature, 0.1f, 5.f);
+  const int k = ids.size();
+  if (k == 1) {
+    return ids[0];
+  }
+  // top-p on the probabilities over the whole vocabulary
+  int len = 0;
+  float cumsum = 0;
+  while (len < k) {
+    cumsum += std::exp(logits[len] - candidates.log_sum_exp);
+    len++;
+    if (cumsum >= top_p) {
+      break;
+    }
+  }
+  auto &weights = _scratch.temp_probs;
+  weights.resize(len);
+  const float inv_temperature = 1.f / temperature;
+  float total = 0;
+  for (int i = 0; i < len; i++) {
+    weights[i] = ExpNonPositive((logits[i] - logits[0]) * inv_temperature);
+    total += weights[i];
+  }
+  float random_value = MinstdUniform(_generator)() * total;
+  cumsum = 0;
+  for (int i = 0; i < len; i++) {
+    cumsum += weights[i];
+    if (cumsum >= random_value) {
+      return ids[i];
+    }
+  }
+  // only reachable by rounding errors
+  return ids[len - 1];
+}
+
+std::vector<int> Sampler::SampleBatch(const Tensor &logits,
+                                      const std::vector<SampleParams> &params,
+                                      ThreadPool *pool) {
+  // one stream per row, seeded in row order so that the result does not
+  // depend on the scheduling
+  const int batch_size = logits.size(0);
+  std::vector<std::minstd_rand0> generators;
+  generators.reserve(batch_size);
+  for (int i = 0; i < batch_size; i++) {
+    generators.emplace_back(_generator());
+  }
+  return SampleRows(logits, params, pool,
+                    [&](int i) { return MinstdUniform(generators[i]); });
+}
+
+std::vector<int> Sampler::SampleBatch(const Tensor &logits,
+                                      const std::vector<SampleParams> &params,
+                                      const std::vector<SampleKey> &keys,
+                                      ThreadPool *pool) {
+  RV_CHECK(keys.size() == logits.size(0))
+      << "keys size " << keys.size() << " != batch size " << logits.size(0);
+  return SampleRows(logits, params, pool,
+                    [&](int i) { return PhiloxUniform(keys[i]); });
+}
+
+template <typename MakeUniform>
+std::vector<int> Sampler::SampleRows(const Tensor &logits,
+                                     const std::vector<SampleParams> &params,
+                                     ThreadPool *pool,
+                                     MakeUniform &&make_uniform) {
+  RV_CHECK(logits.shape().size() == 2 && logits.dtype() == DType::kFloat32 &&
+           logits.device() == Device::kCPU);
+  const int batch_size = logits.size(0);
+  const size_t n_vocab = logits.size(1);
+  RV_CHECK(params.size() == 1 || params.size() == batch_size)
+      << "params size " << params.size() << " != batch size " << batch_size;
+  if (kDebug) {
+    std::cout << "SampleBatch: batch_size=" << batch_size << std::endl;
+  }
+
+  // rows are split into contiguous chunks, each with its own scratch buffers
+  const int num_chunks =
+      pool == nullptr ? 1
+                      : std::min(batch_size, pool->num_threads() + 1);
+  if (_batch_scratch.size() < num_chunks) {
+    _batch_scratch.resize(num_chunks);
+  }
+  std::vector<int> ids(batch_size);
+  auto run_chunk = [&](int chunk) {
+    const int begin = chunk * batch_size / num_chunks;
+    const int end = (chunk + 1) * batch_size / num_chunks;
+    for (int i = begin; i < end; i++) {
+      const auto &p = params.size() == 1 ? params[0] : params[i];
+      ids[i] = SampleRow(logits.data_ptr<float>() + i * n_vocab, n_vocab,
+                         p.temperature, p.top_k, p.top_p, make_uniform(i),
+                         _batch_scratch[chunk]);
+    }
+  };
+  if (pool == nullptr) {
+    run_chunk(0);
+  } else {
+    pool->ParallelFor(num_chunks, run_chunk);
+  }
+  return ids;
+}
+
+template <typename Uniform>
+int Sampler::SampleRow(const float *data, size_t size, float temperature,
+                       int top_k, float top_p, Uniform &&uniform,
+                       Scratch &scratch) {
   temperature = std::clamp(temperature, 0.1f, 5.f);
   if (top_k >= size || top_k == 0)
     top_k = size;
 
   if (top_k == 1)
-    return std::max_element(logits.data_ptr<float>(), logits.data_ptr<float>() + size) - logits.data_ptr<float>();
-
-  // softmax
-  float sum = 0;
-  int *index = new int[size];
-  float *probs = new float[size];
+    return std::max_element(data, data + size) - data;
 
-  const float max_logit = *std::max_element(logits.data_ptr<float>(), logits.data_ptr<float>() + size);
-
-  for (int i = 0; i < size; i++) {
-    probs[i] = std::exp(logits.data_ptr<float>()[i] - max_logit);
-    sum += probs[i];
-    index[i] = i;
+  // softmax, without the division
+  const float max_logit = Max(data, size);
+  if (max_logit == std::numeric_limits<float>::infinity()) {
+    // the +inf logits take all the probability, and inf - inf is NaN below
+    return std::find(data, data + size, max_logit) - data;
   }
+  scratch.probs.resize(size);
+  auto &bucket_begin = scratch.bucket_begin;
+  auto &bucket_mass = scratch.bucket_mass;
+  float *probs = scratch.probs.data();
+  const float sum = ExpAndSum(data, max_logit, probs, size);
+  RV_CHECK(std::isfinite(sum) && sum > 0)
+      << "cannot sample from logits which are NaN or all -inf (e.g. when a "
+         "constraint allows no token)";
 
-  if (top_k != size)
-    std::nth_element(index, index + top_k,
-          index + size,
-          [&](int i, int j) { return probs[i] > probs[j]; });
-    std::sort(index, index + top_k,
-          [&](int i, int j) { return probs[i] > probs[j]; });
+  // Counting sort of the indices by bucket, so that the candidates come in
+  // descending order bucket by bucket and only the buckets where top-k/top-p
+  // cuts or the random choice falls need to be sorted.
+  const int num_buckets = size >= kMinSizeForBuckets ? kNumBuckets : 1;
+  auto bucket_of = [num_buckets](float p) {
+    return num_buckets == 1 ? 0 : DescendingBucket(p);
+  };
+  bucket_begin.assign(num_buckets + 1, 0);
+  bucket_mass.resize(num_buckets);
+  for (size_t i = 0; i < size; i++) {
+    bucket_begin[bucket_of(probs[i]) + 1]++;
+  }
+  std::partial_sum(bucket_begin.begin(), bucket_begin.end(),
+                   bucket_begin.begin());
+  scratch.index.resize(size);
+  int *index = scratch.index.data();
+  {
+    auto &cursor = scratch.bucket_cursor;
+    cursor.assign(bucket_begin.begin(), bucket_begin.end() - 1);
+    for (size_t i = 0; i < size; i++) {
+      index[cursor[bucket_of(probs[i])]++] = i;
+    }
+  }
+  for (int b = 0; b < num_buckets; b++) {
+    float mass = 0;
+    for (int j = bucket_begin[b]; j < bucket_begin[b + 1]; j++) {
+      mass += probs[index[j]];
+    }
+    bucket_mass[b] = mass;
+  }
 
-  int len = top_k;
+  auto sort_range = [&](int begin, int end) {
+    std::sort(index + begin, index + end, [probs](int i, int j) {
+      return probs[i] > probs[j] || (probs[i] == probs[j] && i < j);
+    });
+  };
 
-  // top-p
+  // top-k and top-p: whole buckets are taken until the one where the cut is
+  int len = 0;
+  int sorted_bucket = -1;
   float cumsum = 0;
-  for (int i = 0; i < len; i++) {
-    probs[index[i]] /= sum;
-    cumsum += probs[index[i]];
-    if (cumsum >= top_p) {
-      len = i + 1;
+  for (int b = 0; b < num_buckets; b++) {
+    const int begin = bucket_begin[b];
+    const int end = bucket_begin[b + 1];
+    if (begin == end) {
+      continue;
+    }
+    const float bucket_p = bucket_mass[b] / sum;
+    if (end <= top_k && cumsum + bucket_p < top_p) {
+      cumsum += bucket_p;
+      len = end;
+      continue;
+    }
+    sort_range(begin, end);
+    sorted_bucket = b;
+    bool done = false;
+    for (int j = begin; j < end && j < top_k; j++) {
+      cumsum += probs[index[j]] / sum;
+      len = j + 1;
+      if (cumsum >= top_p) {
+        done = true;
+        break;
+      }
+    }
+    if (done || len >= top_k) {
       break;
     }
   }
 
-  // temperature
+  // temperature, folded into the exponent: p^(1/t) is proportional to
+  // exp((logit - max) / t)
+  const float *weights = probs;
   if (fabs(temperature - 1.f) > 1e-6) {
-    cumsum = 0;
-    for (int i = 0; i < len; i++) {
-      probs[index[i]] = std::pow(probs[index[i]], 1.f / temperature);
-      cumsum += probs[index[i]];
+    scratch.temp_probs.resize(size);
+    const float inv_temperature = 1.f / temperature;
+    for (int j = 0; j < len; j++) {
+      scratch.temp_probs[index[j]] =
+          ExpNonPositive((data[index[j]] - max_logit) * inv_temperature);
+    }
+    weights = scratch.temp_probs.data();
+  }
+  float total = 0;
+  for (int b = 0; b < num_buckets && bucket_begin[b] < len; b++) {
+    float mass = 0;
+    const int end = std::min(bucket_begin[b + 1], len);
+    for (int j = bucket_begin[b]; j < end; j++) {
+      mass += weights[index[j]];
     }
+    bucket_mass[b] = mass;
+    total += mass;
   }
 
   // random choice
-  float random_value = 1. * (_generator() - _generator.min()) /
-                      (_generator.max() - _generator.min()) * cumsum;
-  
-  int ret = -1;
+  float random_value = uniform() * total;
+
   cumsum = 0;
-  for (int i = 0; i < len; i++) {
-    cumsum += probs[index[i]];
-    if (cumsum >= random_value) {
-      ret = index[i];
-      delete[] index;
-      delete[] probs;
-      return ret;
+  for (int b = 0; b < num_buckets && bucket_begin[b] < len; b++) {
+    if (cumsum + bucket_mass[b] < random_value) {
+      cumsum += bucket_mass[b];
+      continue;
+    }
+    const int begin = bucket_begin[b];
+    const int end = std::min(bucket_begin[b + 1], len);
+    if (b != sorted_bucket) {
+      sort_range(begin, end);
+    }
+    for (int j = begin; j < end; j++) {
+      cumsum += weights[index[j]];
+      if (cumsum >= random_value) {
+        return index[j];
+      }
     }
   }
-  
-  delete[] index;
-  delete[] probs;
-  RV_UNIMPLEMENTED();
+  // only reachable by rounding errors
+  return index[len - 1];
+}
+
+void PenaltyState::Apply(float *logits, size_t size, float presence_penalty,
+                         float frequency_penalty, float penalty_decay) {
+  const float frequency = frequency_penalty * _scale;
+  if (_seen_ids.size() * 8 >= size && _scaled.size() >= size) {
+    // dense and vectorizable when many tokens are seen
+    for (size_t i = 0; i < size; i++) {
+      logits[i] -= frequency * _scaled[i] +
+                   (_scaled[i] > 0.f ? presence_penalty : 0.f);
+    }
+  } else {
+    for (int id : _seen_ids) {
+      RV_CHECK(id < size);
+      logits[id] -= frequency * _scaled[id] + presence_penalty;
+    }
+  }
+  _scale *= penalty_decay;
+  // fold the scale back before 1 / _scale gets too large
+  if (_scale < 1e-15f) {
+    for (int id : _seen_ids) {
+      // keep seen tokens non-zero, they still get the presence penalty
+      _scaled[id] =
+          std::max(_scaled[id] * _scale, std::numeric_limits<float>::min());
+    }
+    _scale = 1.f;
+  }
+}
+
+void PenaltyState::Accept(int id, float weight) {
+  if (id >= _scaled.size()) {
+    _scaled.resize(id + 1, 0.f);
+  }
+  const bool seen = _scaled[id] > 0.f;
+  _scaled[id] += weight / _scale;
+  if (!seen && _scaled[id] > 0.f) {
+    _seen_ids.push_back(id);
+  }
+}
+
+void PenaltyState::Reset() {
+  for (int id : _seen_ids) {
+    _scaled[id] = 0.f;
+  }
+  _seen_ids.clear();
+  _scale = 1.f;
 }
 
 void Sampler::set_seed(int seed) { _generator.seed(seed); }
@@ -1,17 +1,121 @@
 #pragma once
 
+#include <cstdint>
 #include <random>
+#include <vector>
 
 #include <tensor.h>
 
 namespace rwkv {
+class ThreadPool;
+struct TopK;
+
+struct SampleParams {
+  float temperature = 1.f;
+  int top_k = 0;
+  float top_p = 1.f;
+};
+
+// Identifies the random draw of one sample for the counter-based sampling
+// overloads, e.g. (request seed, session or batch row, token index). The
+// same key always gives the same draw, whatever thread samples it and
+// whatever was sampled before.
+struct SampleKey {
+  uint64_t seed = 0;
+  uint64_t stream = 0;
+  uint64_t step = 0;
+};
+
+// Presence/frequency penalties of one sequence. The decay of the occurrences
+// is applied lazily through a running scale, so a step only touches the
+// distinct tokens seen so far instead of decaying every entry.
+class PenaltyState {
+public:
+  // For every seen token, logits[id] -= frequency_penalty * occurrence[id] +
+  // presence_penalty, then all occurrences are multiplied by `penalty_decay`.
+  void Apply(float *logits, size_t size, float presence_penalty,
+             float frequency_penalty, float penalty_decay);
+  void Apply(Tensor &logits, float presence_penalty, float frequency_penalty,
+             float penalty_decay) {
+    Apply(logits.data_ptr<float>(), logits.numel(), presence_penalty,
+          frequency_penalty, penalty_decay);
+  }
+  // occurrence[id] += weight
+  void Accept(int id, float weight = 1.f);
+  float occurrence(int id) const {
+    return id < _scaled.size() ? _scaled[id] * _scale : 0.f;
+  }
+  const std::vector<int> &seen_ids() const { return _seen_ids; }
+  void Reset();
+
+private:
+  // occurrence[id] == _scaled[id] * _scale
+  std::vector<float> _scaled;
+  float _scale = 1.f;
+  std::vector<int> _seen_ids;
+};
+
 class Sampler {
 public:
   Sampler();
   int Sample(const Tensor& logits, float temperature, int top_k, float top_p);
+  // Only the tokens whose bit is set in `allowed_mask` (bit i is
+  // allowed_mask[i / 64] >> (i % 64) & 1, e.g. from RegexConstraint) can be
+  // sampled. The mask is applied to a copy of the logits before the softmax.
+  int Sample(const Tensor &logits, float temperature, int top_k, float top_p,
+             const uint64_t *allowed_mask);
+  // The masked Sample above with the draw identified by `key`.
+  int Sample(const Tensor &logits, float temperature, int top_k, float top_p,
+             const uint64_t *allowed_mask, const SampleKey &key);
+  // Sample from the output of Model::RunTopK, the same as Sample() with
+  // top_k = candidates.ids.size() on the full logits.
+  int Sample(const TopK &candidates, float temperature, float top_p);
+  // Sample every row of `logits` ([batch_size, n_vocab]) with its own params
+  // (or the same params if `params` has one element) and its own random
+  // stream seeded from this sampler, in parallel on `pool` if it is given.
+  std::vector<int> SampleBatch(const Tensor &logits,
+                               const std::vector<SampleParams> &params,
+                               ThreadPool *pool = nullptr);
+  // Sample with the draw identified by `key` (see Philox4x32) instead of the
+  // internal generator.
+  int Sample(const Tensor &logits, float temperature, int top_k, float top_p,
+             const SampleKey &key);
+  // Like SampleBatch above, but row i draws with keys[i], so the result is
+  // reproducible from the keys alone, independently of the thread count.
+  std::vector<int> SampleBatch(const Tensor &logits,
+                               const std::vector<SampleParams> &params,
+                               const std::vector<SampleKey> &keys,
+                               ThreadPool *pool = nullptr);
   void set_seed(int seed);
 private:
+  // scratch buffers reused across calls
+  struct Scratch {
+    std::vector<float> masked_logits;
+    std::vector<float> probs;
+    std::vector<float> temp_probs;
+    std::vector<int> index;
+    std::vector<int> bucket_begin;
+    // the write positions of the counting sort
+    std::vector<int> bucket_cursor;
+    std::vector<float> bucket_mass;
+  };
+  // the logits with -inf for the tokens not in `allowed_mask`, in the scratch
+  const float *MaskLogits(const Tensor &logits, const uint64_t *allowed_mask);
+  // `uniform()` returns a uniform double in [0, 1], it is called once unless
+  // the sampling is greedy
+  template <typename Uniform>
+  static int SampleRow(const float *data, size_t size, float temperature,
+                       int top_k, float top_p, Uniform &&uniform,
+                       Scratch &scratch);
+  // `make_uniform(i)` makes the uniform source of row i
+  template <typename MakeUniform>
+  std::vector<int> SampleRows(const Tensor &logits,
+                              const std::vector<SampleParams> &params,
+                              ThreadPool *pool, MakeUniform &&make_uniform);
   std::minstd_rand0 _generator;
+  Scratch _scratch;
+  // one per parallel chunk of SampleBatch
+  std::vector<Scratch> _batch_scratch;
 };
 
 } // namespace rwkv
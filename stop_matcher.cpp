@@ -0,0 +1,98 @@
+#include "stop_matcher.h"
+
+#include <check.h>
+
+namespace rwkv {
+
+StopMatcher::StopMatcher(const std::vector<std::string> &stop_strings) {
+  // the trie of the stop strings, -1 for a missing child
+  Node root;
+  root.next.fill(-1);
+  _nodes.push_back(root);
+  for (size_t i = 0; i < stop_strings.size(); i++) {
+    const auto &str = stop_strings[i];
+    RV_CHECK(!str.empty()) << "empty stop string";
+    int32_t node = 0;
+    for (char c : str) {
+      const uint8_t byte = c;
+      if (_nodes[node].next[byte] == -1) {
+        Node child;
+        child.next.fill(-1);
+        child.depth = _nodes[node].depth + 1;
+        _nodes[node].next[byte] = _nodes.size();
+        _nodes.push_back(child);
+      }
+      node = _nodes[node].next[byte];
+    }
+    if (_nodes[node].stop_index == -1) {
+      _nodes[node].stop_index = i;
+    }
+    _stop_lengths.push_back(str.size());
+  }
+
+  // BFS, turning the trie into a DFA: a missing child goes where the
+  // failure link (the longest proper suffix in the trie) goes
+  std::vector<int32_t> fail(_nodes.size(), 0);
+  std::vector<int32_t> queue;
+  for (auto &child : _nodes[0].next) {
+    if (child == -1) {
+      child = 0;
+    } else {
+      queue.push_back(child);
+    }
+  }
+  for (size_t q = 0; q < queue.size(); q++) {
+    const int32_t node = queue[q];
+    // without a stop string of its own, the longest one ending here is the
+    // one of the failure node
+    if (_nodes[node].stop_index == -1) {
+      _nodes[node].stop_index = _nodes[fail[node]].stop_index;
+    }
+    for (int byte = 0; byte < 256; byte++) {
+      int32_t &child = _nodes[node].next[byte];
+      if (child == -1) {
+        child = _nodes[fail[node]].next[byte];
+      } else {
+        fail[child] = _nodes[fail[node]].next[byte];
+        queue.push_back(child);
+      }
+    }
+  }
+}
+
+StopMatcher::Result StopMatcher::Put(std::string_view bytes) {
+  if (stopped()) {
+    return {std::string_view(), _stop_index};
+  }
+  _buffer.erase(0, _num_emitted);
+  const size_t scan_begin = _buffer.size();
+  _buffer += bytes;
+  for (size_t i = scan_begin; i < _buffer.size(); i++) {
+    _state = _nodes[_state].next[static_cast<uint8_t>(_buffer[i])];
+    const int stop_index = _nodes[_state].stop_index;
+    if (stop_index != -1) {
+      _stop_index = stop_index;
+      const size_t stop_begin = i + 1 - _stop_lengths[stop_index];
+      _num_emitted = _buffer.size();
+      return {std::string_view(_buffer.data(), stop_begin), stop_index};
+    }
+  }
+  // the last `depth` bytes are a prefix of a stop string
+  _num_emitted = _buffer.size() - _nodes[_state].depth;
+  return {std::string_view(_buffer.data(), _num_emitted), -1};
+}
+
+std::string StopMatcher::Flush() {
+  std::string rest = stopped() ? "" : _buffer.substr(_num_emitted);
+  Reset();
+  return rest;
+}
+
+void StopMatcher::Reset() {
+  _state = 0;
+  _stop_index = -1;
+  _buffer.clear();
+  _num_emitted = 0;
+}
+
+} // namespace rwkv
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace rwkv {
+
+// Detects stop strings in generated text as it streams out, e.g. of a
+// StreamDecoder. The stop strings are compiled into an Aho-Corasick
+// automaton with a full byte transition table, so Put costs O(new bytes)
+// however many stop strings there are.
+//
+// Bytes which may be the beginning of a stop string are held back until the
+// stream shows they are not, so a streaming client never prints part of a
+// stop string.
+class StopMatcher {
+public:
+  explicit StopMatcher(const std::vector<std::string> &stop_strings);
+
+  struct Result {
+    // the text which is safe to emit, valid until the next call
+    std::string_view text;
+    // the index of the stop string which was completed (`text` then ends
+    // right before it), or -1
+    int stop_index;
+    bool stopped() const { return stop_index != -1; }
+  };
+  // Feed the next bytes of output. After a stop, everything is ignored until
+  // Reset.
+  Result Put(std::string_view bytes);
+  // the held back bytes, when the stream ends without a stop. Resets the
+  // matcher.
+  std::string Flush();
+  void Reset();
+  bool stopped() const { return _stop_index != -1; }
+
+private:
+  struct Node {
+    std::array<int32_t, 256> next;
+    int32_t depth = 0;
+    // the longest stop string which is a suffix of this node, or -1
+    int32_t stop_index = -1;
+  };
+  std::vector<Node> _nodes;
+  std::vector<size_t> _stop_lengths;
+  int32_t _state = 0;
+  int _stop_index = -1;
+  // _buffer[0, _num_emitted) is the text of the last Put, the rest is held
+  // back
+  std::string _buffer;
+  size_t _num_emitted = 0;
+};
+
+} // namespace rwkv
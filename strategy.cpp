@@ -0,0 +1,85 @@
+#include "strategy.h"
+
+#include <sstream>
+
+#include <check.h>
+
+namespace rwkv {
+
+namespace {
+int ParseInt(const std::string &key, const std::string &value) {
+  size_t pos = 0;
+  int result = -1;
+  try {
+    result = std::stoi(value, &pos);
+  } catch (const std::exception &) {
+  }
+  RV_CHECK(pos == value.size() && result >= 0)
+      << "the value of option \"" << key
+      << "\" should be a non-negative integer, got \"" << value << "\"";
+  return result;
+}
+
+bool ParseBool(const std::string &key, const std::string &value) {
+  RV_CHECK(value == "0" || value == "1")
+      << "the value of option \"" << key << "\" should be 0 or 1";
+  return value == "1";
+}
+
+// "0-3,6" -> {0, 1, 2, 3, 6}
+std::vector<int> ParseCpus(const std::string &value) {
+  std::vector<int> cpus;
+  std::istringstream ss(value);
+  for (std::string range; std::getline(ss, range, ',');) {
+    const auto dash = range.find('-');
+    const int begin = ParseInt("cpus", range.substr(0, dash));
+    const int end = dash == std::string::npos
+                        ? begin
+                        : ParseInt("cpus", range.substr(dash + 1));
+    RV_CHECK(begin <= end) << "invalid cpu range \"" << range << "\"";
+    for (int i = begin; i <= end; i++) {
+      cpus.push_back(i);
+    }
+  }
+  RV_CHECK(!cpus.empty()) << "the value of option \"cpus\" is empty";
+  return cpus;
+}
+} // namespace
+
+StrategyOptions StrategyOptions::Parse(const std::string &strategy) {
+  StrategyOptions options;
+  std::istringstream ss(strategy);
+  std::string word;
+  // skip the device and the dtype
+  ss >> word >> word;
+  while (ss >> word) {
+    const auto pos = word.find('=');
+    RV_CHECK(pos != std::string::npos)
+        << "invalid option \"" << word << "\" in strategy \"" << strategy
+        << "\"";
+    const auto key = word.substr(0, pos);
+    const auto value = word.substr(pos + 1);
+    if (key == "threads") {
+      options.threads = ParseInt(key, value);
+    } else if (key == "cpus") {
+      options.cpus = ParseCpus(value);
+    } else if (key == "numa") {
+      options.numa = ParseBool(key, value);
+    } else if (key == "arena") {
+      options.arena = ParseBool(key, value);
+    } else if (key == "vulkan") {
+      options.vulkan = ParseBool(key, value);
+    } else if (key == "plan") {
+      // the native backends have no matmul kernels for mixed dtypes
+      RV_UNIMPLEMENTED() << "quantization plans are only supported by "
+                            "export_ncnn, pass the plan to it instead";
+    } else {
+      options.backend_options[key] = value;
+    }
+  }
+  RV_CHECK(!options.numa || !options.cpus.empty())
+      << "option \"numa\" needs \"cpus\"";
+  return options;
+}
+
+} // namespace rwkv
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace rwkv {
+
+// The key=value options after the dtype in a strategy, e.g.
+// "ncnn fp16 threads=4 cpus=4-7 vulkan=0". They are parsed once by Model and
+// passed to the `init_model` of the backend, so that models in one process
+// can be configured (and partitioned over the cores) independently. A backend
+// uses the options it supports and ignores the others.
+struct StrategyOptions {
+  // the number of threads, 0 means the default of the backend (FR_THREADS on
+  // ncnn)
+  int threads = 0;
+  // the cpus the threads run on, e.g. "0-3,6", empty means not bound
+  std::vector<int> cpus;
+  // Load the weights on `cpus`, so that the first-touch policy of the OS
+  // allocates them on the NUMA node of `cpus`. Needs `cpus`.
+  bool numa = false;
+  // allocate the activations of the runs from a per-model memory arena
+  bool arena = true;
+  // FR_VULKAN decides if it is not set
+  std::optional<bool> vulkan;
+  // the other options, to be validated by the backend, e.g. ncnn's "bf16"
+  std::map<std::string, std::string> backend_options;
+
+  // `strategy` is the whole strategy string, the first two words (the device
+  // and the dtype) are skipped
+  static StrategyOptions Parse(const std::string &strategy);
+};
+
+} // namespace rwkv
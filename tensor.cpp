@@ -72,6 +72,11 @@ Tensor Copy(const Tensor &x, Device device, bool always_copy) {
                cudaMemcpyHostToDevice);
     return y;
   }
+  if (device == Device::kCUDA && x.device() == Device::kCUDA) {
+    cudaMemcpy(y.data_ptr(), x.data_ptr(), x.numel() * x.elem_size(),
+               cudaMemcpyDeviceToDevice);
+    return y;
+  }
 #endif
 
 #ifdef FR_ENABLE_ONNX
@@ -115,7 +120,13 @@ Tensor Tensor::Empty(const Shape &shape, DType dtype, Device device) {
 
 Tensor Tensor::FromPtr(void *dptr, const Shape &shape, DType dtype,
                        Device device) {
-  auto storage = std::make_shared<TensorStorage>(dptr, device);
+  return FromPtr(dptr, shape, dtype, device, nullptr);
+}
+
+Tensor Tensor::FromPtr(void *dptr, const Shape &shape, DType dtype,
+                       Device device, std::shared_ptr<void> owner) {
+  auto storage =
+      std::make_shared<TensorStorage>(dptr, device, std::move(owner));
   Tensor tensor;
   tensor._storage = storage;
   tensor._shape = shape;
@@ -227,10 +238,15 @@ TensorStorage::TensorStorage(size_t nbytes, Device device) {
   _is_view = false;
 }
 
-TensorStorage::TensorStorage(void *external_ptr, Device device) {
+TensorStorage::TensorStorage(void *external_ptr, Device device)
+    : TensorStorage(external_ptr, device, nullptr) {}
+
+TensorStorage::TensorStorage(void *external_ptr, Device device,
+                             std::shared_ptr<void> owner) {
   _data = external_ptr;
   _device = device;
   _is_view = true;
+  _owner = std::move(owner);
 }
 
 TensorStorage::~TensorStorage() {
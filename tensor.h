@@ -60,6 +60,7 @@ template <> inline const DType dtype_v<float16> = DType::kFloat16;
 template <> inline const DType dtype_v<half> = DType::kFloat16;
 #endif
 template <> inline const DType dtype_v<uint8_t> = DType::kInt8;
+template <> inline const DType dtype_v<int32_t> = DType::kInt32;
 
 using LengthType = int64_t;
 using Shape = std::vector<LengthType>;
@@ -130,6 +131,8 @@ class TensorStorage {
 public:
   TensorStorage(size_t nbytes, Device device);
   TensorStorage(void *external_ptr, Device device);
+  // a view which keeps `owner` (e.g. a buffer of another library) alive
+  TensorStorage(void *external_ptr, Device device, std::shared_ptr<void> owner);
   ~TensorStorage();
   void *data_ptr() const { return _data; }
   Device device() const { return _device; }
@@ -140,6 +143,7 @@ private:
   size_t _nbytes;
   bool _is_view = false;
   Device _device;
+  std::shared_ptr<void> _owner;
 };
 
 // prefer to pass Tensor by reference, but even if we pass by value, it's
@@ -232,6 +236,10 @@ public:
   static Tensor Empty(const Shape &shape, DType dtype, Device device);
   static Tensor FromPtr(void *ptr, const Shape &shape, DType dtype,
                         Device device);
+  // The tensor shares the memory of `ptr` and keeps `owner` alive as long as
+  // it (or any tensor sharing its storage) is alive.
+  static Tensor FromPtr(void *ptr, const Shape &shape, DType dtype,
+                        Device device, std::shared_ptr<void> owner);
   static Tensor FromMsgPack(const msgpack::object &obj);
   static Tensor FromOther(const Tensor &other, const Shape &shape);
 
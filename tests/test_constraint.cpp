@@ -0,0 +1,134 @@
+#include <string>
+#include <vector>
+
+#include <constraint.h>
+#include <sampler.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+namespace {
+// id 0 is eos
+const std::vector<std::string> kVocab{"",   "a",  "b",  "ab", "ba", "1",
+                                      "12", "x1", "{",  "}",  "\"", "é"};
+
+bool Allowed(const uint64_t *mask, int id) { return (mask[id / 64] >> (id % 64)) & 1; }
+
+std::vector<int> AllowedIds(RegexConstraint &constraint) {
+  std::vector<int> ids;
+  const uint64_t *mask = constraint.AllowedMask();
+  for (int i = 0; i < kVocab.size(); i++) {
+    if (Allowed(mask, i)) {
+      ids.push_back(i);
+    }
+  }
+  return ids;
+}
+} // namespace
+
+TEST(RegexConstraint, masks) {
+  auto automaton =
+      std::make_shared<RegexAutomaton>("(ab)+1?", kVocab, /*eos_token_id=*/0);
+  RegexConstraint constraint(automaton);
+  // "a" and "ab"
+  EXPECT_EQ(AllowedIds(constraint), (std::vector<int>{1, 3}));
+  constraint.Accept(1);
+  // "b", and "ba" which continues with the next "ab"
+  EXPECT_EQ(AllowedIds(constraint), (std::vector<int>{2, 4}));
+  constraint.Accept(2);
+  EXPECT_TRUE(constraint.IsComplete());
+  // eos, "a", "ab" and "1"
+  EXPECT_EQ(AllowedIds(constraint), (std::vector<int>{0, 1, 3, 5}));
+  constraint.Accept(5);
+  EXPECT_EQ(AllowedIds(constraint), (std::vector<int>{0}));
+  EXPECT_THROW(constraint.Accept(1), FRException);
+
+  constraint.Reset();
+  EXPECT_FALSE(constraint.IsComplete());
+  EXPECT_EQ(AllowedIds(constraint), (std::vector<int>{1, 3}));
+}
+
+TEST(RegexConstraint, syntax) {
+  auto allowed_at_start = [](const std::string &pattern) {
+    RegexConstraint constraint(
+        std::make_shared<RegexAutomaton>(pattern, kVocab, 0));
+    return AllowedIds(constraint);
+  };
+  EXPECT_EQ(allowed_at_start("\\d{2}"), (std::vector<int>{5, 6}));
+  EXPECT_EQ(allowed_at_start("[a-b]{0,1}"), (std::vector<int>{0, 1, 2}));
+  EXPECT_EQ(allowed_at_start("\\{\"[^\"]*\"\\}"), (std::vector<int>{8}));
+  EXPECT_EQ(allowed_at_start("[é]"), (std::vector<int>{11}));
+  // "." is one code point, "é" is two bytes
+  EXPECT_EQ(allowed_at_start("."),
+            (std::vector<int>{1, 2, 5, 8, 9, 10, 11}));
+  EXPECT_EQ(allowed_at_start("(?:x|b)\\w*"),
+            (std::vector<int>{2, 4, 7}));
+  EXPECT_THROW(RegexAutomaton("(a", kVocab, 0), FRException);
+  EXPECT_THROW(RegexAutomaton("*a", kVocab, 0), FRException);
+}
+
+TEST(RegexConstraint, sample) {
+  auto automaton = std::make_shared<RegexAutomaton>("b+", kVocab, 0);
+  RegexConstraint constraint(automaton);
+  auto logits = Tensor::Empty({static_cast<long>(kVocab.size())},
+                              DType::kFloat32, Device::kCPU);
+  for (int i = 0; i < kVocab.size(); i++) {
+    logits.data_ptr<float>()[i] = i == 1 ? 10.f : 0.f;
+  }
+  Sampler sampler;
+  sampler.set_seed(0);
+  for (int i = 0; i < 20; i++) {
+    const int id =
+        sampler.Sample(logits, 1.f, 0, 1.f, constraint.AllowedMask());
+    constraint.Accept(id);
+    if (id == 0) {
+      break;
+    }
+    EXPECT_EQ(id, 2);
+  }
+}
+
+TEST(RegexConstraint, keyed_sample) {
+  auto automaton = std::make_shared<RegexAutomaton>("[ab]+", kVocab, 0);
+  auto logits = Tensor::Empty({static_cast<long>(kVocab.size())},
+                              DType::kFloat32, Device::kCPU);
+  for (int i = 0; i < kVocab.size(); i++) {
+    logits.data_ptr<float>()[i] = 0.f;
+  }
+  // the same keys give the same output, whatever the sampler state
+  auto generate = [&](int seed) {
+    RegexConstraint constraint(automaton);
+    Sampler sampler;
+    sampler.set_seed(seed);
+    std::vector<int> ids;
+    for (uint64_t step = 0; step < 10; step++) {
+      const int id = sampler.Sample(logits, 1.f, 0, 1.f,
+                                    constraint.AllowedMask(), {3, 0, step});
+      constraint.Accept(id);
+      ids.push_back(id);
+      if (id == 0) {
+        break;
+      }
+    }
+    return ids;
+  };
+  EXPECT_EQ(generate(1), generate(2));
+}
+
+TEST(RegexConstraint, no_allowed_token) {
+  // no token starts with "c"
+  RegexAutomaton automaton("c", kVocab, 0);
+  EXPECT_THROW(automaton.AllowedMask(RegexAutomaton::kStartState),
+               FRException);
+  // complete, and nothing can follow without an eos token
+  RegexConstraint constraint(std::make_shared<RegexAutomaton>("a", kVocab, -1));
+  constraint.Accept(1);
+  EXPECT_THROW(constraint.AllowedMask(), FRException);
+
+  auto logits = Tensor::Empty({static_cast<long>(kVocab.size())},
+                              DType::kFloat32, Device::kCPU);
+  const uint64_t no_tokens = 0;
+  Sampler sampler;
+  EXPECT_THROW(sampler.Sample(logits, 1.f, 0, 1.f, &no_tokens), FRException);
+}
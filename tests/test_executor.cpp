@@ -0,0 +1,40 @@
+#include <cstdlib>
+
+#include <executor.h>
+#include <model.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(FRCancelled, keeps_type_and_message) {
+  try {
+    throw FRCancelled() << "the run is " << "cancelled";
+  } catch (const FRCancelled &e) {
+    EXPECT_STREQ(e.what(), "the run is cancelled");
+    return;
+  } catch (...) {
+  }
+  FAIL() << "FRCancelled is sliced";
+}
+
+TEST(Executor, cancelled_run) {
+  const char *model_dir = std::getenv("FR_MODEL_DIR");
+  if (model_dir == nullptr) {
+    GTEST_SKIP() << "FR_MODEL_DIR is not set";
+  }
+  Model model(std::string(model_dir) +
+                  "/RWKV-4-World-0.1B-v1-20230520-ctx4096-fp32.fr",
+              "cpu fp32");
+  Executor executor(model);
+  Session session(model);
+  CancellationToken token;
+  token.Cancel();
+  auto future = executor.RunAsync(session, {0}, token);
+  EXPECT_THROW(future.get(), FRCancelled);
+
+  Sampler sampler;
+  auto generate_future = executor.GenerateAsync(
+      session, {0}, 4, sampler, 1.f, 1, 1.f, nullptr, token);
+  EXPECT_THROW(generate_future.get(), FRCancelled);
+}
@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <kernels/export-ncnn/quantize.h>
+#include <tensor.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+using namespace rwkv::ncnnmeta;
+
+namespace {
+Tensor MakeWeight(const std::vector<float> &data, int K, int N) {
+  Tensor weight = Tensor::Empty({K, N}, DType::kFloat32, Device::kCPU);
+  std::copy(data.begin(), data.end(), weight.data_ptr<float>());
+  return weight;
+}
+
+// the nf4 code of row `r` and column `c` of a (64, N) weight, unpacking the
+// (64, 8) blocks of GemvA32W4
+int Int4Code(const Int4Weight &weight, int r, int c) {
+  const int e = r * 8 + c % 8;
+  const int sub = e % 32;
+  const uint8_t byte =
+      weight.codes.data_ptr<uint8_t>()[c / 8 * 256 + e / 32 * 16 + sub % 16];
+  return sub < 16 ? byte & 0xf : byte >> 4;
+}
+
+// a normally distributed (K, N) weight with a few outliers, and the
+// statistics of its input channels
+std::pair<std::vector<float>, std::vector<float>> RandomWeight(int K, int N,
+                                                               int seed) {
+  std::mt19937 gen(seed);
+  std::normal_distribution<float> normal;
+  std::uniform_real_distribution<float> uniform(0.f, 4.f);
+  std::vector<float> data(K * N);
+  for (auto &x : data) {
+    x = normal(gen);
+  }
+  for (int i = 0; i < K * N; i += 61) {
+    data[i] *= 8;
+  }
+  std::vector<float> act(K);
+  for (auto &x : act) {
+    x = uniform(gen);
+  }
+  return {data, act};
+}
+
+bool BytesEqual(const Tensor &a, const Tensor &b) {
+  return a.shape() == b.shape() && a.dtype() == b.dtype() &&
+         std::memcmp(a.data_ptr(), b.data_ptr(),
+                     a.numel() * elem_size(a.dtype())) == 0;
+}
+} // namespace
+
+TEST(ExportNcnn, quantize_int4) {
+  constexpr int K = 64;
+  constexpr int N = 16;
+  // the values and the bounds of nf4, the codes of the bounds are the codes
+  // of the values below them
+  std::vector<float> probes;
+  std::vector<int> probe_codes;
+  for (int i = 0; i < 16; i++) {
+    probes.push_back(kNf4Values[i]);
+    probe_codes.push_back(i);
+    if (i < 15) {
+      probes.push_back(kNf4Bounds[i]);
+      probe_codes.push_back(i);
+    }
+  }
+  const float kScales[3] = {2.f, 1.f, 0.5f};
+  const int kQuantizedScales[3] = {127, 64, 32};
+
+  std::vector<float> data(K * N);
+  std::vector<int> expected_codes(K * N);
+  std::vector<int> expected_scales(K * N / 8);
+  int probe = 0;
+  for (int c = 0; c < N; c++) {
+    for (int g = 0; g < 8; g++) {
+      const int s = (g + c) % 3;
+      expected_scales[c * 8 + g] = kQuantizedScales[s];
+      // the first row makes the scale of the group exact
+      data[g * 8 * N + c] = (g + c) % 2 == 0 ? kScales[s] : -kScales[s];
+      expected_codes[g * 8 * N + c] = (g + c) % 2 == 0 ? 15 : 0;
+      for (int r = g * 8 + 1; r < g * 8 + 8; r++) {
+        data[r * N + c] = kScales[s] * probes[probe];
+        expected_codes[r * N + c] = probe_codes[probe];
+        probe = (probe + 1) % probes.size();
+      }
+    }
+  }
+  // constant groups have a scale of 1
+  for (int r = 16; r < 24; r++) {
+    data[r * N + 3] = 0.3f;
+    expected_codes[r * N + 3] = 11;
+    data[r * N + 12] = 0.f;
+    expected_codes[r * N + 12] = 7;
+  }
+  expected_scales[3 * 8 + 2] = 64;
+  expected_scales[12 * 8 + 2] = 64;
+
+  const auto weight = quantize_int4(MakeWeight(data, K, N), nullptr);
+  ASSERT_EQ(weight.codes.shape(), Shape({K / 2, N}));
+  for (int r = 0; r < K; r++) {
+    for (int c = 0; c < N; c++) {
+      EXPECT_EQ(Int4Code(weight, r, c), expected_codes[r * N + c])
+          << "r = " << r << ", c = " << c;
+    }
+  }
+  // the scales of the two (64, 8) blocks are interleaved by groups:
+  // (block, group, column in block)
+  ASSERT_EQ(weight.scales.numel(), K * N / 8);
+  const int8_t *scales = static_cast<const int8_t *>(weight.scales.data_ptr());
+  for (int blk = 0; blk < 2; blk++) {
+    for (int g = 0; g < 8; g++) {
+      for (int j = 0; j < 8; j++) {
+        const int c = blk * 8 + j;
+        EXPECT_EQ(scales[(blk * 8 + g) * 8 + j], expected_scales[c * 8 + g])
+            << "c = " << c << ", g = " << g;
+      }
+    }
+  }
+  // every column has a scale of 2
+  ASSERT_EQ(weight.dq_scales.numel(), 8);
+  for (int j = 0; j < 8; j++) {
+    EXPECT_EQ(weight.dq_scales.data_ptr<float16>()[j],
+              float16(2.f / 127.f) / float16(127.f));
+  }
+}
+
+TEST(ExportNcnn, quantize_int8) {
+  constexpr int K = 64;
+  constexpr int N = 4;
+  std::vector<float> data(K * N);
+  std::vector<int> expected_codes(K * N);
+  for (int r = 0; r < K; r++) {
+    const int q = r == 0 ? 0 : r == 1 ? 255 : r * 37 % 256;
+    // min -32, scale 0.25
+    data[r * N + 0] = -32.f + 0.25f * q;
+    expected_codes[r * N + 0] = q;
+    // min -1, scale 1/128
+    data[r * N + 1] = -1.f + q / 128.f;
+    expected_codes[r * N + 1] = q;
+    // halves round up
+    data[r * N + 2] = -32.f + 0.25f * (q + (r == 5 ? 0.5f : 0.f));
+    expected_codes[r * N + 2] = q + (r == 5);
+    // constant
+    data[r * N + 3] = 0.7f;
+    expected_codes[r * N + 3] = 0;
+  }
+
+  const auto weight = quantize_int8(MakeWeight(data, K, N), nullptr);
+  ASSERT_EQ(weight.codes.shape(), Shape({K, N}));
+  const uint8_t *codes = weight.codes.data_ptr<uint8_t>();
+  for (int i = 0; i < K * N; i++) {
+    EXPECT_EQ(codes[i], expected_codes[i]) << "i = " << i;
+  }
+  const std::vector<float> expected_scales{0.25f, 1.f / 128.f, 0.25f, 1.f};
+  const std::vector<float> expected_zero_points{-32.f, -1.f, -32.f, 0.7f};
+  for (int j = 0; j < N; j++) {
+    EXPECT_EQ(weight.scales.data_ptr<float>()[j], expected_scales[j]);
+    EXPECT_EQ(weight.zero_points.data_ptr<float>()[j], expected_zero_points[j]);
+  }
+}
+
+TEST(ExportNcnn, clip_nf4_scales) {
+  constexpr int kRows = 8;
+  constexpr int kCols = 8;
+  const auto [data, act] = RandomWeight(kRows * 16, kCols, 0);
+  // the weighted error of every column of a group with `scales`
+  const auto error = [&](const float *group_data, const float *group_act,
+                         const float *scales) {
+    std::array<float, kCols> result{};
+    for (int r = 0; r < kRows; r++) {
+      for (int j = 0; j < kCols; j++) {
+        const float w = group_data[r * kCols + j];
+        const float x = std::clamp(w / scales[j], -1.f, 1.f);
+        uint8_t code;
+        quantize_nf4(&x, 1, &code);
+        const float diff = w - kNf4Values[code] * scales[j];
+        result[j] += group_act[r] * diff * diff;
+      }
+    }
+    return result;
+  };
+  for (int g = 0; g < 16; g++) {
+    const float *group_data = data.data() + g * kRows * kCols;
+    const float *group_act = act.data() + g * kRows;
+    std::array<float, kCols> absmax{};
+    for (int i = 0; i < kRows * kCols; i++) {
+      absmax[i % kCols] = std::max(absmax[i % kCols], std::abs(group_data[i]));
+    }
+    auto clipped = absmax;
+    clip_nf4_scales<kRows, kCols>(group_data, group_act, clipped.data());
+    const auto clipped_error = error(group_data, group_act, clipped.data());
+    const auto absmax_error = error(group_data, group_act, absmax.data());
+    for (int j = 0; j < kCols; j++) {
+      EXPECT_LE(clipped[j], absmax[j]);
+      EXPECT_LE(clipped_error[j], absmax_error[j]) << "g = " << g;
+    }
+
+    // without activations every scale is equally good
+    const std::vector<float> zeros(kRows, 0.f);
+    auto unchanged = absmax;
+    clip_nf4_scales<kRows, kCols>(group_data, zeros.data(), unchanged.data());
+    EXPECT_EQ(unchanged, absmax);
+  }
+}
+
+TEST(ExportNcnn, clip_int8_ranges) {
+  constexpr int kRows = 64;
+  constexpr int kCols = 4;
+  const auto [data, act] = RandomWeight(kRows * 4, kCols, 1);
+  // the weighted error of every column of a block with [min, max]
+  const auto error = [&](const float *block_data, const float *block_act,
+                         const float *min, const float *max) {
+    std::array<float, kCols> result{};
+    for (int r = 0; r < kRows; r++) {
+      for (int j = 0; j < kCols; j++) {
+        const float w = block_data[r * kCols + j];
+        const float scale = (max[j] - min[j]) / 255.f;
+        const float q =
+            std::round((std::clamp(w, min[j], max[j]) - min[j]) / scale);
+        const float diff = w - (q * scale + min[j]);
+        result[j] += block_act[r] * diff * diff;
+      }
+    }
+    return result;
+  };
+  for (int b = 0; b < 4; b++) {
+    const float *block_data = data.data() + b * kRows * kCols;
+    const float *block_act = act.data() + b * kRows;
+    std::array<float, kCols> min;
+    std::array<float, kCols> max;
+    std::copy_n(block_data, kCols, min.begin());
+    std::copy_n(block_data, kCols, max.begin());
+    for (int i = 0; i < kRows * kCols; i++) {
+      min[i % kCols] = std::min(min[i % kCols], block_data[i]);
+      max[i % kCols] = std::max(max[i % kCols], block_data[i]);
+    }
+    auto clipped_min = min;
+    auto clipped_max = max;
+    clip_int8_ranges<kRows, kCols>(block_data, block_act, clipped_min.data(),
+                                   clipped_max.data());
+    const auto clipped_error =
+        error(block_data, block_act, clipped_min.data(), clipped_max.data());
+    const auto full_error =
+        error(block_data, block_act, min.data(), max.data());
+    for (int j = 0; j < kCols; j++) {
+      EXPECT_GE(clipped_min[j], min[j]);
+      EXPECT_LE(clipped_max[j], max[j]);
+      EXPECT_LE(clipped_error[j], full_error[j]) << "b = " << b;
+    }
+
+    const std::vector<float> zeros(kRows, 0.f);
+    auto unchanged_min = min;
+    auto unchanged_max = max;
+    clip_int8_ranges<kRows, kCols>(block_data, zeros.data(),
+                                   unchanged_min.data(), unchanged_max.data());
+    EXPECT_EQ(unchanged_min, min);
+    EXPECT_EQ(unchanged_max, max);
+  }
+}
+
+TEST(ExportNcnn, zero_act_stats) {
+  constexpr int K = 128;
+  constexpr int N = 16;
+  const auto [data, act] = RandomWeight(K, N, 2);
+  const Tensor weight = MakeWeight(data, K, N);
+  const std::vector<float> zeros(K, 0.f);
+
+  const auto int4 = quantize_int4(weight, nullptr);
+  const auto int4_zeros = quantize_int4(weight, zeros.data());
+  EXPECT_TRUE(BytesEqual(int4.codes, int4_zeros.codes));
+  EXPECT_TRUE(BytesEqual(int4.scales, int4_zeros.scales));
+  EXPECT_TRUE(BytesEqual(int4.dq_scales, int4_zeros.dq_scales));
+  // and the statistics change something
+  EXPECT_FALSE(
+      BytesEqual(int4.scales, quantize_int4(weight, act.data()).scales));
+
+  const auto int8 = quantize_int8(weight, nullptr);
+  const auto int8_zeros = quantize_int8(weight, zeros.data());
+  EXPECT_TRUE(BytesEqual(int8.codes, int8_zeros.codes));
+  EXPECT_TRUE(BytesEqual(int8.scales, int8_zeros.scales));
+  EXPECT_TRUE(BytesEqual(int8.zero_points, int8_zeros.zero_points));
+}
@@ -1,5 +1,11 @@
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <optional>
+
 #include <kernels/export-ncnn/kernels.h>
 #include <model.h>
+#include <utils.h>
 
 #include <gtest/gtest.h>
 
@@ -17,6 +23,31 @@ TEST(Model, cuda_fp16) {
   EXPECT_FLOAT_EQ(output_ptr[0], -1.5488281);
   EXPECT_FLOAT_EQ(output_ptr[9], -9.640625);
 }
+
+TEST(Model, cuda_head_slice_and_topk) {
+  const std::string model_dir(std::getenv("FR_MODEL_DIR"));
+  rwkv::Model model(model_dir + "/RWKV-4-World-0.1B-v1-20230520-ctx4096-fp16.fr", "cuda fp16");
+  rwkv::Session full(model);
+  rwkv::Session sliced(model);
+  const std::vector<int> allowed{9, 0, 11, 300};
+  sliced.head_slice = model.MakeHeadSlice(allowed);
+  auto expected = model.Run(full, {0, 9});
+  auto output = model.Run(sliced, {0, 9});
+  ASSERT_EQ(output.numel(), expected.numel());
+  for (int i = 0; i < output.numel(); i++) {
+    if (std::find(allowed.begin(), allowed.end(), i) != allowed.end()) {
+      EXPECT_NEAR(output.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                  1e-2);
+    } else {
+      EXPECT_TRUE(std::isinf(output.data_ptr<float>()[i]));
+    }
+  }
+
+  rwkv::Session greedy(model);
+  auto top_k = model.RunTopK(greedy, {0, 9}, 1);
+  auto *ptr = expected.data_ptr<float>();
+  EXPECT_EQ(top_k.ids[0], std::max_element(ptr, ptr + expected.numel()) - ptr);
+}
 #endif
 
 #ifdef FR_ENABLE_NCNN
@@ -70,6 +101,43 @@ TEST(Model, ncnn_fp16_v5) {
   EXPECT_GT(output_ptr[9], -15.0);
 }
 
+TEST(Model, ncnn_seq_v7) {
+  const std::string model_dir(std::getenv("FR_MODEL_DIR"));
+  const std::string path =
+      model_dir + "/RWKV-x070-World-0.1B-v2.8-20241210-ctx4096-fp32.fr";
+  if (!file_exists(path)) {
+    GTEST_SKIP() << path << " does not exist";
+  }
+  rwkv::ncnnmeta::ExportModel(path, rwkv::DType::kFloat16,
+                              "/tmp/rwkv-7-0.1b-ncnn", /*seq_len=*/4);
+  rwkv::Model seq_model("/tmp/rwkv-7-0.1b-ncnn", "ncnn fp16");
+  // token by token
+  rwkv::Model model("/tmp/rwkv-7-0.1b-ncnn", "ncnn fp16 seq=0");
+  // two chunks of the sequence graph, and then one more token by token
+  const std::vector<int> ids{33, 2450, 11, 4600, 59, 10, 11116, 261, 3319};
+  for (int len : {4, 8, 9}) {
+    seq_model.ResetStates();
+    model.ResetStates();
+    const std::vector<int> prompt(ids.begin(), ids.begin() + len);
+    auto seq_output = seq_model.Run(prompt);
+    auto output = model.Run(prompt);
+    ASSERT_EQ(seq_output.numel(), output.numel());
+    for (int i = 0; i < output.numel(); i++) {
+      EXPECT_NEAR(seq_output.data_ptr<float>()[i], output.data_ptr<float>()[i],
+                  5e-2)
+          << "len " << len << ", token " << i;
+    }
+    // and the states continue the same way
+    seq_output = seq_model.Run(0);
+    output = model.Run(0);
+    for (int i = 0; i < output.numel(); i++) {
+      EXPECT_NEAR(seq_output.data_ptr<float>()[i], output.data_ptr<float>()[i],
+                  5e-2)
+          << "len " << len << ", token " << i;
+    }
+  }
+}
+
 TEST(Model, ncnn_int8) {
   const std::string model_dir(std::getenv("FR_MODEL_DIR"));
   rwkv::ncnnmeta::ExportModel(model_dir + "/RWKV-4-World-0.1B-v1-20230520-ctx4096-fp32.fr", rwkv::DType::kInt8,
@@ -97,6 +165,27 @@ TEST(Model, ncnn_int8) {
   EXPECT_FLOAT_EQ(output_ptr[9], old_output_9);
 }
 
+TEST(Model, ncnn_states_outlive_model) {
+  const std::string model_dir(std::getenv("FR_MODEL_DIR"));
+  rwkv::ncnnmeta::ExportModel(model_dir + "/RWKV-4-World-0.1B-v1-20230520-ctx4096-fp32.fr", rwkv::DType::kFloat16,
+                              "/tmp/rwkv-4-0.1b-ncnn");
+  std::unique_ptr<rwkv::Session> session;
+  std::optional<rwkv::Tensor> output;
+  {
+    rwkv::Model model("/tmp/rwkv-4-0.1b-ncnn", "ncnn fp16");
+    session = std::make_unique<rwkv::Session>(model);
+    output = model.Run(*session, {0});
+  }
+  // the states and the output are allocated from the pool of the model,
+  // which they keep alive
+  const float output_0 = output->data_ptr<float>()[0];
+  EXPECT_LT(output_0, 0);
+  EXPECT_GT(output_0, -0.1);
+  EXPECT_EQ(session->states.size(), 12);
+  session.reset();
+  output.reset();
+}
+
 // TODO: add int4 reference implementation
 // TEST(Model, ncnn_int4) {
 //   const std::string model_dir(std::getenv("FR_MODEL_DIR"));
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+
 #include <kernels/kernels.h>
 #include <tensor.h>
 
@@ -15,3 +18,39 @@ TEST(RWKV, cuda_scalar_div_fp16) {
   EXPECT_EQ(x_ptr[0], 0.5f);
 }
 #endif
+
+TEST(RWKV, cpu_head_topk) {
+  const int n_embd = 8;
+  // not a multiple of the tile size
+  const int n_vocab = 1000;
+  auto x = rwkv::Tensor::Empty({n_embd}, rwkv::DType::kFloat32,
+                               rwkv::Device::kCPU);
+  auto w = rwkv::Tensor::Empty({n_embd, n_vocab}, rwkv::DType::kFloat32,
+                               rwkv::Device::kCPU);
+  for (int i = 0; i < n_embd; i++) {
+    x.data_ptr<float>()[i] = 0.1f * (i + 1);
+  }
+  for (int i = 0; i < n_embd * n_vocab; i++) {
+    w.data_ptr<float>()[i] = ((i * 7919) % 1013) / 1013.f - 0.5f;
+  }
+  std::vector<std::pair<float, int>> expected(n_vocab);
+  double sum_exp = 0;
+  for (int v = 0; v < n_vocab; v++) {
+    float logit = 0;
+    for (int c = 0; c < n_embd; c++) {
+      logit += x.data_ptr<float>()[c] * w.data_ptr<float>()[c * n_vocab + v];
+    }
+    expected[v] = {-logit, v};
+    sum_exp += std::exp(logit);
+  }
+  std::sort(expected.begin(), expected.end());
+
+  const int k = 5;
+  auto [values, ids, log_sum_exp] = rwkv::head_topk(x, w, k);
+  ASSERT_EQ(ids.numel(), k);
+  for (int i = 0; i < k; i++) {
+    EXPECT_EQ(ids.data_ptr<int>()[i], expected[i].second);
+    EXPECT_NEAR(values.data_ptr<float>()[i], -expected[i].first, 1e-5);
+  }
+  EXPECT_NEAR(log_sum_exp, std::log(sum_exp), 1e-4);
+}
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <pipeline.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(SpscQueue, full_and_empty) {
+  SpscQueue<int> queue(2);
+  int x;
+  EXPECT_FALSE(queue.TryPop(x));
+  EXPECT_TRUE(queue.TryPush(1));
+  EXPECT_TRUE(queue.TryPush(2));
+  EXPECT_FALSE(queue.TryPush(3));
+  EXPECT_TRUE(queue.TryPop(x));
+  EXPECT_EQ(x, 1);
+  EXPECT_TRUE(queue.TryPush(3));
+  EXPECT_TRUE(queue.TryPop(x));
+  EXPECT_EQ(x, 2);
+  EXPECT_TRUE(queue.TryPop(x));
+  EXPECT_EQ(x, 3);
+  EXPECT_FALSE(queue.TryPop(x));
+}
+
+TEST(SpscQueue, two_threads) {
+  const int n = 100000;
+  SpscQueue<int> queue(16);
+  std::thread producer([&]() {
+    for (int i = 0; i < n; i++) {
+      while (!queue.TryPush(int(i))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  for (int i = 0; i < n; i++) {
+    int x;
+    while (!queue.TryPop(x)) {
+      std::this_thread::yield();
+    }
+    ASSERT_EQ(x, i);
+  }
+  producer.join();
+}
+
+TEST(SpscQueue, blocking) {
+  const int n = 100000;
+  std::atomic<bool> stop{false};
+  SpscQueue<int> queue(4);
+  std::thread producer([&]() {
+    for (int i = 0; i < n; i++) {
+      ASSERT_TRUE(queue.Push(int(i), stop));
+    }
+  });
+  for (int i = 0; i < n; i++) {
+    int x;
+    ASSERT_TRUE(queue.Pop(x, stop));
+    ASSERT_EQ(x, i);
+  }
+  producer.join();
+}
+
+TEST(SpscQueue, stop) {
+  std::atomic<bool> stop{false};
+  SpscQueue<int> queue(1);
+  std::thread consumer([&]() {
+    int x;
+    EXPECT_FALSE(queue.Pop(x, stop));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  stop.store(true);
+  queue.Wake();
+  consumer.join();
+}
@@ -0,0 +1,36 @@
+#include <prompt_lookup.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(NgramIndex, propose_longest_match) {
+  NgramIndex index(1, 3);
+  // 1 2 3 4 5 | 9 2 3 6 | 1 2 3
+  index.Append({1, 2, 3, 4, 5, 9, 2, 3, 6, 1, 2, 3});
+  // "1 2 3" matches the beginning, the continuation is "4 5 9"
+  EXPECT_EQ(index.Propose(3), std::vector<int>({4, 5, 9}));
+}
+
+TEST(NgramIndex, propose_most_recent) {
+  NgramIndex index(1, 2);
+  index.Append({7, 1, 2, 7, 3, 7});
+  // only "7" matches, the most recent continuation is "3"
+  EXPECT_EQ(index.Propose(2), std::vector<int>({3, 7}));
+}
+
+TEST(NgramIndex, propose_bounded_by_history) {
+  NgramIndex index(1, 3);
+  index.Append({5, 6, 5});
+  EXPECT_EQ(index.Propose(10), std::vector<int>({6, 5}));
+}
+
+TEST(NgramIndex, no_match) {
+  NgramIndex index(2, 3);
+  index.Append({1, 2, 3, 4});
+  EXPECT_TRUE(index.Propose(5).empty());
+  // the suffix never matches itself
+  NgramIndex single(1, 1);
+  single.Append(1);
+  EXPECT_TRUE(single.Propose(5).empty());
+}
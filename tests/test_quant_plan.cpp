@@ -0,0 +1,61 @@
+#include <quant_plan.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(QuantPlan, empty) {
+  const auto plan = QuantPlan::Parse("# nothing here\n\n");
+  EXPECT_TRUE(plan.empty());
+  EXPECT_FALSE(plan.Get("head.weight", 12).has_value());
+}
+
+TEST(QuantPlan, patterns) {
+  const auto plan = QuantPlan::Parse(R"(
+blocks.*.att.output.weight fp16  # sensitive
+head.weight int8
+)");
+  EXPECT_EQ(plan.Get("blocks.0.att.output.weight", 12), DType::kFloat16);
+  EXPECT_EQ(plan.Get("blocks.11.att.output.weight", 12), DType::kFloat16);
+  EXPECT_EQ(plan.Get("head.weight", 12), DType::kInt8);
+  EXPECT_FALSE(plan.Get("blocks.0.att.key.weight", 12).has_value());
+  EXPECT_FALSE(plan.Get("head.weight.x", 12).has_value());
+}
+
+TEST(QuantPlan, layers) {
+  const auto plan = QuantPlan::Parse(R"(
+blocks.{:2}.* int8
+blocks.{-2:}.* fp16
+blocks.{4:6}.ffn.* int4
+)");
+  EXPECT_EQ(plan.Get("blocks.0.att.key.weight", 12), DType::kInt8);
+  EXPECT_EQ(plan.Get("blocks.1.ffn.value.weight", 12), DType::kInt8);
+  EXPECT_FALSE(plan.Get("blocks.2.att.key.weight", 12).has_value());
+  EXPECT_EQ(plan.Get("blocks.5.ffn.key.weight", 12), DType::kInt4);
+  EXPECT_FALSE(plan.Get("blocks.6.ffn.key.weight", 12).has_value());
+  EXPECT_FALSE(plan.Get("blocks.9.att.key.weight", 12).has_value());
+  EXPECT_EQ(plan.Get("blocks.10.att.key.weight", 12), DType::kFloat16);
+  EXPECT_EQ(plan.Get("blocks.11.att.key.weight", 12), DType::kFloat16);
+  // the last layers depend on the model
+  EXPECT_EQ(plan.Get("blocks.9.att.key.weight", 10), DType::kFloat16);
+}
+
+TEST(QuantPlan, last_rule_wins) {
+  const auto plan = QuantPlan::Parse(R"(
+* int4
+blocks.*.att.* int8
+blocks.0.att.key.weight fp16
+)");
+  EXPECT_EQ(plan.Get("head.weight", 12), DType::kInt4);
+  EXPECT_EQ(plan.Get("blocks.3.att.key.weight", 12), DType::kInt8);
+  EXPECT_EQ(plan.Get("blocks.0.att.key.weight", 12), DType::kFloat16);
+}
+
+TEST(QuantPlan, invalid) {
+  EXPECT_THROW(QuantPlan::Parse("head.weight"), std::exception);
+  EXPECT_THROW(QuantPlan::Parse("head.weight int3"), std::exception);
+  EXPECT_THROW(QuantPlan::Parse("head.weight int8 fp16"), std::exception);
+  EXPECT_THROW(QuantPlan::Parse("blocks.{2}.* int8"), std::exception);
+  EXPECT_THROW(QuantPlan::Parse("blocks.{x:}.* int8"), std::exception);
+  EXPECT_THROW(QuantPlan::Parse("blocks.{0:2.* int8"), std::exception);
+}
@@ -1,7 +1,16 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <numeric>
 #include <optional>
+#include <random>
 
 #include <kernels/kernels.h>
+#include <model.h>
+#include <philox.h>
 #include <sampler.h>
+#include <thread_pool.h>
 
 #include <gtest/gtest.h>
 
@@ -167,3 +176,282 @@ TEST(Sampler, seed) {
     EXPECT_FLOAT_EQ(dist[4], 0.02);
   }
 }
+
+TEST(Sampler, batch) {
+  const int batch_size = 16;
+  std::vector<float> logits = {3, -5, 0, 4, -1.};
+  const int n_vocab = logits.size();
+  auto logits_t =
+      Tensor::Empty({batch_size, n_vocab}, DType::kFloat32, Device::kCPU);
+  for (int i = 0; i < batch_size; i++) {
+    for (int j = 0; j < n_vocab; j++) {
+      logits_t.data_ptr<float>()[i * n_vocab + j] = logits[(i + j) % n_vocab];
+    }
+  }
+  std::vector<SampleParams> params(batch_size);
+  for (int i = 0; i < batch_size; i++) {
+    params[i].temperature = 2;
+    // greedy on even rows
+    params[i].top_k = i % 2 == 0 ? 1 : 0;
+  }
+
+  Sampler serial_sampler;
+  serial_sampler.set_seed(8);
+  auto serial_ids = serial_sampler.SampleBatch(logits_t, params);
+
+  ThreadPool pool(4);
+  Sampler parallel_sampler;
+  parallel_sampler.set_seed(8);
+  auto parallel_ids = parallel_sampler.SampleBatch(logits_t, params, &pool);
+
+  EXPECT_EQ(serial_ids, parallel_ids);
+  for (int i = 0; i < batch_size; i += 2) {
+    // the max logit 4 is at column (3 - i) mod n_vocab
+    EXPECT_EQ(serial_ids[i], ((3 - i) % n_vocab + n_vocab) % n_vocab);
+  }
+}
+
+TEST(Sampler, penalty) {
+  // compare with the straightforward map-based bookkeeping
+  const int n_vocab = 16;
+  const float presence = 0.4f, frequency = 0.3f, decay = 0.5f;
+  PenaltyState penalties;
+  std::map<int, float> occurrences;
+  std::minstd_rand0 generator(3);
+  for (int step = 0; step < 200; step++) {
+    std::vector<float> logits(n_vocab, 0.f), expected(n_vocab, 0.f);
+    penalties.Apply(logits.data(), n_vocab, presence, frequency, decay);
+    for (auto &[id, occurrence] : occurrences) {
+      expected[id] -= frequency * occurrence + presence;
+      occurrence *= decay;
+    }
+    for (int i = 0; i < n_vocab; i++) {
+      EXPECT_NEAR(logits[i], expected[i], 1e-5);
+    }
+    // few distinct tokens at first (sparse path), then many (dense path)
+    const int id = generator() % (step < 20 ? 2 : n_vocab);
+    penalties.Accept(id);
+    occurrences[id] += 1;
+  }
+  penalties.Reset();
+  EXPECT_TRUE(penalties.seen_ids().empty());
+  EXPECT_EQ(penalties.occurrence(0), 0.f);
+}
+
+TEST(Sampler, penalty_large_vocab) {
+  // with a real vocab size, few seen tokens take the sparse path, which must
+  // match the dense computation over the whole vocab
+  const int n_vocab = 65536;
+  const float presence = 0.4f, frequency = 0.3f, decay = 0.9f;
+  PenaltyState penalties;
+  std::vector<double> occurrences(n_vocab, 0.);
+  std::minstd_rand0 generator(5);
+  auto accept = [&](int id) {
+    penalties.Accept(id);
+    occurrences[id] += 1;
+  };
+  for (int step = 0; step < 60; step++) {
+    if (step == 40) {
+      // enough distinct tokens, up to the last one, for the dense path
+      for (int id = 0; id < n_vocab; id += 7) {
+        accept(id);
+      }
+      accept(n_vocab - 1);
+    }
+    std::vector<float> logits(n_vocab, 1.f);
+    penalties.Apply(logits.data(), n_vocab, presence, frequency, decay);
+    for (int i = 0; i < n_vocab; i++) {
+      const double expected =
+          1. - (occurrences[i] > 0 ? frequency * occurrences[i] + presence : 0);
+      ASSERT_NEAR(logits[i], expected, 1e-4) << "step " << step << ", id " << i;
+      occurrences[i] *= decay;
+    }
+    // a few distinct tokens spread over the vocab
+    accept(generator() % 50 * 1201);
+  }
+}
+
+TEST(Sampler, topk_candidates) {
+  std::vector<float> logits{0.5, 2.0, -1.0, 3.0, 1.5, 0.0, 2.5, -0.5};
+  const int n_vocab = logits.size();
+  auto logits_t = Tensor::Empty({n_vocab}, DType::kFloat32, Device::kCPU);
+  std::copy(logits.begin(), logits.end(), logits_t.data_ptr<float>());
+
+  const int k = 4;
+  TopK candidates;
+  std::vector<int> order(n_vocab);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return logits[a] > logits[b]; });
+  float sum_exp = 0;
+  for (int i = 0; i < n_vocab; i++) {
+    sum_exp += std::exp(logits[i]);
+  }
+  for (int i = 0; i < k; i++) {
+    candidates.ids.push_back(order[i]);
+    candidates.logits.push_back(logits[order[i]]);
+  }
+  candidates.log_sum_exp = std::log(sum_exp);
+
+  for (float top_p : {1.f, 0.8f}) {
+    Sampler full_sampler, topk_sampler;
+    full_sampler.set_seed(5);
+    topk_sampler.set_seed(5);
+    for (int i = 0; i < 1000; i++) {
+      EXPECT_EQ(topk_sampler.Sample(candidates, 1.5f, top_p),
+                full_sampler.Sample(logits_t, 1.5f, k, top_p));
+    }
+  }
+  // greedy needs no randomness
+  candidates.ids.resize(1);
+  candidates.logits.resize(1);
+  Sampler sampler;
+  EXPECT_EQ(sampler.Sample(candidates, 1.f, 0.f), 3);
+}
+
+TEST(Sampler, philox_known_answers) {
+  // from the Random123 known-answer tests
+  EXPECT_EQ(Philox4x32::Generate({0, 0, 0, 0}, {0, 0}),
+            (Philox4x32::Counter{0x6627e8d5, 0xe169c58d, 0xbc57ac4c,
+                                 0x9b00dbd8}));
+  EXPECT_EQ(Philox4x32::Generate({0xffffffff, 0xffffffff, 0xffffffff,
+                                  0xffffffff},
+                                 {0xffffffff, 0xffffffff}),
+            (Philox4x32::Counter{0x408f276d, 0x41c83b0e, 0xa20bc7c6,
+                                 0x6d5451fd}));
+}
+
+TEST(Sampler, keyed_batch) {
+  const int batch_size = 13;
+  const int n_vocab = 50;
+  auto logits_t =
+      Tensor::Empty({batch_size, n_vocab}, DType::kFloat32, Device::kCPU);
+  for (int i = 0; i < batch_size * n_vocab; i++) {
+    logits_t.data_ptr<float>()[i] = (i * 37 % 11) * 0.3f;
+  }
+  std::vector<SampleParams> params(1);
+  params[0].temperature = 1.5f;
+  std::vector<SampleKey> keys;
+  for (int i = 0; i < batch_size; i++) {
+    keys.push_back({/*seed=*/42, /*stream=*/static_cast<uint64_t>(i),
+                    /*step=*/7});
+  }
+
+  Sampler serial_sampler;
+  auto serial_ids = serial_sampler.SampleBatch(logits_t, params, keys);
+  for (int num_threads : {1, 3, 8}) {
+    ThreadPool pool(num_threads);
+    Sampler sampler;
+    EXPECT_EQ(sampler.SampleBatch(logits_t, params, keys, &pool), serial_ids);
+  }
+  // a row does not depend on the other rows nor on the sampler state
+  Sampler single_sampler;
+  single_sampler.set_seed(123);
+  for (int i = 0; i < batch_size; i++) {
+    auto row = Tensor::Empty({n_vocab}, DType::kFloat32, Device::kCPU);
+    std::copy_n(logits_t.data_ptr<float>() + i * n_vocab, n_vocab,
+                row.data_ptr<float>());
+    EXPECT_EQ(single_sampler.Sample(row, 1.5f, 0, 1.f, keys[i]),
+              serial_ids[i]);
+  }
+}
+
+// Sampler::SampleRow without the buckets: sort all the probabilities, cut
+// them by top-k and top-p, and return the [begin, end) ranges of the
+// cumulative distribution (normalized to [0, 1]) which select every token,
+// empty for the cut tokens.
+std::vector<std::pair<double, double>>
+SortSampleRanges(const std::vector<float> &logits, float temperature,
+                 int top_k, float top_p) {
+  const int size = logits.size();
+  if (top_k == 0 || top_k > size) {
+    top_k = size;
+  }
+  const float max = *std::max_element(logits.begin(), logits.end());
+  std::vector<double> probs(size);
+  for (int i = 0; i < size; i++) {
+    probs[i] = std::exp(static_cast<double>(logits[i]) - max);
+  }
+  const double sum = std::accumulate(probs.begin(), probs.end(), 0.);
+  std::vector<int> order(size);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int a, int b) { return probs[a] > probs[b]; });
+  int len = 0;
+  double cumsum = 0;
+  while (len < top_k) {
+    cumsum += probs[order[len]] / sum;
+    len++;
+    if (cumsum >= top_p) {
+      break;
+    }
+  }
+  std::vector<double> weights(len);
+  for (int j = 0; j < len; j++) {
+    weights[j] =
+        std::exp((static_cast<double>(logits[order[j]]) - max) / temperature);
+  }
+  const double total = std::accumulate(weights.begin(), weights.end(), 0.);
+  std::vector<std::pair<double, double>> ranges(size, {0., 0.});
+  cumsum = 0;
+  for (int j = 0; j < len; j++) {
+    ranges[order[j]] = {cumsum / total, (cumsum + weights[j]) / total};
+    cumsum += weights[j];
+  }
+  return ranges;
+}
+
+TEST(Sampler, large_vocab) {
+  // large enough for the bucket path
+  const int n_vocab = 65536;
+  constexpr float kInf = std::numeric_limits<float>::infinity();
+  std::minstd_rand0 generator(7);
+  std::normal_distribution<float> normal(0.f, 3.f);
+  std::vector<float> logits(n_vocab);
+  for (auto &x : logits) {
+    x = normal(generator);
+  }
+  // masked tokens
+  for (int i = 0; i < n_vocab; i += 3) {
+    logits[i] = -kInf;
+  }
+  auto logits_t = Tensor::Empty({n_vocab}, DType::kFloat32, Device::kCPU);
+  std::copy(logits.begin(), logits.end(), logits_t.data_ptr<float>());
+
+  Sampler sampler;
+  const SampleParams all_params[] = {
+      {1.f, 0, 1.f}, {0.7f, 50, 0.9f}, {1.3f, 0, 0.5f}, {1.f, 1000, 1.f}};
+  for (const auto &p : all_params) {
+    const auto ranges =
+        SortSampleRanges(logits, p.temperature, p.top_k, p.top_p);
+    for (uint64_t step = 0; step < 20; step++) {
+      const SampleKey key{/*seed=*/1, /*stream=*/0, step};
+      const int id =
+          sampler.Sample(logits_t, p.temperature, p.top_k, p.top_p, key);
+      const double uniform =
+          Philox4x32::Uniform(key.seed, key.stream, key.step);
+      // up to the rounding errors of summing many small probabilities in
+      // float in another order
+      const auto [begin, end] = ranges[id];
+      EXPECT_LT(begin, end) << "id = " << id;
+      EXPECT_GE(uniform, begin - 1e-4) << "step = " << step;
+      EXPECT_LE(uniform, end + 1e-4) << "step = " << step;
+    }
+  }
+
+  // the +inf logits take all the probability
+  logits_t.data_ptr<float>()[4242] = kInf;
+  logits_t.data_ptr<float>()[50000] = kInf;
+  EXPECT_EQ(sampler.Sample(logits_t, 1.f, 0, 1.f), 4242);
+  EXPECT_EQ(sampler.Sample(logits_t, 1.f, 1, 1.f), 4242);
+
+  // nothing to sample from
+  const std::vector<uint64_t> no_tokens(n_vocab / 64, 0);
+  EXPECT_THROW(sampler.Sample(logits_t, 1.f, 0, 1.f, no_tokens.data()),
+               std::exception);
+  std::fill_n(logits_t.data_ptr<float>(), n_vocab, -kInf);
+  EXPECT_THROW(sampler.Sample(logits_t, 1.f, 0, 1.f), std::exception);
+  logits_t.data_ptr<float>()[5] = std::nanf("");
+  logits_t.data_ptr<float>()[6] = 1.f;
+  EXPECT_THROW(sampler.Sample(logits_t, 1.f, 0, 1.f), std::exception);
+}
@@ -0,0 +1,49 @@
+#include <stop_matcher.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(StopMatcher, holdback_and_stop) {
+  StopMatcher matcher({"\n\nUser:", "###", "\n\n\n"});
+  auto result = matcher.Put("Hello");
+  EXPECT_EQ(result.text, "Hello");
+  EXPECT_FALSE(result.stopped());
+  // "\n" may begin "\n\nUser:", so it is held back
+  result = matcher.Put(" world\n");
+  EXPECT_EQ(result.text, " world");
+  result = matcher.Put("\nUs");
+  EXPECT_EQ(result.text, "");
+  // the held back bytes turned out not to be a stop string
+  result = matcher.Put("a#");
+  EXPECT_EQ(result.text, "\n\nUsa");
+  result = matcher.Put("#");
+  EXPECT_EQ(result.text, "");
+  result = matcher.Put("#tail");
+  EXPECT_EQ(result.text, "");
+  EXPECT_EQ(result.stop_index, 1);
+  EXPECT_TRUE(matcher.stopped());
+  EXPECT_TRUE(matcher.Put("more").stopped());
+
+  matcher.Reset();
+  // "\n\n\n" is found through the failure link of "\n\nU"
+  result = matcher.Put("a\n\n\n");
+  EXPECT_EQ(result.text, "a");
+  EXPECT_EQ(result.stop_index, 2);
+
+  matcher.Reset();
+  result = matcher.Put("end\n\nUse");
+  EXPECT_EQ(result.text, "end");
+  EXPECT_EQ(matcher.Flush(), "\n\nUse");
+  EXPECT_EQ(matcher.Put("x").text, "x");
+}
+
+TEST(StopMatcher, overlapping_stop_strings) {
+  // "bc" ends before "abcd" does, so it stops first
+  StopMatcher matcher({"abcd", "bc"});
+  auto result = matcher.Put("xab");
+  EXPECT_EQ(result.text, "x");
+  result = matcher.Put("cd");
+  EXPECT_EQ(result.text, "a");
+  EXPECT_EQ(result.stop_index, 1);
+}
@@ -0,0 +1,38 @@
+#include <strategy.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(StrategyOptions, defaults) {
+  const auto options = StrategyOptions::Parse("ncnn fp16");
+  EXPECT_EQ(options.threads, 0);
+  EXPECT_TRUE(options.cpus.empty());
+  EXPECT_FALSE(options.numa);
+  EXPECT_TRUE(options.arena);
+  EXPECT_FALSE(options.vulkan.has_value());
+  EXPECT_TRUE(options.backend_options.empty());
+}
+
+TEST(StrategyOptions, parse) {
+  const auto options = StrategyOptions::Parse(
+      "ncnn int8 threads=4 cpus=0-2,6 numa=1 arena=0 vulkan=0 lightmode=0");
+  EXPECT_EQ(options.threads, 4);
+  EXPECT_EQ(options.cpus, std::vector<int>({0, 1, 2, 6}));
+  EXPECT_TRUE(options.numa);
+  EXPECT_FALSE(options.arena);
+  EXPECT_EQ(options.vulkan, false);
+  EXPECT_EQ(options.backend_options.size(), 1);
+  EXPECT_EQ(options.backend_options.at("lightmode"), "0");
+}
+
+TEST(StrategyOptions, invalid) {
+  EXPECT_THROW(StrategyOptions::Parse("ncnn fp16 threads"), std::exception);
+  EXPECT_THROW(StrategyOptions::Parse("ncnn fp16 threads=x"), std::exception);
+  EXPECT_THROW(StrategyOptions::Parse("ncnn fp16 cpus=3-1"), std::exception);
+  EXPECT_THROW(StrategyOptions::Parse("ncnn fp16 arena=2"), std::exception);
+  // numa needs cpus
+  EXPECT_THROW(StrategyOptions::Parse("ncnn fp16 numa=1"), std::exception);
+  // quantization plans are for export_ncnn
+  EXPECT_THROW(StrategyOptions::Parse("cpu fp32 plan=a.plan"), std::exception);
+}
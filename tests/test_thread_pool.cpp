@@ -0,0 +1,40 @@
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <thread_pool.h>
+
+#include <gtest/gtest.h>
+
+using namespace rwkv;
+
+TEST(ThreadPool, parallel_for) {
+  ThreadPool pool(4);
+  std::vector<int> out(1000, 0);
+  pool.ParallelFor(out.size(), [&](int i) { out[i] = i * 2; });
+  for (int i = 0; i < out.size(); i++) {
+    EXPECT_EQ(out[i], i * 2);
+  }
+}
+
+TEST(ThreadPool, exception) {
+  ThreadPool pool(4);
+  EXPECT_THROW(pool.ParallelFor(100,
+                                [&](int i) {
+                                  if (i == 10) {
+                                    throw std::runtime_error("x");
+                                  }
+                                }),
+               std::runtime_error);
+}
+
+TEST(ThreadPool, nested_parallel_for) {
+  // every worker runs an outer item and waits for its inner ParallelFor,
+  // whose helpers are queued behind the other outer items
+  ThreadPool pool(2);
+  std::atomic<int> sum{0};
+  pool.ParallelFor(8, [&](int) {
+    pool.ParallelFor(100, [&](int i) { sum += i; });
+  });
+  EXPECT_EQ(sum, 8 * 4950);
+}
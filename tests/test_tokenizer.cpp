@@ -1,5 +1,9 @@
 #include <tokenizer.h>
 
+#include <random>
+
+#include <thread_pool.h>
+
 #include <gtest/gtest.h>
 
 #include <tests/utils.h>
@@ -88,3 +92,146 @@ TEST(NewABCTokenizer, encode_decode) {
   EXPECT_EQ(str, "S:2");
 }
 
+
+TEST(TokenTrie, longest_prefix) {
+  // there is "cle" and "clear", but not "clea"
+  TokenTrie trie({{"c", 1}, {"cl", 2}, {"cle", 3}, {"clear", 4},
+                  {"\xe4\xbb\x8a", 5}, {"b", 6}});
+  EXPECT_EQ(trie.FindLongestPrefix("clear"), std::make_pair(5, 4));
+  EXPECT_EQ(trie.FindLongestPrefix("clean"), std::make_pair(3, 3));
+  EXPECT_EQ(trie.FindLongestPrefix("clz"), std::make_pair(2, 2));
+  EXPECT_EQ(trie.FindLongestPrefix("c"), std::make_pair(1, 1));
+  EXPECT_EQ(trie.FindLongestPrefix("\xe4\xbb\x8a\xe5"), std::make_pair(3, 5));
+  EXPECT_EQ(trie.FindLongestPrefix("a"), std::make_pair(0, -1));
+  EXPECT_EQ(trie.FindLongestPrefix(""), std::make_pair(0, -1));
+  // a view into a larger string is not read past its end
+  std::string_view view("clear", 4);
+  EXPECT_EQ(trie.FindLongestPrefix(view), std::make_pair(3, 3));
+}
+
+TEST(NormalTokenizer, cache) {
+  const std::unordered_map<int, std::string> idx2word{
+      {1, "c"}, {2, "cl"}, {3, "cle"}, {4, "clear"}, {5, " "}, {7, "a"}};
+  NormalTokenizer tokenizer(idx2word, "", "");
+  // unique, so that concurrent runs of the test don't share the files
+  const auto source = std::filesystem::temp_directory_path() /
+                      ("fr_test_tokenizer_" +
+                       std::to_string(std::random_device()()));
+  auto cache_path = source;
+  cache_path += ".frtk";
+  std::ofstream(source) << "source";
+
+  ASSERT_TRUE(tokenizer.SaveCache(cache_path, source));
+  auto cached = NormalTokenizer::LoadCache(cache_path, source);
+  ASSERT_NE(cached, nullptr);
+  const std::vector<int> expected{4, 5, 3, 7};
+  EXPECT_EQ(tokenizer.encode("clear clea"), expected);
+  EXPECT_EQ(cached->encode("clear clea"), expected);
+  EXPECT_EQ(cached->decode(expected), "clear clea");
+  EXPECT_EQ(cached->decode(6), "<unk>");
+  EXPECT_EQ(cached->decode(100), "<unk>");
+
+  // a corrupted image is ignored instead of being read out of bounds
+  std::unordered_map<std::string, int> word2idx;
+  for (const auto &[id, word] : idx2word) {
+    word2idx[word] = id;
+  }
+  const TokenTrie trie(word2idx);
+  const auto image_size = std::filesystem::file_size(cache_path);
+  // the image ends with num_slots slots, 8 words of (offset, length) and the
+  // 13 bytes of the words
+  const auto words_offset = image_size - 13 - 8 * 2 * sizeof(uint32_t);
+  const auto slots_offset =
+      words_offset - trie.num_slots() * sizeof(TokenTrie::Slot);
+  auto corrupt = [&](size_t offset, uint32_t value) {
+    ASSERT_LE(offset + sizeof(value), image_size);
+    ASSERT_TRUE(tokenizer.SaveCache(cache_path, source));
+    std::fstream file(cache_path,
+                      std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  // the root is its own parent
+  int32_t root_check = -1;
+  std::ifstream(cache_path, std::ios::binary)
+      .seekg(slots_offset + sizeof(int32_t))
+      .read(reinterpret_cast<char *>(&root_check), sizeof(root_check));
+  ASSERT_EQ(root_check, 0);
+  // the base of the root, and the token id of a slot
+  corrupt(slots_offset, 1 << 30);
+  EXPECT_EQ(NormalTokenizer::LoadCache(cache_path, source), nullptr);
+  corrupt(slots_offset + 2 * sizeof(int32_t), 1000);
+  EXPECT_EQ(NormalTokenizer::LoadCache(cache_path, source), nullptr);
+  // the offset of word 7, past the end of the image
+  corrupt(words_offset + 7 * 2 * sizeof(uint32_t), 1000);
+  EXPECT_EQ(NormalTokenizer::LoadCache(cache_path, source), nullptr);
+  ASSERT_TRUE(tokenizer.SaveCache(cache_path, source));
+  EXPECT_NE(NormalTokenizer::LoadCache(cache_path, source), nullptr);
+
+  // a cache of another version of the source is ignored
+  std::ofstream(source) << "another source";
+  EXPECT_EQ(NormalTokenizer::LoadCache(cache_path, source), nullptr);
+  std::filesystem::remove(source);
+  std::filesystem::remove(cache_path);
+}
+
+TEST(NormalTokenizer, encode_batch) {
+  // "ab" and "b\na" cross the newlines which long strings are split at
+  const std::unordered_map<int, std::string> idx2word{
+      {1, "a"}, {2, "b"}, {3, "ab"}, {4, "\n"}, {5, "b\na"}, {6, " "},
+      {7, "ba"}};
+  Tokenizer tokenizer(std::make_shared<NormalTokenizer>(idx2word, "", ""));
+  std::string long_str;
+  std::mt19937 rng(0);
+  const char alphabet[] = "ab\n ";
+  for (int i = 0; i < 3 * 1024 * 1024; i++) {
+    long_str += alphabet[rng() % 4];
+  }
+  std::vector<std::string_view> strs{"ab b\na", "", long_str, "bab",
+                                     std::string_view(long_str).substr(7)};
+
+  ThreadPool pool(3);
+  for (ThreadPool *p : {static_cast<ThreadPool *>(nullptr), &pool}) {
+    auto batch = tokenizer.encode_batch(strs, p);
+    ASSERT_EQ(batch.size(), strs.size());
+    for (size_t i = 0; i < strs.size(); i++) {
+      const auto expected = tokenizer.encode(strs[i]);
+      EXPECT_EQ(std::vector<int>(batch.data(i), batch.data(i) + batch.length(i)),
+                expected);
+    }
+    auto decoded = tokenizer.decode_batch(batch, p);
+    ASSERT_EQ(decoded.size(), strs.size());
+    for (size_t i = 0; i < strs.size(); i++) {
+      EXPECT_EQ(decoded[i], strs[i]);
+    }
+  }
+}
+
+TEST(StreamDecoder, utf8_boundaries) {
+  // "今" is e4 bb 8a and "天" is e5 a4 a9
+  const std::unordered_map<int, std::string> idx2word{
+      {1, "\xe4"}, {2, "\xbb\x8a\xe5"}, {3, "\xa4\xa9"}, {4, "a"}, {5, "\xe4\xbb"}};
+  Tokenizer tokenizer(std::make_shared<NormalTokenizer>(idx2word, "", ""));
+  StreamDecoder decoder(tokenizer);
+  EXPECT_EQ(decoder.Put(4), "a");
+  EXPECT_EQ(decoder.Put(1), "");
+  EXPECT_EQ(decoder.Put(2), "\xe4\xbb\x8a");
+  EXPECT_EQ(decoder.Put(3), "\xe5\xa4\xa9");
+  EXPECT_EQ(decoder.Put(5), "");
+  EXPECT_EQ(decoder.Flush(), "\xe4\xbb");
+  EXPECT_EQ(decoder.Put(4), "a");
+  // stray continuation bytes are not held back
+  EXPECT_EQ(decoder.Put(3), "\xa4\xa9");
+}
+
+TEST(NormalTokenizer, lowercase_whitespace_split) {
+  const std::unordered_map<int, std::string> idx2word{
+      {1, "abc"}, {2, "x@[`{"}, {3, "\xc3\x84z"}, {4, "longer_than_8_bytes"}};
+  NormalTokenizer tokenizer(idx2word, "Lowercase", "WhitespaceSplit");
+  // only ASCII letters are lowercased, and the words cross the 8-byte blocks
+  auto ids = tokenizer.encode(
+      " ABC\tX@[`{\n\r\xc3\x84Z  abc\vLONGER_than_8_BYTES\f\x0b");
+  EXPECT_EQ(ids, std::vector<int>({1, 2, 3, 1, 4}));
+  EXPECT_TRUE(tokenizer.encode(" \t\n").empty());
+  EXPECT_THROW(tokenizer.encode("abc abcd"), FRException);
+}
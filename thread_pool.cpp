@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace rwkv {
+
+ThreadPool::ThreadPool(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_threads; i++) {
+    _threads.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cv.notify_all();
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    RV_CHECK(!_stop);
+    _tasks.push_back(std::move(task));
+  }
+  _cv.notify_one();
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+      // pending tasks are still run on destruction so that no future is left
+      // unsatisfied
+      if (_tasks.empty()) {
+        return;
+      }
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+    task();
+  }
+}
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int)> &fn) {
+  if (n <= 0) {
+    return;
+  }
+  // Shared with the helper tasks, which may start after this call returns
+  // if the workers are busy (e.g. when it is called from a task of this
+  // pool). The calling thread never waits for a helper which has not
+  // started, it runs the remaining indices itself instead, so that the call
+  // cannot deadlock.
+  struct State {
+    // indices are claimed dynamically so that uneven items are balanced
+    std::atomic<int> next{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    // the helpers which are running `fn`
+    int num_running = 0;
+    // set when the calling thread is done, helpers starting later return
+    // without touching `fn`
+    bool closed = false;
+    std::exception_ptr exception;
+  };
+  auto state = std::make_shared<State>();
+  auto run = [n, &fn](State &state) {
+    try {
+      for (int i = state.next++; i < n; i = state.next++) {
+        fn(i);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      if (!state.exception) {
+        state.exception = std::current_exception();
+      }
+    }
+  };
+  const int num_helpers = std::min<int>(_threads.size(), n - 1);
+  for (int i = 0; i < num_helpers; i++) {
+    Post([state, run]() {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->closed) {
+          return;
+        }
+        state->num_running++;
+      }
+      run(*state);
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->num_running--;
+      }
+      state->cv.notify_all();
+    });
+  }
+  run(*state);
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->closed = true;
+  state->cv.wait(lock, [&]() { return state->num_running == 0; });
+  if (state->exception) {
+    std::rethrow_exception(state->exception);
+  }
+}
+
+} // namespace rwkv
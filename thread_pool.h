@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <check.h>
+
+namespace rwkv {
+
+// A fixed-size pool of worker threads running tasks in FIFO order.
+class ThreadPool {
+public:
+  // `num_threads` <= 0 means the number of hardware threads
+  explicit ThreadPool(int num_threads = 0);
+  ~ThreadPool();
+  FR_DISALLOW_COPY_AND_MOVE(ThreadPool);
+
+  template <typename F>
+  std::future<std::invoke_result_t<F>> Submit(F &&f) {
+    using R = std::invoke_result_t<F>;
+    // std::function must be copyable
+    auto task =
+        std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    auto future = task->get_future();
+    Post([task]() { (*task)(); });
+    return future;
+  }
+
+  // Run `fn(i)` for i in [0, n) on the pool and the calling thread, and wait
+  // for all of them. The first exception thrown by `fn` is rethrown. It can
+  // be called from a task of this pool: the calling thread runs the items
+  // the busy workers can't take.
+  void ParallelFor(int n, const std::function<void(int)> &fn);
+
+  int num_threads() const { return _threads.size(); }
+
+private:
+  void Post(std::function<void()> task);
+  void WorkerLoop();
+
+  std::vector<std::thread> _threads;
+  std::deque<std::function<void()>> _tasks;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stop = false;
+};
+
+} // namespace rwkv
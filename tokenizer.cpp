@@ -1,67 +1,209 @@
 #include "tokenizer.h"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <string_view>
-#include <optional>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <msgpack.hpp>
 
+#include <thread_pool.h>
 #include <utils.h>
 
 namespace rwkv {
 
-struct TrieTree {
-  std::unordered_map<int, std::unique_ptr<TrieTree>> children;
-  std::string word;
-  std::optional<int> token_id;
-  
-  TrieTree(const std::unordered_map<std::string, int>& word2id) {
-    for (auto& pair : word2id) {
-      add_word(pair.first, pair.second);
+namespace {
+// strings shorter than this are not split by encode_parallel
+constexpr size_t kMinChunkSize = 256 * 1024;
+
+// The normalizer and pre_tokenizer work on 8 bytes at a time in a uint64_t
+// (SWAR), which is portable to every target and does not depend on the
+// locale.
+constexpr uint64_t kOnes = 0x0101010101010101ULL;
+constexpr uint64_t kHighBits = 0x8080808080808080ULL;
+
+uint64_t Load64(const char *p) {
+  uint64_t x;
+  std::memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+// 'A'-'Z' to lowercase, like std::tolower in the "C" locale
+uint64_t Lowercase64(uint64_t x) {
+  // per byte, the high bit of (low 7 bits + c) is set iff they are >= 128 - c
+  const uint64_t low7 = x & ~kHighBits;
+  const uint64_t ge_a = low7 + (0x80 - 'A') * kOnes;
+  const uint64_t gt_z = low7 + (0x80 - 'Z' - 1) * kOnes;
+  const uint64_t upper = ~x & (ge_a ^ gt_z) & kHighBits;
+  return x | (upper >> 2);
+}
+
+// whether any byte is <= ' ', i.e. may be whitespace
+bool MaybeSpace64(uint64_t x) {
+  return ((x - ('!' * kOnes)) & ~x & kHighBits) != 0;
+}
+
+// the whitespace of std::isspace in the "C" locale, which `>>` splits at
+bool IsSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+// calls `fn` with every maximal run of non-whitespace bytes
+template <typename F> void ForEachWord(std::string_view str, F &&fn) {
+  const size_t size = str.size();
+  size_t i = 0;
+  while (true) {
+    while (i < size && IsSpace(str[i])) {
+      i++;
     }
+    if (i == size) {
+      return;
+    }
+    const size_t begin = i;
+    while (i + 8 <= size && !MaybeSpace64(Load64(str.data() + i))) {
+      i += 8;
+    }
+    while (i < size && !IsSpace(str[i])) {
+      i++;
+    }
+    fn(str.substr(begin, i - begin));
   }
+}
 
-  std::pair<std::string, int> find_longest_prefix(const std::string& str) const {
-    std::string prefix;
-    int token_id = -1;
-    const TrieTree* node = this;
-    for (int i = 0; i < str.size(); ++i) {
-      auto it = node->children.find(str[i]);
-      if (it == node->children.end()) {
-        break;
+// FNV-1a
+uint64_t HashWord(std::string_view word) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (char c : word) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+} // namespace
+
+TokenTrie::TokenTrie(const std::unordered_map<std::string, int> &word2idx) {
+  std::vector<std::pair<std::string_view, int>> words;
+  words.reserve(word2idx.size());
+  for (const auto &[word, id] : word2idx) {
+    if (!word.empty()) {
+      words.emplace_back(word, id);
+    }
+  }
+  // std::char_traits<char> compares as unsigned char
+  std::sort(words.begin(), words.end());
+
+  // Every node covers the range of the sorted words which start with its
+  // prefix. Nodes are placed in BFS order, each one at the first base where
+  // all its children fit.
+  struct Pending {
+    size_t begin;
+    size_t end;
+    size_t depth;
+    int32_t slot;
+  };
+  std::vector<Pending> queue{{0, words.size(), 0, 0}};
+  auto &slots = _storage;
+  slots.resize(1);
+  // the root is its own parent so that slot 0 is not free
+  slots[0].check = 0;
+  size_t first_free = 1;
+  std::vector<uint8_t> labels;
+  std::vector<std::pair<size_t, size_t>> groups;
+  for (size_t q = 0; q < queue.size(); q++) {
+    auto [begin, end, depth, slot] = queue[q];
+    if (begin < end && words[begin].first.size() == depth) {
+      slots[slot].token_id = words[begin].second;
+      begin++;
+    }
+    labels.clear();
+    groups.clear();
+    while (begin < end) {
+      const char c = words[begin].first[depth];
+      size_t group_end = begin + 1;
+      while (group_end < end && words[group_end].first[depth] == c) {
+        group_end++;
       }
-      node = it->second.get();
-      RV_CHECK(node != nullptr);
-      if (node->token_id.has_value()) {
-        prefix = node->word;
-        token_id = node->token_id.value();
+      labels.push_back(static_cast<uint8_t>(c));
+      groups.emplace_back(begin, group_end);
+      begin = group_end;
+    }
+    if (labels.empty()) {
+      continue;
+    }
+    while (first_free < slots.size() && slots[first_free].check != -1) {
+      first_free++;
+    }
+    int32_t base = std::max<int64_t>(1, static_cast<int64_t>(first_free) -
+                                            labels.front());
+    while (true) {
+      bool fits = true;
+      for (uint8_t c : labels) {
+        const size_t t = base + c;
+        if (t < slots.size() && slots[t].check != -1) {
+          fits = false;
+          break;
+        }
       }
+      if (fits) {
+        break;
+      }
+      base++;
+    }
+    slots[slot].base = base;
+    if (slots.size() < base + 256) {
+      slots.resize(base + 256);
+    }
+    for (size_t i = 0; i < labels.size(); i++) {
+      const int32_t t = base + labels[i];
+      slots[t].check = slot;
+      queue.push_back({groups[i].first, groups[i].second, depth + 1, t});
     }
-    RV_CHECK(!prefix.empty());
-    RV_CHECK(token_id != -1);
-    return {prefix, token_id};
   }
-
-  private:
-  TrieTree() = default;
-  void add_word(const std::string& word, int token_id) {
-    return _add_word(word, token_id, 0);
+  // trailing free slots are only needed as padding for base + 255
+  size_t last_used = slots.size();
+  while (last_used > 0 && slots[last_used - 1].check == -1) {
+    last_used--;
   }
-  void _add_word(const std::string& word, int token_id, int idx) {
-    if (idx == word.size()) {
-      this->word = word;
-      this->token_id = token_id;
-      return;
+  slots.resize(last_used + 256);
+  _slots = slots.data();
+  _num_slots = slots.size();
+}
+
+std::pair<int, int> TokenTrie::FindLongestPrefix(std::string_view str) const {
+  std::pair<int, int> result{0, -1};
+  const Slot *slots = _slots;
+  int32_t node = 0;
+  for (size_t i = 0; i < str.size(); i++) {
+    const int32_t t = slots[node].base + static_cast<uint8_t>(str[i]);
+    if (slots[node].base == 0 || slots[t].check != node) {
+      break;
     }
-    auto& child = children[word[idx]];
-    if (!child) {
-      child = std::unique_ptr<TrieTree>(new TrieTree());
+    node = t;
+    if (slots[node].token_id != -1) {
+      result = {static_cast<int>(i + 1), slots[node].token_id};
     }
-    child->_add_word(word, token_id, idx + 1);
   }
-};
+  return result;
+}
+
+int TokenTrie::Find(std::string_view word) const {
+  const Slot *slots = _slots;
+  int32_t node = 0;
+  for (char c : word) {
+    const int32_t t = slots[node].base + static_cast<uint8_t>(c);
+    if (slots[node].base == 0 || slots[t].check != node) {
+      return -1;
+    }
+    node = t;
+  }
+  return word.empty() ? -1 : slots[node].token_id;
+}
 
 Tokenizer::Tokenizer(std::filesystem::path path, void *asset_manager) {
   if (path.empty()) {
@@ -71,6 +213,16 @@ Tokenizer::Tokenizer(std::filesystem::path path, void *asset_manager) {
   if (std::filesystem::is_directory(path)) {
     path /= "tokenizer";
   }
+  // assets are read-only and cannot be mapped, so they are not cached
+  const bool cacheable = path.string().substr(0, 6) != "asset:";
+  std::filesystem::path cache_path = path;
+  cache_path += ".frtk";
+  if (cacheable) {
+    if (auto cached = NormalTokenizer::LoadCache(cache_path, path)) {
+      _impl = cached;
+      return;
+    }
+  }
 #ifdef _WIN32
   const std::vector<uint8_t> data = read_file_to_vector(path.string(), asset_manager);
   auto unpacker = msgpack::unpack((const char*)data.data(), data.size());
@@ -92,7 +244,12 @@ Tokenizer::Tokenizer(std::filesystem::path path, void *asset_manager) {
     return "NormalTokenizer";
   }();
   if (type == "NormalTokenizer") {
-    _impl = std::make_shared<NormalTokenizer>(obj);
+    auto tokenizer = std::make_shared<NormalTokenizer>(obj);
+    if (cacheable) {
+      // best effort, e.g. the model directory may be read-only
+      tokenizer->SaveCache(cache_path, path);
+    }
+    _impl = tokenizer;
   } else if (type == "SimpleABCTokenizer") {
     _impl = std::make_shared<ABCTokenizer>();
   } else {
@@ -100,85 +257,517 @@ Tokenizer::Tokenizer(std::filesystem::path path, void *asset_manager) {
   }
 }
 
+TokenBatch Tokenizer::encode_batch(const std::vector<std::string_view> &strs,
+                                   ThreadPool *pool) const {
+  const int n = strs.size();
+  std::vector<std::vector<int>> ids(n);
+  if (pool == nullptr) {
+    for (int i = 0; i < n; i++) {
+      ids[i] = _impl->encode(strs[i]);
+    }
+  } else {
+    // long strings are encoded one by one with all threads, and the others
+    // are distributed over the threads in contiguous ranges
+    std::vector<int> short_strs;
+    for (int i = 0; i < n; i++) {
+      if (strs[i].size() >= kMinChunkSize) {
+        ids[i] = _impl->encode_parallel(strs[i], *pool);
+      } else {
+        short_strs.push_back(i);
+      }
+    }
+    const int num_ranges =
+        std::min<int>(short_strs.size(), (pool->num_threads() + 1) * 4);
+    pool->ParallelFor(num_ranges, [&](int r) {
+      const size_t begin = r * short_strs.size() / num_ranges;
+      const size_t end = (r + 1) * short_strs.size() / num_ranges;
+      for (size_t i = begin; i < end; i++) {
+        ids[short_strs[i]] = _impl->encode(strs[short_strs[i]]);
+      }
+    });
+  }
+  TokenBatch batch;
+  batch.offsets.resize(n + 1);
+  for (int i = 0; i < n; i++) {
+    batch.offsets[i + 1] = batch.offsets[i] + ids[i].size();
+  }
+  batch.ids.resize(batch.offsets[n]);
+  for (int i = 0; i < n; i++) {
+    std::copy(ids[i].begin(), ids[i].end(),
+              batch.ids.begin() + batch.offsets[i]);
+  }
+  return batch;
+}
+
+std::vector<std::string> Tokenizer::decode_batch(const TokenBatch &batch,
+                                                 ThreadPool *pool) const {
+  const int n = batch.size();
+  std::vector<std::string> strs(n);
+  auto decode_range = [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (size_t j = 0; j < batch.length(i); j++) {
+        strs[i] += _impl->decode_view(batch.data(i)[j]);
+      }
+    }
+  };
+  if (pool == nullptr) {
+    decode_range(0, n);
+  } else {
+    const int num_ranges = std::min(n, (pool->num_threads() + 1) * 4);
+    pool->ParallelFor(num_ranges, [&](int r) {
+      decode_range(r * n / num_ranges, (r + 1) * n / num_ranges);
+    });
+  }
+  return strs;
+}
+
+// The image is the header, then num_slots TokenTrie::Slot, then num_words
+// Word, then pool_size bytes of words. Offsets of the normalizer and
+// pre_tokenizer are into the pool as well.
+struct NormalTokenizer::CacheHeader {
+  static constexpr char kMagic[8] = {'F', 'R', 'T', 'O', 'K', 'E', 'N', '1'};
+  // the image is in native byte order
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t num_slots;
+  uint32_t num_words;
+  uint32_t pool_size;
+  Word normalizer;
+  Word pre_tokenizer;
+  // identify the msgpack file the image was built from
+  uint64_t source_size;
+  int64_t source_mtime;
+};
+
+namespace {
+std::pair<uint64_t, int64_t> FileStamp(const std::filesystem::path &path) {
+  std::error_code ec;
+  const auto size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return {0, 0};
+  }
+  const auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return {0, 0};
+  }
+  return {size, mtime.time_since_epoch().count()};
+}
+
+// operator new[] aligns to alignof(std::max_align_t), like mmap
+std::shared_ptr<char> AllocateImage(size_t size) {
+  return std::shared_ptr<char>(new char[size], std::default_delete<char[]>());
+}
+
+std::shared_ptr<const char> MapFile(const std::filesystem::path &path,
+                                    size_t *size) {
+#ifdef _WIN32
+  if (!file_exists(path.string())) {
+    return nullptr;
+  }
+  const std::vector<uint8_t> data = read_file_to_vector(path.string());
+  auto image = AllocateImage(data.size());
+  std::copy(data.begin(), data.end(), image.get());
+  *size = data.size();
+  return image;
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  const size_t length = st.st_size;
+  void *ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+  *size = length;
+  return std::shared_ptr<const char>(
+      static_cast<const char *>(ptr),
+      [length](const char *p) { munmap(const_cast<char *>(p), length); });
+#endif
+}
+} // namespace
+
 NormalTokenizer::NormalTokenizer(msgpack::object obj) : TokenizerBase(0, 0, 0) {
+  std::unordered_map<int, std::string> idx2word;
+  std::string normalizer;
+  std::string pre_tokenizer;
   try {
     auto dict = obj.as<std::unordered_map<std::string, msgpack::object>>();
     if (dict.find("type") != dict.end()) {
       RV_CHECK(dict["type"].as<std::string>() == "NormalTokenizer");
     }
-    _idx2word = dict["idx2word"].as<std::unordered_map<int, std::string>>();
+    idx2word = dict["idx2word"].as<std::unordered_map<int, std::string>>();
     if (dict.find("normalizer") != dict.end()) {
-      _normalizer = dict["normalizer"].as<std::string>();
+      normalizer = dict["normalizer"].as<std::string>();
     }
     if (dict.find("pre_tokenizer") != dict.end()) {
-      _pre_tokenizer = dict["pre_tokenizer"].as<std::string>();
+      pre_tokenizer = dict["pre_tokenizer"].as<std::string>();
     }
   } catch (const std::exception &e) {
     // legacy world tokenizer format
-    _idx2word = obj.as<std::unordered_map<int, std::string>>();
+    idx2word = obj.as<std::unordered_map<int, std::string>>();
   }
-  for (auto &pair : _idx2word) {
-    _word2idx[pair.second] = pair.first;
+  Build(idx2word, normalizer, pre_tokenizer);
+}
+
+NormalTokenizer::NormalTokenizer(
+    const std::unordered_map<int, std::string> &idx2word,
+    const std::string &normalizer, const std::string &pre_tokenizer)
+    : TokenizerBase(0, 0, 0) {
+  Build(idx2word, normalizer, pre_tokenizer);
+}
+
+void NormalTokenizer::Build(
+    const std::unordered_map<int, std::string> &idx2word,
+    const std::string &normalizer, const std::string &pre_tokenizer) {
+  std::unordered_map<std::string, int> word2idx;
+  size_t num_words = 0;
+  size_t pool_size = normalizer.size() + pre_tokenizer.size();
+  for (const auto &[id, word] : idx2word) {
+    RV_CHECK(id >= 0) << "negative token id " << id;
+    word2idx[word] = id;
+    num_words = std::max<size_t>(num_words, id + 1);
+    pool_size += word.size();
   }
-  _tree = std::make_unique<TrieTree>(_word2idx);
+  const TokenTrie trie(word2idx);
+
+  const size_t slots_offset = sizeof(CacheHeader);
+  const size_t words_offset =
+      slots_offset + trie.num_slots() * sizeof(TokenTrie::Slot);
+  const size_t pool_offset = words_offset + num_words * sizeof(Word);
+  const size_t image_size = pool_offset + pool_size;
+  RV_CHECK(pool_size <= UINT32_MAX) << "the vocabulary is too large";
+  auto image = AllocateImage(image_size);
+
+  auto *header = reinterpret_cast<CacheHeader *>(image.get());
+  std::copy_n(CacheHeader::kMagic, sizeof(header->magic), header->magic);
+  header->byte_order = CacheHeader::kByteOrderMark;
+  header->num_slots = trie.num_slots();
+  header->num_words = num_words;
+  header->pool_size = pool_size;
+  header->source_size = 0;
+  header->source_mtime = 0;
+  std::copy_n(trie.slots(), trie.num_slots(),
+              reinterpret_cast<TokenTrie::Slot *>(image.get() + slots_offset));
+  auto *words = reinterpret_cast<Word *>(image.get() + words_offset);
+  std::fill_n(words, num_words, Word{UINT32_MAX, 0});
+  char *pool = image.get() + pool_offset;
+  uint32_t pool_end = 0;
+  auto append = [&](const std::string &str) {
+    std::copy(str.begin(), str.end(), pool + pool_end);
+    const Word word{pool_end, static_cast<uint32_t>(str.size())};
+    pool_end += str.size();
+    return word;
+  };
+  header->normalizer = append(normalizer);
+  header->pre_tokenizer = append(pre_tokenizer);
+  for (const auto &[id, word] : idx2word) {
+    words[id] = append(word);
+  }
+  Attach(std::move(image), image_size);
 }
 
-std::vector<int> NormalTokenizer::encode(std::string_view _str) const {
-  std::string str;
+NormalTokenizer::NormalTokenizer(std::shared_ptr<const char> image,
+                                 size_t image_size)
+    : TokenizerBase(0, 0, 0) {
+  Attach(std::move(image), image_size);
+}
+
+void NormalTokenizer::Attach(std::shared_ptr<const char> image,
+                             size_t image_size) {
+  const auto *header = reinterpret_cast<const CacheHeader *>(image.get());
+  const char *slots = image.get() + sizeof(CacheHeader);
+  const char *words = slots + header->num_slots * sizeof(TokenTrie::Slot);
+  _pool = words + header->num_words * sizeof(Word);
+  _trie = std::make_unique<TokenTrie>(
+      reinterpret_cast<const TokenTrie::Slot *>(slots), header->num_slots);
+  _words = reinterpret_cast<const Word *>(words);
+  _num_words = header->num_words;
+  _normalizer.assign(_pool + header->normalizer.offset,
+                     header->normalizer.length);
+  _pre_tokenizer.assign(_pool + header->pre_tokenizer.offset,
+                        header->pre_tokenizer.length);
+  _image = std::move(image);
+  _image_size = image_size;
+
+  if (_pre_tokenizer == "WhitespaceSplit") {
+    // a power of two, at most half full
+    size_t table_size = 2;
+    while (table_size < 2 * _num_words) {
+      table_size *= 2;
+    }
+    _word_table.assign(table_size, -1);
+    for (size_t id = 0; id < _num_words; id++) {
+      const std::string_view word = decode_view(id);
+      // of duplicated words, keep the one the trie has
+      if (_words[id].offset == UINT32_MAX || _trie->Find(word) != id) {
+        continue;
+      }
+      size_t i = HashWord(word) & (table_size - 1);
+      while (_word_table[i] != -1) {
+        i = (i + 1) & (table_size - 1);
+      }
+      _word_table[i] = id;
+    }
+  }
+}
+
+bool NormalTokenizer::SaveCache(const std::filesystem::path &cache_path,
+                                const std::filesystem::path &source) const {
+  CacheHeader header = *reinterpret_cast<const CacheHeader *>(_image.get());
+  std::tie(header.source_size, header.source_mtime) = FileStamp(source);
+  // write then rename, so that a concurrent load never sees a partial file
+  std::filesystem::path tmp_path = cache_path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(_image.get() + sizeof(header), _image_size - sizeof(header));
+    if (!file) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, cache_path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<NormalTokenizer>
+NormalTokenizer::LoadCache(const std::filesystem::path &cache_path,
+                           const std::filesystem::path &source) {
+  size_t size = 0;
+  auto image = MapFile(cache_path, &size);
+  if (image == nullptr || size < sizeof(CacheHeader)) {
+    return nullptr;
+  }
+  const auto *header = reinterpret_cast<const CacheHeader *>(image.get());
+  const size_t expected_size =
+      sizeof(CacheHeader) +
+      static_cast<size_t>(header->num_slots) * sizeof(TokenTrie::Slot) +
+      static_cast<size_t>(header->num_words) * sizeof(Word) +
+      header->pool_size;
+  if (!std::equal(header->magic, header->magic + sizeof(header->magic),
+                  CacheHeader::kMagic) ||
+      header->byte_order != CacheHeader::kByteOrderMark ||
+      // FindLongestPrefix reads up to base + 255
+      header->num_slots < 256 || expected_size != size ||
+      std::make_pair(header->source_size, header->source_mtime) !=
+          FileStamp(source)) {
+    return nullptr;
+  }
+  // a corrupted image must not make the lookups read out of bounds
+  const auto *slots = reinterpret_cast<const TokenTrie::Slot *>(
+      image.get() + sizeof(CacheHeader));
+  const auto *words = reinterpret_cast<const Word *>(slots + header->num_slots);
+  auto valid_word = [&](const Word &word) {
+    return static_cast<uint64_t>(word.offset) + word.length <=
+           header->pool_size;
+  };
+  const int64_t num_slots = header->num_slots;
+  const int64_t num_words = header->num_words;
+  for (int64_t i = 0; i < num_slots; i++) {
+    const auto &slot = slots[i];
+    // the trie reads slots[base + c] for every byte c
+    if ((slot.base != 0 &&
+         (slot.base < 0 || int64_t{slot.base} + 255 >= num_slots)) ||
+        slot.token_id < -1 || slot.token_id >= num_words) {
+      return nullptr;
+    }
+  }
+  for (int64_t i = 0; i < num_words; i++) {
+    if (words[i].offset != UINT32_MAX && !valid_word(words[i])) {
+      return nullptr;
+    }
+  }
+  if (!valid_word(header->normalizer) || !valid_word(header->pre_tokenizer)) {
+    return nullptr;
+  }
+  return std::shared_ptr<NormalTokenizer>(
+      new NormalTokenizer(std::move(image), size));
+}
+
+std::string_view NormalTokenizer::Normalize(std::string_view str,
+                                            std::string *buf) const {
   if (_normalizer == "Lowercase") {
-    for (int i = 0; i < _str.size(); ++i) {
-      str += std::tolower(_str[i]);
+    buf->resize(str.size());
+    char *out = buf->data();
+    size_t i = 0;
+    for (; i + 8 <= str.size(); i += 8) {
+      const uint64_t x = Lowercase64(Load64(str.data() + i));
+      std::memcpy(out + i, &x, sizeof(x));
     }
+    for (; i < str.size(); ++i) {
+      out[i] = std::tolower(static_cast<unsigned char>(str[i]));
+    }
+    return *buf;
   } else if (_normalizer.empty()) {
-    str = _str;
+    // no copy
+    return str;
   } else {
     RV_UNIMPLEMENTED() << "Unknown normalizer: " << _normalizer;
   }
-  std::vector<std::string> pieces;
-  if (_pre_tokenizer == "WhitespaceSplit") {
-    std::string buf;
-    std::stringstream ss{std::string(str)};
-    while (ss >> buf) {
-      pieces.push_back(buf);
+}
+
+int NormalTokenizer::FindWord(std::string_view word) const {
+  const size_t mask = _word_table.size() - 1;
+  for (size_t i = HashWord(word) & mask;; i = (i + 1) & mask) {
+    const int id = _word_table[i];
+    if (id == -1 || decode_view(id) == word) {
+      return id;
     }
+  }
+}
+
+size_t NormalTokenizer::EncodeGreedy(std::string_view str, size_t begin,
+                                     size_t end, std::vector<int> *ids,
+                                     std::vector<size_t> *starts) const {
+  size_t str_idx = begin;
+  while (str_idx < end) {
+    // substr of a string_view does not copy
+    auto [len, token_id] = _trie->FindLongestPrefix(str.substr(str_idx));
+    RV_CHECK(len > 0) << "no token matches at byte " << str_idx;
+    ids->push_back(token_id);
+    if (starts != nullptr) {
+      starts->push_back(str_idx);
+    }
+    str_idx += len;
+  }
+  return str_idx;
+}
+
+std::vector<int> NormalTokenizer::encode(std::string_view _str) const {
+  std::string normalized;
+  const std::string_view str = Normalize(_str, &normalized);
+  if (_pre_tokenizer == "WhitespaceSplit") {
     std::vector<int> ids;
-    for (auto &piece : pieces) {
-      auto it = _word2idx.find(piece);
-      if (it == _word2idx.end()) {
-        RV_UNIMPLEMENTED();
+    ForEachWord(str, [&](std::string_view piece) {
+      const int id = FindWord(piece);
+      if (id == -1) {
+        RV_UNIMPLEMENTED() << "Unknown word: " << piece;
       } else {
-        ids.push_back(it->second);
+        ids.push_back(id);
       }
-    }
+    });
     return ids;
   } else if (_pre_tokenizer.empty()) {
     std::vector<int> ids;
-    int str_idx = 0;
-
-    while (str_idx < str.size()) {
-      auto [prefix, token_id] = _tree->find_longest_prefix(str.substr(str_idx));
-      ids.push_back(token_id);
-      str_idx += prefix.size();
-    }
+    // tokens are a few bytes long on average
+    ids.reserve(str.size() / 3 + 1);
+    EncodeGreedy(str, 0, str.size(), &ids, nullptr);
     return ids;
   } else {
     RV_UNIMPLEMENTED() << "Unknown pre_tokenizer: " << _pre_tokenizer;
   }
 }
 
-std::string NormalTokenizer::decode(int id) const {
-  auto it = _idx2word.find(id);
-  if (it == _idx2word.end()) {
+namespace {
+// A chunk boundary near `pos`: preferably after a newline, or else before a
+// space, where tokens of natural text usually begin. Never inside a UTF-8
+// sequence.
+size_t ChunkBoundary(std::string_view str, size_t pos) {
+  constexpr size_t kWindow = 4096;
+  const size_t window_end = std::min(str.size(), pos + kWindow);
+  const size_t newline = str.substr(0, window_end).find('\n', pos);
+  if (newline != std::string_view::npos) {
+    return newline + 1;
+  }
+  const size_t space = str.substr(0, window_end).find(' ', pos);
+  if (space != std::string_view::npos) {
+    return space;
+  }
+  while (pos < str.size() && (static_cast<uint8_t>(str[pos]) & 0xC0) == 0x80) {
+    pos++;
+  }
+  return pos;
+}
+} // namespace
+
+std::vector<int> NormalTokenizer::encode_parallel(std::string_view _str,
+                                                  ThreadPool &pool) const {
+  const size_t max_chunks = std::min<size_t>(pool.num_threads() + 1,
+                                             _str.size() / kMinChunkSize);
+  if (!_pre_tokenizer.empty() || max_chunks < 2) {
+    return encode(_str);
+  }
+  std::string normalized;
+  const std::string_view str = Normalize(_str, &normalized);
+
+  std::vector<size_t> bounds{0};
+  for (size_t i = 1; i < max_chunks; i++) {
+    const size_t bound = ChunkBoundary(str, i * str.size() / max_chunks);
+    if (bound > bounds.back() && bound < str.size()) {
+      bounds.push_back(bound);
+    }
+  }
+  bounds.push_back(str.size());
+  const int num_chunks = bounds.size() - 1;
+
+  // Every chunk is encoded as if the text started at its beginning. A token
+  // may cross the end of the chunk, so the chunk ends at `end` >= its bound.
+  struct Chunk {
+    std::vector<int> ids;
+    std::vector<size_t> starts;
+    size_t end;
+  };
+  std::vector<Chunk> chunks(num_chunks);
+  pool.ParallelFor(num_chunks, [&](int i) {
+    auto &chunk = chunks[i];
+    chunk.ids.reserve((bounds[i + 1] - bounds[i]) / 3 + 1);
+    chunk.starts.reserve((bounds[i + 1] - bounds[i]) / 3 + 1);
+    chunk.end =
+        EncodeGreedy(str, bounds[i], bounds[i + 1], &chunk.ids, &chunk.starts);
+  });
+
+  // The greedy encoding from a position is unique, so once the sequential
+  // encoding reaches a token start of a chunk, the rest of that chunk is
+  // what the sequential encoding would produce. Until then (usually no
+  // token at all, since chunks begin at newlines) it is re-encoded here.
+  std::vector<int> ids;
+  ids.reserve(str.size() / 3 + 1);
+  size_t pos = 0;
+  for (const auto &chunk : chunks) {
+    auto it = std::lower_bound(chunk.starts.begin(), chunk.starts.end(), pos);
+    while ((it == chunk.starts.end() || *it != pos) && pos < chunk.end) {
+      pos = EncodeGreedy(str, pos, pos + 1, &ids, nullptr);
+      it = std::lower_bound(it, chunk.starts.end(), pos);
+    }
+    if (it != chunk.starts.end() && *it == pos) {
+      ids.insert(ids.end(), chunk.ids.begin() + (it - chunk.starts.begin()),
+                 chunk.ids.end());
+      pos = chunk.end;
+    }
+  }
+  return ids;
+}
+
+std::string_view NormalTokenizer::decode_view(int id) const {
+  if (id < 0 || id >= _num_words || _words[id].offset == UINT32_MAX) {
     return "<unk>";
   } else {
-    return it->second;
+    return std::string_view(_pool + _words[id].offset, _words[id].length);
   }
 }
 
+std::string NormalTokenizer::decode(int id) const {
+  return std::string(decode_view(id));
+}
+
 std::string NormalTokenizer::decode(const std::vector<int> &ids) const {
   std::string str;
   for (auto id : ids) {
-    str += decode(id);
+    str += decode_view(id);
   }
   return str;
 }
@@ -191,20 +780,73 @@ std::vector<int> ABCTokenizer::encode(std::string_view str) const {
   return ids;
 }
 
-std::string ABCTokenizer::decode(int id) const {
+std::string_view ABCTokenizer::decode_view(int id) const {
   if (id <= eos_token_id) {
     return "";
-  } else {
-    return std::string(1, static_cast<char>(id));
   }
+  static const std::array<char, 256> kBytes = [] {
+    std::array<char, 256> bytes;
+    for (int i = 0; i < 256; i++) {
+      bytes[i] = static_cast<char>(i);
+    }
+    return bytes;
+  }();
+  // the same byte as static_cast<char>(id)
+  return std::string_view(&kBytes[static_cast<uint8_t>(id)], 1);
+}
+
+std::string ABCTokenizer::decode(int id) const {
+  return std::string(decode_view(id));
 }
 
 std::string ABCTokenizer::decode(const std::vector<int> &ids) const {
   std::string str;
   for (auto id : ids) {
-    str += decode(id);
+    str += decode_view(id);
   }
   return str;
 }
 
+std::string_view StreamDecoder::Put(int id) {
+  RV_CHECK(_tokenizer != nullptr) << "StreamDecoder has no tokenizer";
+  return Put(_tokenizer->decode_view(id));
+}
+
+std::string_view StreamDecoder::Put(std::string_view bytes) {
+  _buffer.erase(0, _num_emitted);
+  _buffer += bytes;
+  // hold back the last code point if its lead byte announces more bytes
+  // than there are. Continuation bytes without a lead byte, and invalid
+  // lead bytes, are passed through instead of being held forever.
+  const size_t size = _buffer.size();
+  _num_emitted = size;
+  for (size_t i = size; i > 0 && size - i < 4; i--) {
+    const uint8_t byte = _buffer[i - 1];
+    if ((byte & 0xC0) == 0x80) {
+      continue;
+    }
+    const size_t length = byte < 0xC0   ? 1
+                          : byte < 0xE0 ? 2
+                          : byte < 0xF0 ? 3
+                          : byte < 0xF8 ? 4
+                                        : 1;
+    if (size - (i - 1) < length) {
+      _num_emitted = i - 1;
+    }
+    break;
+  }
+  return std::string_view(_buffer.data(), _num_emitted);
+}
+
+std::string StreamDecoder::Flush() {
+  std::string rest = _buffer.substr(_num_emitted);
+  Reset();
+  return rest;
+}
+
+void StreamDecoder::Reset() {
+  _buffer.clear();
+  _num_emitted = 0;
+}
+
 } // namespace rwkv
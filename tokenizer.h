@@ -1,16 +1,64 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <filesystem>
 
 #include <msgpack.hpp>
 
+#include <check.h>
+
 namespace rwkv {
-struct TrieTree;
-  
+class ThreadPool;
+
+// A double-array trie of the vocabulary: the child of node s by byte c is
+// t = base(s) + c iff check(t) == s, so every step of a longest-prefix walk
+// is one array access, without pointers or per-node containers.
+class TokenTrie {
+public:
+  struct Slot {
+    int32_t base = 0;
+    // the parent node, -1 for a free slot
+    int32_t check = -1;
+    int32_t token_id = -1;
+  };
+
+  explicit TokenTrie(const std::unordered_map<std::string, int> &word2idx);
+  // a view of the slots of another trie, e.g. in a mapped cache file. They
+  // must outlive this trie.
+  TokenTrie(const Slot *slots, size_t num_slots)
+      : _slots(slots), _num_slots(num_slots) {}
+  FR_DISALLOW_COPY_AND_MOVE(TokenTrie);
+  // (length, id) of the longest word which is a prefix of `str`, (0, -1) if
+  // there is none
+  std::pair<int, int> FindLongestPrefix(std::string_view str) const;
+  // the id of `word`, -1 if it is not in the vocabulary
+  int Find(std::string_view word) const;
+
+  const Slot *slots() const { return _slots; }
+  size_t num_slots() const { return _num_slots; }
+
+private:
+  std::vector<Slot> _storage;
+  const Slot *_slots;
+  size_t _num_slots;
+};
+
+// Token ids of a batch of strings in one flat buffer: the ids of string i
+// are ids[offsets[i], offsets[i + 1]).
+struct TokenBatch {
+  std::vector<int> ids;
+  std::vector<size_t> offsets{0};
+
+  size_t size() const { return offsets.size() - 1; }
+  const int *data(size_t i) const { return ids.data() + offsets[i]; }
+  size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+};
+
 class TokenizerBase {
 public:
   TokenizerBase(int pad_token_id, int bos_token_id, int eos_token_id)
@@ -20,6 +68,13 @@ public:
   virtual std::vector<int> encode(std::string_view str) const = 0;
   virtual std::string decode(const std::vector<int> &ids) const = 0;
   virtual std::string decode(int id) const = 0;
+  // the bytes of token `id`, valid as long as the tokenizer
+  virtual std::string_view decode_view(int id) const = 0;
+  // Same as encode, but may split a long `str` into chunks encoded on `pool`.
+  virtual std::vector<int> encode_parallel(std::string_view str,
+                                           ThreadPool &pool) const {
+    return encode(str);
+  }
   const int pad_token_id;
   const int bos_token_id;
   const int eos_token_id;
@@ -31,6 +86,8 @@ public:
   // non-Android builds)
   Tokenizer(std::filesystem::path path, void* asset_manager);
   Tokenizer(std::filesystem::path path) : Tokenizer(path, nullptr) {}
+  explicit Tokenizer(std::shared_ptr<TokenizerBase> impl)
+      : _impl(std::move(impl)) {}
   std::vector<int> encode(std::string_view str) const {
     return _impl->encode(str);
   }
@@ -38,6 +95,14 @@ public:
     return _impl->decode(ids);
   }
   std::string decode(int id) const { return _impl->decode(id); }
+  std::string_view decode_view(int id) const { return _impl->decode_view(id); }
+  // Encode/decode many strings, in parallel on `pool` if it is given. Strings
+  // are distributed over the threads, and long strings are also split into
+  // chunks, with the same result as encoding them one by one.
+  TokenBatch encode_batch(const std::vector<std::string_view> &strs,
+                          ThreadPool *pool = nullptr) const;
+  std::vector<std::string> decode_batch(const TokenBatch &batch,
+                                        ThreadPool *pool = nullptr) const;
 
   int pad_token_id() const { return _impl->pad_token_id; }
   int bos_token_id() const { return _impl->bos_token_id; }
@@ -47,17 +112,69 @@ private:
   std::shared_ptr<TokenizerBase> _impl;
 };
 
+// All data of a NormalTokenizer lives in one flat image: the trie slots, an
+// id -> (offset, length) table and the pool of word bytes. The image is what
+// the "<tokenizer>.frtk" cache stores, so loading the cache is mapping the
+// file and pointing into it.
 class NormalTokenizer : public TokenizerBase {
 public:
   NormalTokenizer(msgpack::object obj);
+  NormalTokenizer(const std::unordered_map<int, std::string> &idx2word,
+                  const std::string &normalizer,
+                  const std::string &pre_tokenizer);
   std::vector<int> encode(std::string_view str) const;
   std::string decode(const std::vector<int> &ids) const;
   std::string decode(int id) const;
+  std::string_view decode_view(int id) const;
+  // Without a pre_tokenizer, the encoding is a greedy longest-match scan, so
+  // chunks can be encoded independently and stitched back at a common token
+  // boundary.
+  std::vector<int> encode_parallel(std::string_view str,
+                                   ThreadPool &pool) const;
+
+  // Writes the image to `cache_path`, stamped with the size and mtime of
+  // `source` (the msgpack file it was built from). Returns false if the file
+  // cannot be written.
+  bool SaveCache(const std::filesystem::path &cache_path,
+                 const std::filesystem::path &source) const;
+  // nullptr if `cache_path` does not exist, is corrupted or was built from
+  // another version of `source`
+  static std::shared_ptr<NormalTokenizer>
+  LoadCache(const std::filesystem::path &cache_path,
+            const std::filesystem::path &source);
 
 private:
-  std::unordered_map<std::string, int> _word2idx;
-  std::unordered_map<int, std::string> _idx2word;
-  std::unique_ptr<TrieTree> _tree;
+  struct Word {
+    uint32_t offset;
+    uint32_t length;
+  };
+  struct CacheHeader;
+
+  NormalTokenizer(std::shared_ptr<const char> image, size_t image_size);
+  void Build(const std::unordered_map<int, std::string> &idx2word,
+             const std::string &normalizer, const std::string &pre_tokenizer);
+  void Attach(std::shared_ptr<const char> image, size_t image_size);
+  // `str` itself, or a normalized copy of it in `buf`
+  std::string_view Normalize(std::string_view str, std::string *buf) const;
+  // the id of `word` by _word_table, -1 if it is not in the vocabulary
+  int FindWord(std::string_view word) const;
+  // Appends the greedy encoding of str[begin, ...) to `ids` and the start of
+  // every token to `starts`, until a token ends at or after `end`. Returns
+  // the position after the last token.
+  size_t EncodeGreedy(std::string_view str, size_t begin, size_t end,
+                      std::vector<int> *ids,
+                      std::vector<size_t> *starts) const;
+
+  std::shared_ptr<const char> _image;
+  size_t _image_size = 0;
+  std::unique_ptr<TokenTrie> _trie;
+  const Word *_words = nullptr;
+  size_t _num_words = 0;
+  const char *_pool = nullptr;
+  // For WhitespaceSplit, an open-addressing hash table of the ids of all
+  // words (-1 for an empty bucket), so that a piece is looked up by one
+  // hash instead of a trie walk.
+  std::vector<int32_t> _word_table;
   std::string _normalizer;
   std::string _pre_tokenizer;
 };
@@ -70,6 +187,32 @@ public:
   std::vector<int> encode(std::string_view str) const;
   std::string decode(const std::vector<int> &ids) const;
   std::string decode(int id) const;
+  std::string_view decode_view(int id) const;
+};
+
+// Turns a stream of tokens into text in whole UTF-8 code points. The bytes
+// of a code point split across tokens are held back until the token that
+// completes it, so every piece of output is valid UTF-8 on its own.
+class StreamDecoder {
+public:
+  StreamDecoder() = default;
+  explicit StreamDecoder(const Tokenizer &tokenizer) : _tokenizer(&tokenizer) {}
+  // The text completed by token `id` (possibly empty), valid until the next
+  // call. Needs the tokenizer of the constructor.
+  std::string_view Put(int id);
+  // the same, given the bytes of the token
+  std::string_view Put(std::string_view bytes);
+  // the held back bytes of an incomplete code point, e.g. at the end of the
+  // stream. Resets the decoder.
+  std::string Flush();
+  void Reset();
+
+private:
+  const Tokenizer *_tokenizer = nullptr;
+  // _buffer[0, _num_emitted) is the output of the last Put, the rest is
+  // held back
+  std::string _buffer;
+  size_t _num_emitted = 0;
 };
 
 } // namespace rwkv
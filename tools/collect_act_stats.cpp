@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <kernels/export-ncnn/kernels.h>
+#include <kernels/ncnn/extra.h>
+#include <model.h>
+#include <tokenizer.h>
+#include <utils.h>
+
+// Runs a text through a model and saves the mean of x^2 of every input
+// channel of its matmuls, for `export_ncnn <...> int4 0 <act stats path>`.
+int main(int argc, char **argv) {
+  if (argc < 5 || argc > 6) {
+    std::cerr << "Usage: ./collect_act_stats <input path> <tokenizer path> "
+                 "<text path> <output path> [<max tokens>]"
+              << std::endl;
+    return 1;
+  }
+  const std::string calib_prefix = std::string(argv[4]) + ".calib";
+  rwkv::ncnnmeta::ExportCalibrationModel(argv[1], calib_prefix);
+
+  rwkv::Tokenizer tokenizer(argv[2]);
+  auto ids = tokenizer.encode(read_file(argv[3]));
+  if (argc == 6) {
+    ids.resize(std::min<size_t>(ids.size(), std::stoi(argv[5])));
+  }
+  RV_CHECK(!ids.empty()) << "the text is empty";
+
+  {
+    rwkv::Model model(calib_prefix, "ncnn fp16");
+    constexpr int kChunkSize = 256;
+    for (size_t i = 0; i < ids.size(); i += kChunkSize) {
+      std::cout << "Running tokens " << i << "/" << ids.size() << std::endl;
+      model.Run(std::vector<int>(
+          ids.begin() + i,
+          ids.begin() + std::min(ids.size(), i + kChunkSize)));
+    }
+
+    auto &extra =
+        *std::any_cast<std::shared_ptr<NcnnExtra>>(model.extra());
+    RV_CHECK(static_cast<size_t>(extra.num_act_samples) == ids.size());
+    rwkv::ncnnmeta::ActStats stats;
+    for (const auto &[name, sum_squares] : extra.act_sum_squares) {
+      auto &mean_squares = stats[name];
+      for (double x : sum_squares) {
+        mean_squares.push_back(x / extra.num_act_samples);
+      }
+    }
+    std::ofstream ofs(argv[4], std::ios::binary);
+    msgpack::pack(ofs, stats);
+    std::cout << "Saved the statistics of " << stats.size() << " weights to "
+              << argv[4] << std::endl;
+  }
+
+  for (const auto &suffix : {".bin", ".param", ".config"}) {
+    std::remove((calib_prefix + suffix).c_str());
+  }
+  return 0;
+}
@@ -1,19 +1,22 @@
 #include <fstream>
 #include <iostream>
+#include <string>
 
 #include <kernels/export-ncnn/kernels.h>
 
 int main(int argc, char **argv) {
-  if (argc != 3 && argc != 4) {
+  if (argc < 3 || argc > 7) {
     std::cerr
-        << "Usage: ./export_ncnn <input path> <output prefix> [<weight_dtype>]"
+        << "Usage: ./export_ncnn <input path> <output prefix> [<weight_dtype>] "
+           "[<seq_len>] [<act stats path>] [<quant plan path>]"
         << std::endl;
     return 1;
   }
   if (std::ifstream ifs(argv[1]); !ifs.good()) {
     std::cerr << "Failed to open " << argv[1] << std::endl;
     std::cerr
-        << "Usage: ./export_ncnn <input path> <output prefix> [<weight_dtype>]"
+        << "Usage: ./export_ncnn <input path> <output prefix> [<weight_dtype>] "
+           "[<seq_len>] [<act stats path>] [<quant plan path>]"
         << std::endl;
     return 1;
   }
@@ -38,6 +41,22 @@ int main(int argc, char **argv) {
                          << weight_dtype_str << ".";
     }
   }
-  rwkv::ncnnmeta::ExportModel(argv[1], weight_dtype, argv[2]);
+  // e.g. 16 also exports a graph which runs 16 prompt tokens at once
+  int seq_len = 0;
+  if (argc >= 5) {
+    seq_len = std::stoi(argv[4]);
+  }
+  // generated by collect_act_stats, for better int4/int8 scales
+  std::string act_stats_path;
+  if (argc >= 6) {
+    act_stats_path = argv[5];
+  }
+  // the dtypes of some weights, e.g. "head.weight fp16", see quant_plan.h
+  std::string quant_plan_path;
+  if (argc == 7) {
+    quant_plan_path = argv[6];
+  }
+  rwkv::ncnnmeta::ExportModel(argv[1], weight_dtype, argv[2], seq_len,
+                              act_stats_path, quant_plan_path);
   return 0;
 }
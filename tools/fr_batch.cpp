@@ -0,0 +1,539 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <check.h>
+#include <kernels/kernels.h>
+#include <model.h>
+#include <sampler.h>
+#include <stop_matcher.h>
+#include <thread_pool.h>
+#include <tokenizer.h>
+
+// Generates a response for every line of a JSONL file, e.g. {"prompt": "...",
+// "max_tokens": 200, "top_p": 0.3, "stop": ["\n\n"]} (see Request), decoding
+// up to [max_batch] requests in lockstep and writing each result when done.
+
+namespace {
+
+struct JsonValue {
+  bool is_string;
+  // the string, or the text of a number, boolean or null
+  std::string value;
+  bool is_array = false;
+  // the elements of an array, which can only hold strings
+  std::vector<std::string> strings;
+};
+
+using JsonObject = std::map<std::string, JsonValue>;
+
+// e.g. -1.5e3, but not NaN or 0x10
+bool IsJsonNumber(const std::string &str) {
+  size_t i = 0;
+  auto digits = [&]() {
+    const size_t start = i;
+    while (i < str.size() && std::isdigit(static_cast<unsigned char>(str[i]))) {
+      i++;
+    }
+    return i > start;
+  };
+  if (i < str.size() && str[i] == '-') {
+    i++;
+  }
+  if (!digits()) {
+    return false;
+  }
+  if (i < str.size() && str[i] == '.') {
+    i++;
+    if (!digits()) {
+      return false;
+    }
+  }
+  if (i < str.size() && (str[i] == 'e' || str[i] == 'E')) {
+    i++;
+    if (i < str.size() && (str[i] == '+' || str[i] == '-')) {
+      i++;
+    }
+    if (!digits()) {
+      return false;
+    }
+  }
+  return i == str.size();
+}
+
+void AppendUtf8(std::string &out, uint32_t cp) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
+
+// A parser of flat JSON objects whose values are strings, numbers, booleans,
+// null or arrays of strings, which is all the request format needs.
+class JsonParser {
+public:
+  explicit JsonParser(const std::string &str) : _str(str) {}
+
+  JsonObject ParseObject() {
+    JsonObject obj;
+    Expect('{');
+    SkipSpaces();
+    if (Peek() == '}') {
+      _pos++;
+      return obj;
+    }
+    while (true) {
+      SkipSpaces();
+      auto key = ParseString();
+      Expect(':');
+      SkipSpaces();
+      if (Peek() == '"') {
+        obj[key] = {true, ParseString(), false, {}};
+      } else if (Peek() == '[') {
+        obj[key] = ParseStringArray();
+      } else {
+        auto start = _pos;
+        while (_pos < _str.size() && _str[_pos] != ',' && _str[_pos] != '}' &&
+               !std::isspace(static_cast<unsigned char>(_str[_pos]))) {
+          _pos++;
+        }
+        RV_CHECK(_pos > start) << "missing value of \"" << key << "\"";
+        obj[key] = {false, _str.substr(start, _pos - start), false, {}};
+      }
+      SkipSpaces();
+      if (Peek() == ',') {
+        _pos++;
+        continue;
+      }
+      Expect('}');
+      return obj;
+    }
+  }
+
+private:
+  char Peek() const {
+    RV_CHECK(_pos < _str.size()) << "unexpected end of line";
+    return _str[_pos];
+  }
+
+  void SkipSpaces() {
+    while (_pos < _str.size() &&
+           std::isspace(static_cast<unsigned char>(_str[_pos]))) {
+      _pos++;
+    }
+  }
+
+  void Expect(char c) {
+    SkipSpaces();
+    RV_CHECK(Peek() == c) << "expected '" << c << "' at column " << _pos;
+    _pos++;
+  }
+
+  JsonValue ParseStringArray() {
+    JsonValue value{false, "", true, {}};
+    Expect('[');
+    SkipSpaces();
+    if (Peek() == ']') {
+      _pos++;
+      return value;
+    }
+    while (true) {
+      SkipSpaces();
+      RV_CHECK(Peek() == '"') << "arrays can only hold strings";
+      value.strings.push_back(ParseString());
+      SkipSpaces();
+      if (Peek() == ',') {
+        _pos++;
+        continue;
+      }
+      Expect(']');
+      return value;
+    }
+  }
+
+  uint32_t ParseHex4() {
+    RV_CHECK(_pos + 4 <= _str.size()) << "invalid \\u escape";
+    auto cp = static_cast<uint32_t>(std::stoul(_str.substr(_pos, 4), nullptr, 16));
+    _pos += 4;
+    return cp;
+  }
+
+  std::string ParseString() {
+    Expect('"');
+    std::string out;
+    while (true) {
+      char c = Peek();
+      _pos++;
+      if (c == '"') {
+        return out;
+      }
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      c = Peek();
+      _pos++;
+      switch (c) {
+      case 'n': out += '\n'; break;
+      case 't': out += '\t'; break;
+      case 'r': out += '\r'; break;
+      case 'b': out += '\b'; break;
+      case 'f': out += '\f'; break;
+      case 'u': {
+        uint32_t cp = ParseHex4();
+        // surrogate pair
+        if (cp >= 0xD800 && cp < 0xDC00 && _pos + 6 <= _str.size() &&
+            _str[_pos] == '\\' && _str[_pos + 1] == 'u') {
+          _pos += 2;
+          uint32_t low = ParseHex4();
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        }
+        AppendUtf8(out, cp);
+        break;
+      }
+      default: out += c; break;
+      }
+    }
+  }
+
+  const std::string &_str;
+  size_t _pos = 0;
+};
+
+std::string JsonEscape(const std::string &str) {
+  std::string out;
+  out.reserve(str.size() + 2);
+  out += '"';
+  for (unsigned char c : str) {
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+  return out;
+}
+
+struct Request {
+  // the "id" field as it appears in the input (already JSON), or the line
+  // number
+  std::string id;
+  std::string prompt;
+  int max_tokens = 200;
+  float temperature = 1.f;
+  int top_k = 0;
+  float top_p = 0.3f;
+  float presence_penalty = 0.f;
+  float frequency_penalty = 0.f;
+  float penalty_decay = 1.f;
+  int seed = -1;
+  std::vector<std::string> stop;
+};
+
+Request ParseRequest(const std::string &line, int line_no) {
+  auto obj = JsonParser(line).ParseObject();
+  Request req;
+  RV_CHECK(obj.count("prompt") && obj["prompt"].is_string)
+      << "\"prompt\" is missing";
+  req.prompt = obj["prompt"].value;
+  if (obj.count("id")) {
+    const auto &id = obj["id"];
+    RV_CHECK(id.is_string || (!id.is_array && IsJsonNumber(id.value)))
+        << "\"id\" should be a string or a number";
+    req.id = id.is_string ? JsonEscape(id.value) : id.value;
+  } else {
+    req.id = std::to_string(line_no);
+  }
+  auto get = [&](const std::string &key, auto &field) {
+    if (obj.count(key)) {
+      const auto &value = obj[key];
+      std::stringstream ss(value.value);
+      // e.g. 1.5 for an integer leaves ".5" unread
+      RV_CHECK(!value.is_string && !value.is_array &&
+               IsJsonNumber(value.value) && (ss >> field) && ss.eof())
+          << "\"" << key << "\" should be a number of its type, but got "
+          << value.value;
+    }
+  };
+  get("max_tokens", req.max_tokens);
+  get("temperature", req.temperature);
+  get("top_k", req.top_k);
+  get("top_p", req.top_p);
+  get("presence_penalty", req.presence_penalty);
+  get("frequency_penalty", req.frequency_penalty);
+  get("penalty_decay", req.penalty_decay);
+  get("seed", req.seed);
+  if (obj.count("stop")) {
+    const auto &stop = obj["stop"];
+    RV_CHECK(stop.is_string || stop.is_array)
+        << "\"stop\" should be a string or an array of strings";
+    req.stop = stop.is_string ? std::vector<std::string>{stop.value}
+                              : stop.strings;
+    // "" means no stop string
+    req.stop.erase(std::remove(req.stop.begin(), req.stop.end(), ""),
+                   req.stop.end());
+  }
+  return req;
+}
+
+// a request being decoded
+struct Job {
+  Job(int line, Request request, const rwkv::Model &model,
+      const rwkv::Tokenizer &tokenizer)
+      : line(line), req(std::move(request)), session(model),
+        decoder(tokenizer), stop_matcher(req.stop) {}
+
+  int line;
+  Request req;
+  rwkv::Session session;
+  rwkv::PenaltyState penalties;
+  // a stop string may end in the middle of a token, the text after it is
+  // dropped
+  rwkv::StreamDecoder decoder;
+  rwkv::StopMatcher stop_matcher;
+  // of the next token, on CPU
+  std::optional<rwkv::Tensor> logits;
+  int next_id = -1;
+  int num_prompt_tokens = 0;
+  int num_new_tokens = 0;
+  std::string response;
+  std::string finish_reason;
+  std::string error;
+  std::chrono::steady_clock::time_point start;
+};
+
+std::string ErrorLine(int line, const std::string &what) {
+  return "{\"line\": " + std::to_string(line) +
+         ", \"error\": " + JsonEscape(what) + "}";
+}
+
+// Puts the sampled `next_id` into the response, and sets `finish_reason` if
+// the job is done.
+void Accept(Job &job, int eos_token_id) {
+  job.penalties.Accept(job.next_id);
+  job.num_new_tokens++;
+  if (job.next_id == eos_token_id) {
+    job.finish_reason = "eos";
+  } else {
+    auto put_result = job.stop_matcher.Put(job.decoder.Put(job.next_id));
+    job.response += put_result.text;
+    if (put_result.stopped()) {
+      job.finish_reason = "stop";
+    } else if (job.num_new_tokens >= job.req.max_tokens) {
+      job.finish_reason = "length";
+    }
+  }
+  if (job.finish_reason.empty() || job.stop_matcher.stopped()) {
+    return;
+  }
+  // the bytes of an incomplete code point, they may complete a stop string
+  // too
+  auto flush_result = job.stop_matcher.Put(job.decoder.Flush());
+  job.response += flush_result.text;
+  if (flush_result.stopped()) {
+    job.finish_reason = "stop";
+  } else {
+    job.response += job.stop_matcher.Flush();
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 6 || argc > 8) {
+    std::cerr << "Usage: " << argv[0]
+              << " [vocab] [model] [strategy] [input.jsonl] [output.jsonl] "
+                 "[num_threads (default: number of cores)] "
+                 "[max_batch (default: 64)]\n";
+    return 1;
+  }
+
+  rwkv::Tokenizer tokenizer(argv[1]);
+  rwkv::Model model(argv[2], argv[3]);
+  std::ifstream input_file(argv[4]);
+  RV_CHECK(input_file.good()) << "Unable to open " << argv[4];
+  std::ofstream output_file(argv[5]);
+  RV_CHECK(output_file.good()) << "Unable to open " << argv[5];
+  rwkv::ThreadPool pool(argc >= 7 ? std::stoi(argv[6]) : 0);
+  const int max_batch = argc == 8 ? std::stoi(argv[7]) : 64;
+  RV_CHECK(max_batch > 0) << "max_batch should be > 0";
+
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(input_file, line);) {
+    if (line.find_first_not_of(" \t\r") != std::string::npos) {
+      lines.push_back(line);
+    }
+  }
+  std::cout << "Requests num: " << lines.size()
+            << ", threads num: " << pool.num_threads()
+            << ", max batch: " << max_batch << std::endl;
+
+  // requests without "seed" draw from this seed with their line as stream,
+  // seeded requests use stream 0 so that their output only depends on the
+  // seed
+  const uint64_t base_seed = std::random_device()();
+  rwkv::Sampler sampler;
+  int64_t total_prompt_tokens = 0;
+  int64_t total_new_tokens = 0;
+  int num_failed = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::unique_ptr<Job>> jobs;
+  size_t next_line = 0;
+  while (next_line < lines.size() || !jobs.empty()) {
+    // prefill the new requests, in parallel as their tokenization and
+    // sessions are independent
+    const size_t num_new =
+        std::min(lines.size() - next_line, max_batch - jobs.size());
+    std::vector<std::unique_ptr<Job>> new_jobs(num_new);
+    std::vector<std::string> new_errors(num_new);
+    pool.ParallelFor(num_new, [&](int i) {
+      const int line = next_line + i;
+      try {
+        auto job = std::make_unique<Job>(line, ParseRequest(lines[line], line),
+                                         model, tokenizer);
+        job->start = std::chrono::steady_clock::now();
+        auto prompt_ids = tokenizer.encode(job->req.prompt);
+        RV_CHECK(!prompt_ids.empty()) << "empty prompt";
+        job->num_prompt_tokens = prompt_ids.size();
+        if (job->req.max_tokens > 0) {
+          job->logits = Copy(model.Run(job->session, prompt_ids),
+                             rwkv::Device::kCPU);
+        } else {
+          job->finish_reason = "length";
+        }
+        new_jobs[i] = std::move(job);
+      } catch (std::exception &e) {
+        new_errors[i] = e.what();
+      }
+    });
+    for (size_t i = 0; i < num_new; i++) {
+      if (new_jobs[i]) {
+        jobs.push_back(std::move(new_jobs[i]));
+      } else {
+        num_failed++;
+        output_file << ErrorLine(next_line + i, new_errors[i]) << std::endl;
+      }
+    }
+    next_line += num_new;
+
+    // sample the next token of every job at once
+    std::vector<Job *> decoding;
+    for (auto &job : jobs) {
+      if (job->finish_reason.empty()) {
+        decoding.push_back(job.get());
+      }
+    }
+    if (!decoding.empty()) {
+      const int batch_size = decoding.size();
+      const int n_vocab = decoding[0]->logits->numel();
+      auto logits = rwkv::Tensor::Empty({batch_size, n_vocab},
+                                        rwkv::DType::kFloat32,
+                                        rwkv::Device::kCPU);
+      std::vector<rwkv::SampleParams> params(batch_size);
+      std::vector<rwkv::SampleKey> keys(batch_size);
+      for (int i = 0; i < batch_size; i++) {
+        const Request &req = decoding[i]->req;
+        float *row = logits.data_ptr<float>() + i * n_vocab;
+        std::copy_n(decoding[i]->logits->data_ptr<float>(), n_vocab, row);
+        decoding[i]->penalties.Apply(row, n_vocab, req.presence_penalty,
+                                     req.frequency_penalty, req.penalty_decay);
+        params[i] = {req.temperature, req.top_k, req.top_p};
+        keys[i] = {req.seed >= 0 ? static_cast<uint64_t>(req.seed) : base_seed,
+                   req.seed >= 0 ? 0 : static_cast<uint64_t>(decoding[i]->line),
+                   static_cast<uint64_t>(decoding[i]->num_new_tokens)};
+      }
+      auto ids = sampler.SampleBatch(logits, params, keys, &pool);
+      std::vector<Job *> running;
+      for (int i = 0; i < batch_size; i++) {
+        decoding[i]->next_id = ids[i];
+        Accept(*decoding[i], tokenizer.eos_token_id());
+        if (decoding[i]->finish_reason.empty()) {
+          running.push_back(decoding[i]);
+        }
+      }
+      pool.ParallelFor(running.size(), [&](int i) {
+        try {
+          running[i]->logits =
+              Copy(model.Run(running[i]->session, {running[i]->next_id}),
+                   rwkv::Device::kCPU);
+        } catch (std::exception &e) {
+          running[i]->error = e.what();
+        }
+      });
+    }
+
+    // write the jobs which are done
+    auto done = std::stable_partition(
+        jobs.begin(), jobs.end(), [](const std::unique_ptr<Job> &job) {
+          return job->finish_reason.empty() && job->error.empty();
+        });
+    for (auto it = done; it != jobs.end(); ++it) {
+      const Job &job = **it;
+      if (!job.error.empty()) {
+        num_failed++;
+        output_file << ErrorLine(job.line, job.error) << std::endl;
+        continue;
+      }
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - job.start)
+                    .count();
+      total_prompt_tokens += job.num_prompt_tokens;
+      total_new_tokens += job.num_new_tokens;
+      output_file << "{\"id\": " << job.req.id
+                  << ", \"output\": " << JsonEscape(job.response)
+                  << ", \"finish_reason\": \"" << job.finish_reason
+                  << "\", \"prompt_tokens\": " << job.num_prompt_tokens
+                  << ", \"completion_tokens\": " << job.num_new_tokens
+                  << ", \"time_ms\": " << ms << "}" << std::endl;
+    }
+    jobs.erase(done, jobs.end());
+  }
+
+  auto total_ms = std::max<int64_t>(
+      1, std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+             .count());
+  const int64_t total_tokens = total_prompt_tokens + total_new_tokens;
+  std::cout << "Failed num: " << num_failed << std::endl;
+  std::cout << "Prompt tokens: " << total_prompt_tokens
+            << ", generated tokens: " << total_new_tokens << std::endl;
+  std::cout << "Total time: " << total_ms << "ms" << std::endl;
+  std::cout << std::fixed << std::setprecision(2)
+            << "Tokens per second: " << 1000. * total_tokens / total_ms
+            << " (generated: " << 1000. * total_new_tokens / total_ms << ")"
+            << std::endl;
+  return num_failed == 0 ? 0 : 1;
+}